@@ -10,6 +10,8 @@
 #include <SimDataFormats/TrackingAnalysis/interface/TrackingParticle.h>
 #include "SimTracker/TrackAssociation/interface/ParametersDefinerForTP.h"
 
+class TrackerGeometry;
+
 class CosmicParametersDefinerForTP : public ParametersDefinerForTP {
 
  public:
@@ -19,6 +21,20 @@ class CosmicParametersDefinerForTP : public ParametersDefinerForTP {
   virtual ParticleBase::Vector momentum(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticle& tp) const;
   virtual ParticleBase::Point vertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticle& tp) const;
 
+  virtual void momentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticleCollection& tPC,
+				 std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const;
+  virtual void momentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticleRefVector& tPC,
+				 std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const;
+
+ private:
+  /// Global position and momentum of the tracker simhit of the particle closest to the beam line;
+  /// false if the particle has no tracker simhit.
+  static bool closestHit(const TrackingParticle& tp, const TrackerGeometry& tracker, GlobalPoint& position, GlobalVector& momentum);
+  /// momentumAndVertex for a TrackingParticleCollection or a TrackingParticleRefVector
+  template <typename Collection>
+  void fillMomentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const Collection& tPC,
+			     std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const;
+
 };
 
 
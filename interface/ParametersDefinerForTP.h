@@ -8,10 +8,18 @@
  */
 
 #include <SimDataFormats/TrackingAnalysis/interface/TrackingParticle.h>
+#include "SimDataFormats/TrackingAnalysis/interface/TrackingParticleFwd.h"
 #include "DataFormats/Candidate/interface/Candidate.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/Framework/interface/ESHandle.h"      
 #include "FWCore/Framework/interface/EventSetup.h"
+#include "DataFormats/GeometryVector/interface/GlobalVector.h"
+#include "DataFormats/GeometryVector/interface/GlobalPoint.h"
+
+#include <vector>
+
+class MagneticField;
+namespace reco { class BeamSpot; }
 
 class ParametersDefinerForTP {
 
@@ -29,6 +37,27 @@ class ParametersDefinerForTP {
     return vertex(iEvent, iSetup, ParticleBase(tp.charge(),tp.p4(),tp.vertex()));
   }
 
+  /// Momentum and vertex of all the TrackingParticles of the collection, in its order, as given one by one by
+  /// momentum() and vertex(): the magnetic field and the beam spot are looked up once, and every particle is
+  /// propagated once to the beam line for both.
+  virtual void momentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticleCollection& tPC,
+				 std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const;
+  virtual void momentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticleRefVector& tPC,
+				 std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const;
+
+ protected:
+  /// Momentum and vertex (relative to the beam spot) at the point of closest approach to the beam line of the
+  /// state at (position, momentum); both stay (0,0,0) if the propagation fails.
+  static void momentumAndVertexAtPCA(const GlobalPoint& position, const GlobalVector& momentum, int charge,
+				     const MagneticField& field, const reco::BeamSpot& bs,
+				     ParticleBase::Vector& momentumAtPCA, ParticleBase::Point& vertexAtPCA);
+
+ private:
+  /// momentumAndVertex for a TrackingParticleCollection or a TrackingParticleRefVector
+  template <typename Collection>
+  void fillMomentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const Collection& tPC,
+			     std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const;
+
 };
 
 
@@ -2,10 +2,10 @@
 #define QuickTrackAssociatorByHits_h
 
 #include "SimTracker/TrackAssociation/interface/TrackAssociatorBase.h"
+#include "SimTracker/TrackAssociation/interface/SimTrackToTrackingParticleIndex.h"
+#include "SimTracker/TrackAssociation/interface/RecHitSimTrackIdFinder.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
-
-// Forward declarations
-class TrackerHitAssociator;
+#include "FWCore/Utilities/interface/InputTag.h"
 
 /** @brief TrackAssociator that associates by hits a bit quicker than the normal TrackAssociatorByHits class.
  *
@@ -39,6 +39,14 @@ class TrackerHitAssociator;
  *
  * associateStrip - bool - Passed on to the hit associator.
  *
+ * recHitSimTrackIdMap - InputTag - A RecHitSimTrackIdMap with the sim track identifiers of the hits, made once per event
+ * for all the track collections. Hits that are not in it (or every hit if the product is missing) go through the hit associator.
+ * An empty label disables it.
+ *
+ * parallelTrackLoop - bool - If true, the tracks that have all their hits in the RecHitSimTrackIdMap are associated in a
+ * tbb::parallel_for, in whatever task arena the caller runs in. The other tracks, and every track when there is no map, are
+ * done serially. The results are the same either way.
+ *
  *
  * Note that the TrackAssociatorByHits parameters UseGrouped and UseSplitting are not used.
  *
@@ -51,8 +59,6 @@ class QuickTrackAssociatorByHits : public TrackAssociatorBase
 public:
 	QuickTrackAssociatorByHits( const edm::ParameterSet& config );
 	~QuickTrackAssociatorByHits();
-	QuickTrackAssociatorByHits( const QuickTrackAssociatorByHits& otherAssociator );
-	QuickTrackAssociatorByHits& operator=( const QuickTrackAssociatorByHits& otherAssociator );
 	reco::RecoToSimCollection associateRecoToSim( edm::Handle<edm::View<reco::Track> >& trackCollectionHandle,
 	                                              edm::Handle<TrackingParticleCollection>& trackingParticleCollectionHandle,
 	                                              const edm::Event* pEvent=0,
@@ -70,6 +76,19 @@ public:
 												  const edm::Event* pEvent=0,
 												  const edm::EventSetup* pSetup=0 ) const;
 
+	void associateBoth( edm::Handle<edm::View<reco::Track> >& trackCollectionHandle,
+	                    edm::Handle<TrackingParticleCollection>& trackingParticleCollectionHandle,
+	                    const edm::Event* pEvent,
+	                    const edm::EventSetup* pSetup,
+	                    reco::RecoToSimCollection& recoToSim,
+	                    reco::SimToRecoCollection& simToReco ) const;
+	void associateBoth( const edm::RefToBaseVector<reco::Track>& trackCollection,
+	                    const edm::RefVector<TrackingParticleCollection>& trackingParticleCollection,
+	                    const edm::Event* pEvent,
+	                    const edm::EventSetup* pSetup,
+	                    reco::RecoToSimCollection& recoToSim,
+	                    reco::SimToRecoCollection& simToReco ) const;
+
 	//seed
 	reco::RecoToSimCollectionSeed associateRecoToSim(edm::Handle<edm::View<TrajectorySeed> >&,
 							 edm::Handle<TrackingParticleCollection>&,
@@ -85,26 +104,61 @@ private:
 	typedef std::pair<uint32_t,EncodedEventId> SimTrackIdentifiers;
 	enum SimToRecoDenomType {denomnone,denomsim,denomreco};
 
-	/** @brief The method that does the work for both overloads of associateRecoToSim.
+	/** @brief Everything that is specific to one call of the associate methods.
+	 *
+	 * This is created on the stack by each of the public methods and passed down, so that the associator itself is never
+	 * modified and one instance can be used for several events at the same time. The hit associator is only built if a hit
+	 * isn't in the RecHitSimTrackIdMap, and it's never copied, so the context can't be copied either. The parallel track loop
+	 * shares the context between the threads and only uses its const map lookup.
+	 *
+	 * Only one of pTrackCollectionHandle or pTrackCollection will ever be non Null, and the same for the TrackingParticle
+	 * pointers. This is so that both flavours of the associate methods (one takes Handles, the other a RefToBaseVector and
+	 * RefVector) can use the same associateImplementation method and keep the logic for both in one place, without copying
+	 * the Handle collections into new RefToBaseVectors.
 	 */
-	reco::RecoToSimCollection associateRecoToSimImplementation() const;
-
-	/** @brief The method that does the work for both overloads of associateSimToReco.
+	struct Context
+	{
+		Context( const edm::Event& event, const edm::ParameterSet& hitAssociatorParameters, const edm::InputTag& recHitSimTrackIdMapTag );
+
+		/** @brief Fills simTrackIdentifiers for the hit, from the RecHitSimTrackIdMap if there is one and it has the hit, otherwise from the hit associator. */
+		void associateHitId( const TrackingRecHit& hit, std::vector<SimTrackIdentifiers>& simTrackIdentifiers );
+
+		/** @brief Takes the hit ids from the map of the event if there is one, and builds the hit associator for the others. */
+		RecHitSimTrackIdFinder simTrackIdFinder;
+
+		const edm::Handle<edm::View<reco::Track> >* pTrackCollectionHandle;
+		const edm::RefToBaseVector<reco::Track>* pTrackCollection;
+		const edm::Handle<TrackingParticleCollection>* pTrackingParticleCollectionHandle;
+		const edm::RefVector<TrackingParticleCollection>* pTrackingParticleCollection;
+	private:
+		Context( const Context& );
+		Context& operator=( const Context& );
+	};
+
+	/** @brief The method that does the work for both overloads of associateRecoToSim, associateSimToReco and associateBoth.
+	 *
+	 * Each track is associated to the TrackingParticles only once, and the shared hit counts are used to fill whichever
+	 * of pRecoToSim and pSimToReco is not Null.
 	 */
-	reco::SimToRecoCollection associateSimToRecoImplementation() const;
+	void associateImplementation( Context& context, reco::RecoToSimCollection* pRecoToSim, reco::SimToRecoCollection* pSimToReco ) const;
 
 	/** @brief Returns the TrackingParticle that has the most associated hits to the given track.
 	 *
 	 * Return value is a vector of pairs, where first is an edm::Ref to the associated TrackingParticle, and second is
-	 * the number of associated hits.
+	 * the number of associated hits. The pairs are in the order of the TrackingParticle collection. The sim track identifiers
+	 * of the hits come from hitIdLookup, which is either the context or a lookup in the RecHitSimTrackIdMap only.
 	 */
-	template<typename iter> std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > associateTrack( iter begin, iter end ) const;
+	template<typename iter, typename HitIdLookup> std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > associateTrack( const Context& context, HitIdLookup& hitIdLookup, const SimTrackToTrackingParticleIndex& trackingParticleIndex, iter begin, iter end ) const;
 
-	/** @brief Returns true if the supplied TrackingParticle has the supplied g4 track identifiers. */
-	bool trackingParticleContainsIdentifier( const TrackingParticle* pTrackingParticle, const SimTrackIdentifiers& identifier ) const;
+	/** @brief Fills the index from g4 track identifiers to the position of the TrackingParticles in the current collection.
+	 *
+	 * Called once per call to the associate methods so that associateTrack only has to look up the identifiers of the track
+	 * hits, rather than check every TrackingParticle for every track. TrackingParticles with no hits are left out.
+	 */
+	void fillTrackingParticleIndex( const Context& context, SimTrackToTrackingParticleIndex& trackingParticleIndex ) const;
 
 	/** @brief This method was copied almost verbatim from the standard TrackAssociatorByHits. */
-	template<typename iter> int getDoubleCount( iter begin, iter end, const TrackingParticle& associatedTrackingParticle ) const;
+	template<typename iter> int getDoubleCount( Context& context, iter begin, iter end, const TrackingParticle& associatedTrackingParticle ) const;
 
 	/** @brief Returns a vector of pairs where first is a SimTrackIdentifiers (see typedef above) and second is the number of hits that came from that sim track.
 	 *
@@ -112,7 +166,7 @@ private:
 	 * E.g. If all the hits in the reco track come from the same sim track, then there will only be one entry with second as the number of hits in
 	 * the track.
 	 */
-	template<typename iter> std::vector< std::pair<SimTrackIdentifiers,size_t> > getAllSimTrackIdentifiers( iter begin, iter end ) const;
+	template<typename iter, typename HitIdLookup> std::vector< std::pair<SimTrackIdentifiers,size_t> > getAllSimTrackIdentifiers( HitIdLookup& hitIdLookup, iter begin, iter end ) const;
 
 	const TrackingRecHit* getHitFromIter(trackingRecHit_iterator iter) const {
 	  return &(**iter);
@@ -123,52 +177,18 @@ private:
 	}
 
 	//
-	// Members. Note that there are custom copy constructor and assignment operators, so if any members are added
-	// those methods will need to be updated.
+	// Members. These are only the configuration, all the per call state is in Context.
 	//
-	mutable TrackerHitAssociator* pHitAssociator_;
-	const mutable edm::Event* pEventForWhichAssociatorIsValid_;
-	void initialiseHitAssociator( const edm::Event* event ) const;
-
 	edm::ParameterSet hitAssociatorParameters_;
+	edm::InputTag recHitSimTrackIdMapTag_;
 
 	bool absoluteNumberOfHits_;
 	double qualitySimToReco_;
 	double puritySimToReco_;
 	double cutRecoToSim_;
 	bool threeHitTracksAreSpecial_;
+	bool parallelTrackLoop_;
 	SimToRecoDenomType simToRecoDenominator_;
-
-	/** @brief Pointer to the handle to the track collection.
-	 *
-	 * Only one of pTrackCollectionHandle_ or pTrackCollection_ will ever be non Null. This is so that both flavours of the
-	 * associateRecoToSim (one takes a Handle, the other a RefToBaseVector) can use the same associateRecoToSimImplementation
-	 * method and keep the logic for both in one place.  The old implementation for the handle flavour copied everything into
-	 * a new RefToBaseVector, wasting memory.  I tried to do something clever with templates but couldn't get it to work, so
-	 * the associateRecoToSimImplementation method checks which is non Null and uses that to get the tracks.
-	 */
-	mutable edm::Handle<edm::View<reco::Track> >* pTrackCollectionHandle_;
-
-	/** @brief Pointer to the track collection.
-	 *
-	 * Either this or pTrackCollectionHandle_ will be set, the other will be Null. See the comment on pTrackCollectionHandle_
-	 * for reasons why.
-	 */
-	mutable const edm::RefToBaseVector<reco::Track>* pTrackCollection_;
-
-	/** @brief Pointer to the TrackingParticle collection handle
-	 *
-	 * Either this or pTrackingParticleCollection_ will be set, the other will be Null. See the comment on pTrackCollectionHandle_
-	 * for reasons why.
-	 */
-	mutable edm::Handle<TrackingParticleCollection>* pTrackingParticleCollectionHandle_;
-
-	/** @brief Pointer to the TrackingParticle collection handle
-	 *
-	 * Either this or pTrackingParticleCollectionHandle_ will be set, the other will be Null. See the comment on pTrackCollectionHandle_
-	 * for reasons why.
-	 */
-	mutable const edm::RefVector<TrackingParticleCollection>* pTrackingParticleCollection_;
 }; // end of the QuickTrackAssociatorByHits class
 
 #endif // end of ifndef QuickTrackAssociatorByHits_h
@@ -0,0 +1,57 @@
+#ifndef RecHitSimTrackIdFinder_h
+#define RecHitSimTrackIdFinder_h
+
+/** \class RecHitSimTrackIdFinder
+ *  SimTrack identifiers of the rechits for one call of a hit associator. They are taken from the RecHitSimTrackIdMap
+ *  of the event when there is one and it has the hit, otherwise from a TrackerHitAssociator which is only built the
+ *  first time such a hit comes up, so that its DigiSimLink maps are not read at all when the map covers every hit.
+ *  It can not be copied, the hit associator is never duplicated.
+ */
+
+#include "SimTracker/TrackAssociation/interface/RecHitSimTrackIdMap.h"
+#include "FWCore/Utilities/interface/InputTag.h"
+
+#include <memory>
+#include <vector>
+
+class TrackerHitAssociator;
+class TrackingRecHit;
+namespace edm {
+  class Event;
+  class ParameterSet;
+}
+
+class RecHitSimTrackIdFinder {
+
+ public:
+  typedef RecHitSimTrackIdMap::SimTrackIdentifiers SimTrackIdentifiers;
+
+  /// Reads the map of the event (if the tag is not empty); the hit associator is made from the parameters when needed.
+  /// The event and the parameters have to outlive the finder.
+  RecHitSimTrackIdFinder(const edm::Event& event, const edm::ParameterSet& hitAssociatorParameters, const edm::InputTag& recHitSimTrackIdMapTag);
+  /// Uses the given hit associator for every hit, without a map
+  explicit RecHitSimTrackIdFinder(TrackerHitAssociator& hitAssociator);
+  ~RecHitSimTrackIdFinder();
+
+  /// Same as TrackerHitAssociator::associateHitId
+  void associateHitId(const TrackingRecHit& hit, std::vector<SimTrackIdentifiers>& simTrackIds);
+
+  /// Looks the hit up in the map only, returns false if it is not there. It is const and never touches
+  /// the hit associator, so it can be called from several threads at once.
+  bool findInMap(const TrackingRecHit& hit, std::vector<SimTrackIdentifiers>& simTrackIds) const;
+
+  /// The map of the event, or null if there is none
+  const RecHitSimTrackIdMap* recHitSimTrackIdMap() const { return map_; }
+
+ private:
+  RecHitSimTrackIdFinder(const RecHitSimTrackIdFinder&);
+  RecHitSimTrackIdFinder& operator=(const RecHitSimTrackIdFinder&);
+
+  const edm::Event* event_;
+  const edm::ParameterSet* hitAssociatorParameters_;
+  const RecHitSimTrackIdMap* map_;
+  std::unique_ptr<TrackerHitAssociator> ownedHitAssociator_;
+  TrackerHitAssociator* hitAssociator_;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef RecHitSimTrackIdMap_h
+#define RecHitSimTrackIdMap_h
+
+/** \class RecHitSimTrackIdMap
+ *  Event product with the SimTrack identifiers (trackId, EncodedEventId) that TrackerHitAssociator::associateHitId
+ *  returns for the tracker rechits of the track collections of an event. The rechits are identified by the clusters
+ *  they are built from, so that the copies of the same hit in different track collections share one entry.
+ *  It is filled by RecHitSimTrackIdMapProducer, and the hit associators use it instead of redoing the DigiSimLink
+ *  lookup for every track collection.
+ */
+
+#include "SimDataFormats/EncodedEventId/interface/EncodedEventId.h"
+#include "DataFormats/Provenance/interface/ProductID.h"
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class TrackingRecHit;
+
+class RecHitSimTrackIdMap {
+
+ public:
+  typedef std::pair<uint32_t,EncodedEventId> SimTrackIdentifiers;// same as SimHitIdpr
+
+  /// Identity of a rechit: its DetId, the cluster collection and the raw index of the one (or two, for matched strip hits)
+  /// clusters it is built from. The collection is needed since the indices of e.g. the conversion or GSF rechits are
+  /// counted in their own cluster collections.
+  struct Key {
+    Key() : detId(0), nClusters(0), firstCluster(0), secondCluster(0) {}
+    bool operator<(const Key& other) const;
+    bool operator==(const Key& other) const;
+
+    uint32_t detId;
+    edm::ProductID clusters;
+    uint32_t nClusters;
+    uint32_t firstCluster;
+    uint32_t secondCluster;
+  };
+
+  struct Entry {
+    Entry() : begin(0), end(0) {}
+    Key key;
+    uint32_t begin;
+    uint32_t end;
+    bool operator<(const Entry& other) const { return key < other.key; }
+  };
+
+  /// Fills the key of the rechit. Returns false for the hits that are not built from pixel or strip clusters
+  /// (or from two different cluster collections), which can not be found in the map.
+  static bool makeKey(const TrackingRecHit& hit, Key& key);
+
+  /// Add the identifiers of a rechit; post_insert has to be called once all the hits are in
+  void insert(const Key& key, const std::vector<SimTrackIdentifiers>& simTrackIds);
+
+  /// Sorts the entries to make them searchable
+  void post_insert();
+
+  /// Fills simTrackIds with the identifiers stored for the key. Returns false if the key is not in the map.
+  bool find(const Key& key, std::vector<SimTrackIdentifiers>& simTrackIds) const;
+
+  size_t size() const { return entries_.size(); }
+
+ private:
+  std::vector<Entry> entries_;
+  std::vector<uint32_t> trackIds_;
+  std::vector<EncodedEventId> eventIds_;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SimTrackToTrackingParticleIndex_h
+#define SimTrackToTrackingParticleIndex_h
+
+#include "SimDataFormats/EncodedEventId/interface/EncodedEventId.h"
+
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+/** @brief Inverted index from the SimTrack identifiers (trackId, EncodedEventId) to the indices of the TrackingParticles
+ * that contain them.
+ *
+ * The hit associators used to loop over every TrackingParticle for every track to see which of them contain the sim
+ * track identifiers of the track hits. This index is filled once per event so that only the identifiers that actually
+ * appear on the track have to be looked up.
+ *
+ * The TrackingParticle indices have to be inserted in increasing order, the lists returned by find are then sorted.
+ */
+class SimTrackToTrackingParticleIndex
+{
+public:
+	typedef std::vector<size_t> IndexList;
+
+	/** @brief Packs the sim track identifiers into the key used by the index. */
+	static uint64_t key( uint32_t trackId, const EncodedEventId& eventId )
+	{
+		return (static_cast<uint64_t>(eventId.rawId())<<32) | trackId;
+	}
+
+	void clear() { index_.clear(); }
+	void reserve( size_t numberOfKeys ) { index_.reserve( numberOfKeys ); }
+	bool empty() const { return index_.empty(); }
+
+	/** @brief Adds trackingParticleIndex to the list for the identifiers, even if it is already the last entry. */
+	void insert( uint32_t trackId, const EncodedEventId& eventId, size_t trackingParticleIndex );
+
+	/** @brief Adds trackingParticleIndex to the list for the identifiers, unless it is already the last entry.
+	 *
+	 * Use this if a TrackingParticle should only be counted once however many of its g4 tracks have the identifiers.
+	 */
+	void insertOnce( uint32_t trackId, const EncodedEventId& eventId, size_t trackingParticleIndex );
+
+	/** @brief Returns the TrackingParticle indices for the identifiers, or NULL if none of them contain it. */
+	const IndexList* find( uint32_t trackId, const EncodedEventId& eventId ) const;
+
+private:
+	std::unordered_map<uint64_t,IndexList> index_;
+};
+
+#endif // end of ifndef SimTrackToTrackingParticleIndex_h
@@ -83,6 +83,30 @@ class TrackAssociatorBase {
                                                         const edm::Event * event ,
                                                         const edm::EventSetup * setup  ) const = 0 ; 
 
+  /// compare reco to sim and sim to reco the handle of reco::Track and TrackingParticle collections in one go.
+  /// The default just calls associateRecoToSim and associateSimToReco, associators that can share the work
+  /// between the two directions override it.
+  virtual void associateBoth(edm::Handle<edm::View<reco::Track> >& tCH, 
+			     edm::Handle<TrackingParticleCollection>& tPCH,
+			     const edm::Event * event ,
+			     const edm::EventSetup * setup ,
+			     reco::RecoToSimCollection& recoToSim,
+			     reco::SimToRecoCollection& simToReco ) const {
+    recoToSim = associateRecoToSim(tCH,tPCH,event,setup);
+    simToReco = associateSimToReco(tCH,tPCH,event,setup);
+  }
+
+  /// Association Reco To Sim and Sim To Reco with Collections in one go
+  virtual void associateBoth(const edm::RefToBaseVector<reco::Track> & tc,
+			     const edm::RefVector<TrackingParticleCollection>& tpc,
+			     const edm::Event * event ,
+			     const edm::EventSetup * setup ,
+			     reco::RecoToSimCollection& recoToSim,
+			     reco::SimToRecoCollection& simToReco ) const {
+    recoToSim = associateRecoToSim(tc,tpc,event,setup);
+    simToReco = associateSimToReco(tc,tpc,event,setup);
+  }
+
   //TrajectorySeed
   virtual reco::RecoToSimCollectionSeed associateRecoToSim(edm::Handle<edm::View<TrajectorySeed> >&, 
 							   edm::Handle<TrackingParticleCollection>&, 
@@ -10,6 +10,7 @@
  */
 
 #include "SimTracker/TrackAssociation/interface/TrackAssociatorBase.h"
+#include "SimTracker/TrackAssociation/interface/TrackParameterPulls.h"
 #include "SimDataFormats/Track/interface/SimTrackContainer.h"
 #include "FWCore/Framework/interface/ESHandle.h"
 #include "MagneticField/Engine/interface/MagneticField.h" 
@@ -46,24 +47,49 @@ class TrackAssociatorByChi2 : public TrackAssociatorBase {
   typedef std::pair< reco::Track, Chi2SimMap> RecoToSimPair;
   typedef std::vector< RecoToSimPair > RecoToSimPairAssociation;
 
+  /// chi2 of the reco::Track and the SimTrack at these indices of the collections given to compareTracksParam
+  struct TrackSimTrackChi2 {
+    unsigned int trackIndex;
+    unsigned int simTrackIndex;
+    double chi2;
+    bool operator<(const TrackSimTrackChi2& other) const {
+      if (trackIndex!=other.trackIndex) return trackIndex<other.trackIndex;
+      if (chi2!=other.chi2) return chi2<other.chi2;
+      return simTrackIndex<other.simTrackIndex;
+    }
+  };
+  typedef std::vector<TrackSimTrackChi2> TrackSimTrackChi2Collection;
+
   /// Constructor with PSet
   TrackAssociatorByChi2(const edm::ESHandle<MagneticField> mF, edm::ParameterSet conf):
     chi2cut(conf.getParameter<double>("chi2cut")),
     onlyDiagonal(conf.getParameter<bool>("onlyDiagonal")),
-    bsSrc(conf.getParameter<edm::InputTag>("beamSpot")) {
+    bsSrc(conf.getParameter<edm::InputTag>("beamSpot")),
+    useFloatPrecision(conf.getParameter<bool>("useFloatPrecision")),
+    useSimParameterIndex(conf.getParameter<bool>("useSimParameterIndex")),
+    useAnalyticalPCA(conf.getParameter<bool>("useAnalyticalPCA")),
+    onlyStableGenParticles(conf.getParameter<bool>("onlyStableGenParticles")),
+    parallelTrackLoop(conf.getParameter<bool>("parallelTrackLoop")) {
     theMF=mF;  
     if (onlyDiagonal)
       edm::LogInfo("TrackAssociator") << " ---- Using Off Diagonal Covariance Terms = 0 ---- " <<  "\n";
     else 
       edm::LogInfo("TrackAssociator") << " ---- Using Off Diagonal Covariance Terms != 0 ---- " <<  "\n";
+    bindChi2Kernels();
   }
 
-  /// Constructor with magnetic field, double, bool and InputTag
-  TrackAssociatorByChi2(const edm::ESHandle<MagneticField> mF, double chi2Cut, bool onlyDiag, edm::InputTag beamspotSrc){
+  /// Constructor with magnetic field, double, bool and InputTag, useSimParameterIndex on as in TrackAssociatorByChi2_cfi
+  TrackAssociatorByChi2(const edm::ESHandle<MagneticField> mF, double chi2Cut, bool onlyDiag, edm::InputTag beamspotSrc):
+    useFloatPrecision(false),
+    useSimParameterIndex(true),
+    useAnalyticalPCA(false),
+    onlyStableGenParticles(false),
+    parallelTrackLoop(false) {
     chi2cut=chi2Cut;
     onlyDiagonal=onlyDiag;
     theMF=mF;  
     bsSrc = beamspotSrc;
+    bindChi2Kernels();
   }
 
   /// Destructor
@@ -83,6 +109,14 @@ class TrackAssociatorByChi2 : public TrackAssociatorBase {
 					      const edm::SimVertexContainer&,
 					      const reco::BeamSpot&) const;
 
+  /// compare collections reco to sim without copying the tracks: the pairs with chi2 < chi2cut,
+  /// sorted by track index, then chi2, then SimTrack index
+  void compareTracksParam(const reco::TrackCollection&, 
+			  const edm::SimTrackContainer&, 
+			  const edm::SimVertexContainer&,
+			  const reco::BeamSpot&,
+			  TrackSimTrackChi2Collection&) const;
+
   /// basic method where chi2 is computed
   double getChi2(reco::TrackBase::ParameterVector& rParameters,
 		 reco::TrackBase::CovarianceMatrix& recoTrackCovMatrix,
@@ -91,6 +125,15 @@ class TrackAssociatorByChi2 : public TrackAssociatorBase {
 		 int& charge,
 		 const reco::BeamSpot&) const;
 
+  /// chi2 of the pairs chosen by the caller (e.g. sharing hits), given as the index of the track in tC and the
+  /// TrackingParticle; 10000000000. if the particle is neutral or can't be propagated. Only the TrackingParticles
+  /// in the pairs are propagated to the beam line, each of them once.
+  typedef std::pair<unsigned int, edm::Ref<TrackingParticleCollection> > TrackIndexTrackingParticlePair;
+  void getChi2s(const edm::RefToBaseVector<reco::Track>& tC,
+		const std::vector<TrackIndexTrackingParticlePair>& pairs,
+		const reco::BeamSpot&,
+		std::vector<double>& chi2s) const;
+
   /// compare reco::TrackCollection and TrackingParticleCollection iterators: returns the chi2
   double associateRecoToSim(reco::TrackCollection::const_iterator,
 			    TrackingParticleCollection::const_iterator,
@@ -101,6 +144,12 @@ class TrackAssociatorByChi2 : public TrackAssociatorBase {
 									       Basic3DVector<double>,// momAtVtx
 									       float,// charge
 									       const reco::BeamSpot&) const;//beam spot
+  /// same with the closed form helix of useAnalyticalPCA in the field at the beam spot, whatever useAnalyticalPCA,
+  /// to check it against the propagation of parametersAtClosestApproach
+  std::pair<bool,reco::TrackBase::ParameterVector> analyticalParametersAtClosestApproach(const Basic3DVector<double>& vertex,
+											 const Basic3DVector<double>& momAtVtx,
+											 float charge,
+											 const reco::BeamSpot&) const;
   /// Association Reco To Sim with Collections
   reco::RecoToSimCollection associateRecoToSim(const edm::RefToBaseVector<reco::Track>&,
 					       const edm::RefVector<TrackingParticleCollection>&,
@@ -128,6 +177,87 @@ class TrackAssociatorByChi2 : public TrackAssociatorBase {
     return TrackAssociatorBase::associateSimToReco(tCH,tPCH,event,setup);
   }  
 
+  /// both directions from one propagation of the TrackingParticles and one chi2 evaluation of each pair
+  void associateBoth(edm::Handle<edm::View<reco::Track> >& tCH,
+		     edm::Handle<TrackingParticleCollection>& tPCH,
+		     const edm::Event * event,
+		     const edm::EventSetup * setup,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco) const;
+  void associateBoth(const edm::RefToBaseVector<reco::Track>&,
+		     const edm::RefVector<TrackingParticleCollection>&,
+		     const edm::Event * event,
+		     const edm::EventSetup * setup,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco) const;
+
+  /// same as above, pulls gets the pulls of the five parameters of each associated pair (see TrackParameterPulls)
+  void associateBoth(edm::Handle<edm::View<reco::Track> >& tCH,
+		     edm::Handle<TrackingParticleCollection>& tPCH,
+		     const edm::Event * event,
+		     const edm::EventSetup * setup,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco,
+		     TrackParameterPulls& pulls) const;
+  void associateBoth(const edm::RefToBaseVector<reco::Track>&,
+		     const edm::RefVector<TrackingParticleCollection>&,
+		     const edm::Event * event,
+		     const edm::EventSetup * setup,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco,
+		     TrackParameterPulls& pulls) const;
+
+  /// Parameters at the point of closest approach to the beam line of the TrackingParticles, GenParticles or SimTracks,
+  /// propagated once per call. valid is 0 for the neutral particles and when the propagation failed.
+  /// There is one array per parameter (qoverp, lambda, phi, dxy, dsz) so that the chi2 loop over the particles
+  /// can be vectorised; floatParameters is the same in single precision, only filled with useFloatPrecision.
+  struct SimParameterCache {
+    std::vector<double> parameters[5];
+    std::vector<float> floatParameters[5];
+    std::vector<char> valid;
+    void resize(size_t n);
+    void set(size_t i, const reco::TrackBase::ParameterVector& sParameters, bool isValid);
+    void fillFloatParameters();
+  };
+
+  /// Indices of the valid particles of a SimParameterCache binned in (phi, lambda), so that a track only
+  /// evaluates the chi2 with the particles inside its window. The cells are stored one after the other:
+  /// the particles of cell c are entries[cellBegin[c]] to entries[cellBegin[c+1]-1]. The valid particles with
+  /// a phi or lambda that is not finite are in no cell but in unbinned, and are candidates of every window.
+  struct SimParameterIndex {
+    static const unsigned int nPhiBins = 72;
+    static const unsigned int nLambdaBins = 36;
+    std::vector<unsigned int> cellBegin;
+    std::vector<unsigned int> entries;
+    std::vector<unsigned int> unbinned;
+    void fill(const SimParameterCache&);
+    /// indices, in increasing order, of the particles in the cells that overlap the window. Returns false,
+    /// without candidates, if the window is not finite: then all the particles have to be evaluated.
+    bool getCandidates(double phi, double phiWindow, double lambda, double lambdaWindow, std::vector<unsigned int>& candidates) const;
+  };
+
+  /// GenParticles that can be associated (charged, status 1 with onlyStableGenParticles) with their indices in the
+  /// collection and their parameters at the beam line, prepared once per event and shared by associateRecoToGen
+  /// and associateGenToReco. It refers to the RefVector it was prepared from, which must outlive it.
+  /// The candidates are in the order of the collection, parameters and index have one entry per candidate.
+  struct GenParticleCandidates {
+    GenParticleCandidates() : genParticles(0) {}
+    const edm::RefVector<reco::GenParticleCollection>* genParticles;
+    std::vector<unsigned int> indices;
+    SimParameterCache parameters;
+    SimParameterIndex index;
+  };
+  void prepareGenParticles(const edm::RefVector<reco::GenParticleCollection>&,
+			   const edm::Event * event,
+			   GenParticleCandidates&) const;
+
+  /// Association Reco To Gen with prepared GenParticles
+  reco::RecoToGenCollection associateRecoToGen(const edm::RefToBaseVector<reco::Track>&,
+					       const GenParticleCandidates&) const;
+  /// Association Gen To Reco with prepared GenParticles
+  reco::GenToRecoCollection associateGenToReco(const edm::RefToBaseVector<reco::Track>&,
+					       const GenParticleCandidates&) const;
+
   /// Association Sim To Reco with Collections (Gen Particle version)
   reco::RecoToGenCollection associateRecoToGen(const edm::RefToBaseVector<reco::Track>&,
 					       const edm::RefVector<reco::GenParticleCollection>&,
@@ -173,10 +303,110 @@ class TrackAssociatorByChi2 : public TrackAssociatorBase {
 
 
  private:
+  /// Parameters and inverted covariance matrices of the reco tracks, filled once per call so that they are not
+  /// recomputed for every sim particle: only the reciprocals of the diagonal terms if onlyDiagonal, otherwise
+  /// the full covariance inverted with Cholesky (invertPosDefMatrix), or with Invert() if that fails.
+  /// phiWindows and lambdaWindows are the largest |phi| and |lambda| differences with which a particle can
+  /// pass chi2cut, sqrt(5*chi2cut*cov(i,i)) plus a rounding margin; they are negative when the covariance
+  /// is not positive definite, in which case there is no such bound. inverseErrors are 1/sqrt(cov(i,i)), for the pulls.
+  struct TrackCache {
+    std::vector<reco::TrackBase::ParameterVector> parameters;
+    std::vector<reco::TrackBase::CovarianceMatrix> invertedCovariances;
+    std::vector<reco::TrackBase::ParameterVector> inverseErrors;
+    std::vector<double> phiWindows;
+    std::vector<double> lambdaWindows;
+  };
+
+  /// Per call buffers of getChi2s: the indices of the particles evaluated for the current track, their chi2,
+  /// and their parameters copied next to each other for the chi2 loop (and then for the pulls loop)
+  struct Chi2Workspace {
+    std::vector<unsigned int> candidates;
+    std::vector<double> chi2s;
+    std::vector<float> floatChi2s;
+    std::vector<double> parameters[5];
+    std::vector<float> floatParameters[5];
+    std::vector<double> pulls[5];
+  };
+
+  /// same as parametersAtClosestApproach for a helix in the uniform field bz (Tesla), without propagator
+  std::pair<bool,reco::TrackBase::ParameterVector> helixParametersAtClosestApproach(const Basic3DVector<double>& vertex,
+										     const Basic3DVector<double>& momAtVtx,
+										     float charge,
+										     const reco::BeamSpot&,
+										     double bz) const;
+  /// z component of the field at the beam spot, used by all the helices of a call
+  double beamSpotBz(const reco::BeamSpot&) const;
+
+  /// (index in simCache, chi2) of the particles that pass chi2cut with each track, in increasing index.
+  /// If pulls is not 0 it gets the five pulls of each of these pairs one after the other.
+  typedef std::vector<std::vector<std::pair<unsigned int,double> > > PassingPairs;
+  typedef std::vector<std::vector<float> > PassingPulls;
+  void fillPassingPairs(const TrackCache&, size_t trackIndex, const SimParameterCache&, const SimParameterIndex*,
+			Chi2Workspace&, std::vector<std::pair<unsigned int,double> >& passing, std::vector<float>* pulls) const;
+  /// the same for all the tracks of the cache, in a tbb::parallel_for if parallelTrackLoop
+  void getPassingPairs(const TrackCache&, const SimParameterCache&, const SimParameterIndex*, PassingPairs&,
+		       PassingPulls* pulls = 0) const;
+
+  /// Reco To Sim and Sim To Reco with TrackingParticles: fills the outputs that are not 0
+  void associateImplementation(const edm::RefToBaseVector<reco::Track>&,
+			       const edm::RefVector<TrackingParticleCollection>&,
+			       const edm::Event * event,
+			       reco::RecoToSimCollection* recoToSim,
+			       reco::SimToRecoCollection* simToReco,
+			       TrackParameterPulls* pulls) const;
+
+  /// parameters at the beam line with the propagation chosen by useAnalyticalPCA, bz from beamSpotBz
+  std::pair<bool,reco::TrackBase::ParameterVector> simParametersAtClosestApproach(const Basic3DVector<double>& vertex,
+										   const Basic3DVector<double>& momAtVtx,
+										   float charge,
+										   const reco::BeamSpot&,
+										   double bz) const;
+
+  /// fills the cache for TrackingParticles or GenParticles, neutral particles are not propagated
+  template<typename C>
+  void fillSimParameterCache(const C&, const reco::BeamSpot&, SimParameterCache&) const;
+  void fillSimParameterCache(const edm::SimTrackContainer&, const edm::SimVertexContainer&, const reco::BeamSpot&, SimParameterCache&) const;
+
+  /// chi2 (divided by 5 as in getChi2) of one track of the cache with the particles of simCache: all of them
+  /// if simIndex is 0, otherwise only those that can pass chi2cut. workspace.candidates are the indices of
+  /// the evaluated particles in increasing order, workspace.chi2s their chi2.
+  void getChi2s(const TrackCache&, size_t trackIndex, const SimParameterCache&, const SimParameterIndex* simIndex, Chi2Workspace& workspace) const;
+
+  /// chi2 of the track with already propagated sim parameters
+  double getChi2(const reco::TrackBase::ParameterVector& rParameters,
+		 const reco::TrackBase::CovarianceMatrix& recoTrackCovMatrix,
+		 const reco::TrackBase::ParameterVector& sParameters) const;
+
+  /// covariance of the track inverted: only the reciprocals of the diagonal terms if onlyDiagonal,
+  /// otherwise by Cholesky decomposition
+  reco::TrackBase::CovarianceMatrix invertedCovariance(const reco::Track&) const;
+
+  /// sets the chi2 loops below to the form of the quadratic form chosen by onlyDiagonal
+  void bindChi2Kernels();
+
+  void fillTrackCache(const edm::RefToBaseVector<reco::Track>&, TrackCache&) const;
+  void fillTrackCache(const reco::TrackCollection&, TrackCache&) const;
+  void addToTrackCache(const reco::Track&, TrackCache&) const;
+
   edm::ESHandle<MagneticField> theMF;
   double chi2cut;
   bool onlyDiagonal;
+  /// chi2/5 of one track with n particles (see chi2Kernel in the .cc), in single and double precision, for
+  /// the diagonal or the full covariance: bound once in the constructor instead of for every call and pair
+  void (*floatChi2Kernel)(const float (&rPar)[5], const float (&invCov)[5][5], const float* const (&sPar)[5], size_t n, float* chi2);
+  void (*doubleChi2Kernel)(const double (&rPar)[5], const double (&invCov)[5][5], const double* const (&sPar)[5], size_t n, double* chi2);
   edm::InputTag bsSrc;
+  /// compute the chi2 in single precision (faster loop, chi2 values differ in the last digits)
+  bool useFloatPrecision;
+  /// skip the (track, particle) pairs that are too far apart in phi or lambda to pass chi2cut, same output
+  bool useSimParameterIndex;
+  /// propagate the sim particles to the beam line as helices in the field at the beam spot instead of with
+  /// TSCBLBuilderNoMaterial (the exact mode, also used by the public single particle methods)
+  bool useAnalyticalPCA;
+  /// only associate the status 1 GenParticles
+  bool onlyStableGenParticles;
+  /// chi2 of the tracks with the particles in a tbb::parallel_for, in the task arena of the caller; same output
+  bool parallelTrackLoop;
 };
 
 #endif
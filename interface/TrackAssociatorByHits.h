@@ -6,6 +6,7 @@
 #include "FWCore/Framework/interface/EventSetup.h"
 #include "FWCore/Framework/interface/ESHandle.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/Utilities/interface/InputTag.h"
 #include "DataFormats/Common/interface/Ref.h"
 #include "SimTracker/TrackerHitAssociation/interface/TrackerHitAssociator.h"
 
@@ -17,6 +18,10 @@
 #include "SimDataFormats/TrackingAnalysis/interface/TrackingParticle.h"
 #include "SimDataFormats/EncodedEventId/interface/EncodedEventId.h"
 #include "SimTracker/TrackAssociation/interface/TrackAssociatorBase.h"
+#include "SimTracker/TrackAssociation/interface/SimTrackToTrackingParticleIndex.h"
+
+class TrackerTopology;
+class RecHitSimTrackIdFinder;
 
 class TrackAssociatorByHits : public TrackAssociatorBase {
   
@@ -56,6 +61,33 @@ class TrackAssociatorByHits : public TrackAssociatorBase {
     return TrackAssociatorBase::associateSimToReco(tCH,tPCH,event,setup);
   }  
 
+  /// Association in both directions with Collections: with UseIndexedHitCounting the hits of each track are
+  /// matched and counted only once for both maps, otherwise the two methods are called in turn
+  void associateBoth(const edm::RefToBaseVector<reco::Track>&,
+		     const edm::RefVector<TrackingParticleCollection>&,
+		     const edm::Event * event ,
+		     const edm::EventSetup * setup ,
+		     reco::RecoToSimCollection&,
+		     reco::SimToRecoCollection& ) const ;
+
+  /// Association in both directions of the handle of reco::Track and TrackingParticle collections
+  void associateBoth(edm::Handle<edm::View<reco::Track> >& tCH, 
+		     edm::Handle<TrackingParticleCollection>& tPCH,
+		     const edm::Event * event ,
+		     const edm::EventSetup * setup ,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco ) const {
+    edm::RefToBaseVector<reco::Track> tc(tCH);
+    for (unsigned int j=0; j<tCH->size();j++)
+      tc.push_back(edm::RefToBase<reco::Track>(tCH,j));
+
+    edm::RefVector<TrackingParticleCollection> tpc(tPCH.id());
+    for (unsigned int j=0; j<tPCH->size();j++)
+      tpc.push_back(edm::Ref<TrackingParticleCollection>(tPCH,j));
+
+    associateBoth(tc,tpc,event,setup,recoToSim,simToReco);
+  }
+
   //seed
   reco::RecoToSimCollectionSeed associateRecoToSim(edm::Handle<edm::View<TrajectorySeed> >&, 
 						   edm::Handle<TrackingParticleCollection>&, 
@@ -82,6 +114,42 @@ class TrackAssociatorByHits : public TrackAssociatorBase {
   int getDoubleCount(iter,iter,TrackerHitAssociator*,TrackingParticleCollection::const_iterator) const;
 
  private:
+  /// Same as the public versions, with the SimTrack ids of the hits taken from the RecHitSimTrackIdMap when it has them;
+  /// the hit associator of the finder is only built for the hits that are not in the map
+  template<typename iter>
+  void getMatchedIds(std::vector<SimHitIdpr>&, 
+		     std::vector<SimHitIdpr>&, 
+		     int&, 
+		     iter,
+		     iter,
+		     RecHitSimTrackIdFinder&) const;
+
+  template<typename iter>
+  int getDoubleCount(iter,iter,RecHitSimTrackIdFinder&,TrackingParticleCollection::const_iterator) const;
+
+  /// Fills the index from (g4 track id, TrackingParticle event id) to the position of the TrackingParticle in the collection.
+  /// A TrackingParticle is entered once per matching g4 track, as getShared counts it.
+  void fillTrackingParticleIndex(const TrackingParticleCollection&,
+				 SimTrackToTrackingParticleIndex&) const;
+
+  /// Number of shared hits for each TrackingParticle that has at least one of the matchedIds, in collection order.
+  /// Gives the same counts as getShared but only looks at the TrackingParticles found through the index.
+  void getSharedHitCounts(const std::vector<SimHitIdpr>&,
+			  const SimTrackToTrackingParticleIndex&,
+			  std::vector<std::pair<size_t,int> >&) const;
+
+  /// Number of tracker simhits of the TrackingParticle, counted according to UseGrouped and UseSplitting
+  int getNumberOfSimHits(const TrackingParticle&, const TrackerTopology*) const;
+
+  /// Association with the indexed shared hit counting (UseIndexedHitCounting = true).
+  /// Fills whichever of the output collections is not null, or both of them for associateBoth.
+  void associateByIndex(const edm::RefToBaseVector<reco::Track>&,
+			const edm::RefVector<TrackingParticleCollection>&,
+			const edm::Event * event,
+			const edm::EventSetup * setup,
+			reco::RecoToSimCollection*,
+			reco::SimToRecoCollection*) const;
+
   // ----- member data
   const edm::ParameterSet& conf_;
   const bool AbsoluteNumberOfHits;
@@ -93,6 +161,8 @@ class TrackAssociatorByHits : public TrackAssociatorBase {
   const bool UseGrouped;
   const bool UseSplitting;
   const bool ThreeHitTracksAreSpecial;
+  const bool UseIndexedHitCounting;
+  edm::InputTag recHitSimTrackIdMapTag;
 
   const TrackingRecHit* getHitPtr(edm::OwnVector<TrackingRecHit>::const_iterator iter) const {return &*iter;}
   const TrackingRecHit* getHitPtr(trackingRecHit_iterator iter) const {return &**iter;}
@@ -0,0 +1,97 @@
+#ifndef TrackAssociatorByHitsAndChi2_h
+#define TrackAssociatorByHitsAndChi2_h
+
+/** \class TrackAssociatorByHitsAndChi2
+ *  Associator that takes the (track, TrackingParticle) pairs that share hits, as found by QuickTrackAssociatorByHits,
+ *  and only evaluates the chi2 of TrackAssociatorByChi2 for those pairs instead of for all of them. The quality of the
+ *  Association Maps is -chi2 as for TrackAssociatorByChi2, and the pairs must also pass its chi2cut. The shared hit
+ *  quality of the same pairs can be returned as well (see associateBoth).
+ *
+ *  Configuration: hitAssociation is the PSet of a QuickTrackAssociatorByHits, chi2Association the PSet of a
+ *  TrackAssociatorByChi2.
+ */
+
+#include "SimTracker/TrackAssociation/interface/TrackAssociatorBase.h"
+#include "SimTracker/TrackAssociation/interface/QuickTrackAssociatorByHits.h"
+#include "SimTracker/TrackAssociation/interface/TrackAssociatorByChi2.h"
+#include "FWCore/Framework/interface/ESHandle.h"
+#include "MagneticField/Engine/interface/MagneticField.h"
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+
+class TrackAssociatorByHitsAndChi2 : public TrackAssociatorBase {
+
+ public:
+  TrackAssociatorByHitsAndChi2(const edm::ESHandle<MagneticField> mF, const edm::ParameterSet& conf);
+
+  ~TrackAssociatorByHitsAndChi2(){}
+
+  /// Association Reco To Sim with Collections
+  reco::RecoToSimCollection associateRecoToSim(const edm::RefToBaseVector<reco::Track>&,
+					       const edm::RefVector<TrackingParticleCollection>&,
+					       const edm::Event * event = 0,
+					       const edm::EventSetup * setup = 0 ) const ;
+  /// Association Sim To Reco with Collections
+  reco::SimToRecoCollection associateSimToReco(const edm::RefToBaseVector<reco::Track>&,
+					       const edm::RefVector<TrackingParticleCollection>&,
+					       const edm::Event * event = 0,
+					       const edm::EventSetup * setup = 0 ) const ;
+
+  /// compare reco to sim the handle of reco::Track and TrackingParticle collections
+  reco::RecoToSimCollection associateRecoToSim(edm::Handle<edm::View<reco::Track> >& tCH,
+					       edm::Handle<TrackingParticleCollection>& tPCH,
+					       const edm::Event * event = 0,
+					       const edm::EventSetup * setup = 0) const {
+    return TrackAssociatorBase::associateRecoToSim(tCH,tPCH,event,setup);
+  }
+
+  /// compare reco to sim the handle of reco::Track and TrackingParticle collections
+  reco::SimToRecoCollection associateSimToReco(edm::Handle<edm::View<reco::Track> >& tCH,
+					       edm::Handle<TrackingParticleCollection>& tPCH,
+					       const edm::Event * event = 0,
+					       const edm::EventSetup * setup = 0) const {
+    return TrackAssociatorBase::associateSimToReco(tCH,tPCH,event,setup);
+  }
+
+  /// both directions from one hit association and one propagation of each matched TrackingParticle
+  void associateBoth(edm::Handle<edm::View<reco::Track> >& tCH,
+		     edm::Handle<TrackingParticleCollection>& tPCH,
+		     const edm::Event * event,
+		     const edm::EventSetup * setup,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco) const;
+  void associateBoth(const edm::RefToBaseVector<reco::Track>&,
+		     const edm::RefVector<TrackingParticleCollection>&,
+		     const edm::Event * event,
+		     const edm::EventSetup * setup,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco) const;
+
+  /// same as above, recoToSimByHits and simToRecoByHits get the same pairs with the quality of QuickTrackAssociatorByHits
+  /// (shared hit fraction, or number of shared hits with AbsoluteNumberOfHits)
+  void associateBoth(const edm::RefToBaseVector<reco::Track>&,
+		     const edm::RefVector<TrackingParticleCollection>&,
+		     const edm::Event * event,
+		     const edm::EventSetup * setup,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco,
+		     reco::RecoToSimCollection& recoToSimByHits,
+		     reco::SimToRecoCollection& simToRecoByHits) const;
+
+ private:
+  /// fills the maps of the directions that are not Null
+  void associateImplementation(const edm::RefToBaseVector<reco::Track>&,
+			       const edm::RefVector<TrackingParticleCollection>&,
+			       const edm::Event * event,
+			       const edm::EventSetup * setup,
+			       reco::RecoToSimCollection* recoToSim,
+			       reco::SimToRecoCollection* simToReco,
+			       reco::RecoToSimCollection* recoToSimByHits,
+			       reco::SimToRecoCollection* simToRecoByHits) const;
+
+  QuickTrackAssociatorByHits hitAssociator_;
+  TrackAssociatorByChi2 chi2Associator_;
+  double chi2cut_;
+  edm::InputTag bsSrc_;
+};
+
+#endif
@@ -10,12 +10,14 @@
  */
 
 #include "SimTracker/TrackAssociation/interface/TrackAssociatorBase.h"
+#include "SimTracker/TrackAssociation/interface/TrackingParticleReferenceStates.h"
 #include "SimDataFormats/Track/interface/SimTrackContainer.h"
 #include "FWCore/Framework/interface/ESHandle.h"
 #include "FWCore/Framework/interface/EventSetup.h"
 #include "SimDataFormats/Vertex/interface/SimVertexContainer.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
+#include "FWCore/Utilities/interface/InputTag.h"
 
 #include "TrackingTools/GeomPropagators/interface/Propagator.h"
 #include "Geometry/CommonDetUnit/interface/GlobalTrackingGeometry.h"
@@ -23,6 +25,7 @@
 #include <TrackingTools/TrajectoryState/interface/TrajectoryStateOnSurface.h>
 
 #include<map>
+#include<memory>
 
 //Note that the Association Map is filled with -ch2 and not chi2 because it is ordered using std::greater:
 //the track with the lowest association chi2 will be the first in the output map.
@@ -47,9 +50,29 @@ class TrackAssociatorByPosition : public TrackAssociatorBase {
      else if (meth=="momdr"){theMethod = 2;}
      else if (meth=="posdr"){theMethod = 3;}
      else{
+       theMethod = 4;
        edm::LogError("TrackAssociatorByPosition")<<meth<<" mothed not recognized. Use dr or chi2.";     }
 
+     theQualityEstimator.reset(makeQualityEstimator(theMethod));
+
      theConsiderAllSimHits = iConfig.getParameter<bool>("ConsiderAllSimHits");
+     theReferenceStatesTag = iConfig.getParameter<edm::InputTag>("referenceStates");
+
+     thePreselection = iConfig.getParameter<bool>("usePreselection");
+     thePreselectionMargin = iConfig.getParameter<double>("preselectionMargin");
+     theValidatePreselection = iConfig.getParameter<bool>("validatePreselection");
+     if (thePreselection && theMinIfNoMatch){
+       edm::LogWarning("TrackAssociatorByPosition")<<"usePreselection would change the best pair that MinIfNoMatch keeps, it is switched off.";
+       thePreselection = false;}
+
+     thePrePropagation = iConfig.getParameter<bool>("usePrePropagation");
+     thePrePropagationCutFactor = iConfig.getParameter<double>("prePropagationCutFactor");
+     if (thePrePropagation && (theMethod==0 || !theQualityEstimator)){
+       edm::LogWarning("TrackAssociatorByPosition")<<"usePrePropagation is only available with the dist, momdr and posdr methods, it is switched off.";
+       thePrePropagation = false;}
+     if (thePrePropagation && theMinIfNoMatch){
+       edm::LogWarning("TrackAssociatorByPosition")<<"usePrePropagation would change the best pair that MinIfNoMatch keeps, it is switched off.";
+       thePrePropagation = false;}
    };
 
 
@@ -70,11 +93,69 @@ class TrackAssociatorByPosition : public TrackAssociatorBase {
 					       const edm::Event * event = 0,
                                                const edm::EventSetup * setup = 0 ) const ;
 
+  /// compare reco to sim the handle of reco::Track and TrackingParticle collections
+  reco::RecoToSimCollection associateRecoToSim(edm::Handle<edm::View<reco::Track> >& tCH, 
+					       edm::Handle<TrackingParticleCollection>& tPCH, 
+					       const edm::Event * event = 0,
+                                               const edm::EventSetup * setup = 0) const {
+    return TrackAssociatorBase::associateRecoToSim(tCH,tPCH,event,setup);
+  }
+  
+  /// compare reco to sim the handle of reco::Track and TrackingParticle collections
+  reco::SimToRecoCollection associateSimToReco(edm::Handle<edm::View<reco::Track> >& tCH, 
+					       edm::Handle<TrackingParticleCollection>& tPCH,
+					       const edm::Event * event = 0,
+                                               const edm::EventSetup * setup = 0) const {
+    return TrackAssociatorBase::associateSimToReco(tCH,tPCH,event,setup);
+  }  
+
+  /// both directions with the states of the tracks and of the TrackingParticles computed once
+  void associateBoth(edm::Handle<edm::View<reco::Track> >& tCH,
+		     edm::Handle<TrackingParticleCollection>& tPCH,
+		     const edm::Event * event,
+		     const edm::EventSetup * setup,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco) const;
+  void associateBoth(const edm::RefToBaseVector<reco::Track>&,
+		     const edm::RefVector<TrackingParticleCollection>&,
+		     const edm::Event * event,
+		     const edm::EventSetup * setup,
+		     reco::RecoToSimCollection& recoToSim,
+		     reco::SimToRecoCollection& simToReco) const;
+
   double quality(const TrajectoryStateOnSurface&, const TrajectoryStateOnSurface &)const;
 
+  /// quality of one propagated track state with several TrackingParticle states on its surface: the
+  /// track state is prepared once (e.g. its local error inverted for chi2) for all of them
+  void quality(const TrajectoryStateOnSurface&, const std::vector<TrajectoryStateOnSurface>&, std::vector<double>&)const;
+
+  /// What the quality of a pair needs of its two states, prepared once per state for the method:
+  /// the local parameters and, for the track state, the inverted local error (chi2), the global position
+  /// (dist), or the eta and phi of the momentum (momdr) or of the position (posdr).
+  struct QualityState {
+    AlgebraicVector5 localParameters;
+    AlgebraicSymMatrix55 localWeight;
+    GlobalPoint position;
+    double eta;
+    double phi;
+  };
+
+  /// Quality of the pairs for one method, implemented as a template on the method so that the per pair
+  /// evaluation and the loop of qualities are inlined; the estimator is chosen once in the constructor.
+  class QualityEstimator {
+  public:
+    virtual ~QualityEstimator() {}
+    /// withWeight: the state is the track state of the pair, whose error is needed by chi2
+    virtual void prepare(const TrajectoryStateOnSurface&, bool withWeight, QualityState&) const = 0;
+    virtual double quality(const QualityState& track, const QualityState& sim) const = 0;
+    /// results[k] = quality(track, sims[k]) for k < n
+    virtual void qualities(const QualityState& track, const QualityState* sims, size_t n, double* results) const = 0;
+  };
+
  private:
 
   const TrackingGeometry * theGeometry;
+  /// the propagations are serial: the propagators, the field cache and the reference counts of the surfaces aren't thread safe
   const Propagator * thePropagator;
   unsigned int theMethod;
   double theQminCut;
@@ -82,9 +163,107 @@ class TrackAssociatorByPosition : public TrackAssociatorBase {
   bool theMinIfNoMatch;
   double thePositionMinimumDistance;
   bool theConsiderAllSimHits;
+  /// TrackingParticleReferenceStates of the event, used instead of looking for the hit of each particle
+  /// when it is there and made with the same positionMinimumDistance and ConsiderAllSimHits
+  edm::InputTag theReferenceStatesTag;
+  /// only propagate the pairs whose directions are close enough in eta-phi (see preselectionWindows), not with MinIfNoMatch
+  bool thePreselection;
+  /// eta-phi distance allowed on top of the QCut and bending terms, for the vertex spread, scattering, field...
+  double thePreselectionMargin;
+  /// also compare the pairs rejected by the preselection or the pre-propagation and report those that would have passed QCut
+  bool theValidatePreselection;
+  /// first propagate with an AnalyticalPropagator and only propagate with thePropagator the pairs that pass
+  /// thePrePropagationCutFactor*QCut (dist, momdr and posdr methods, not with MinIfNoMatch); only the pairs
+  /// whose track state and reference surface are inside the solenoid, where the field is nearly uniform
+  bool thePrePropagation;
+  double thePrePropagationCutFactor;
+  /// estimator of theMethod, 0 if the method is not recognized
+  std::shared_ptr<const QualityEstimator> theQualityEstimator;
+  static QualityEstimator * makeQualityEstimator(unsigned int method);
   
   FreeTrajectoryState getState(const reco::Track &) const;
   TrajectoryStateOnSurface getState(const TrackingParticle &)const;
+  TrajectoryStateOnSurface getState(const TrackingParticleReferenceStates::Entry &)const;
+  /// the TrackingParticleReferenceStates to use for these TrackingParticles, 0 if there are none
+  const TrackingParticleReferenceStates * getReferenceStates(const edm::Event *, const edm::RefVector<TrackingParticleCollection>&) const;
+
+  /// Counters of the two stage mode (usePrePropagation) for one call, logged at its end
+  struct PrePropagationCounters {
+    PrePropagationCounters() : pairs(0), rejected(0), outsideSolenoid(0), refined(0), agreeing(0) {}
+    unsigned long long pairs;    ///< pairs compared after the analytical propagation
+    unsigned long long rejected; ///< of which rejected by the loose cut, without propagation by thePropagator
+    unsigned long long outsideSolenoid; ///< pairs not pre-propagated, the track state or the surface is outside the solenoid
+    unsigned long long refined;  ///< pairs compared after the propagation by thePropagator
+    unsigned long long agreeing; ///< of which with the same decision at QCut as after the analytical propagation
+  };
+
+  /// Initial states of the tracks and reference states of the TrackingParticles (invalid if the particle has
+  /// no hit to compare to), by index in the collections: computed once per call instead of once per pair.
+  /// Many TrackingParticles have their reference state on the same surface, so the TrackingParticles are
+  /// grouped by surface and each track is propagated at most once to each of them.
+  struct StateCache {
+    std::vector<FreeTrajectoryState> trackStates;
+    std::vector<TrajectoryStateOnSurface> simStates;
+    /// index in surfaces of the surface of each TrackingParticle state, -1 if the state is invalid
+    std::vector<int> simSurfaces;
+    std::vector<const Surface*> surfaces;
+    /// track Ti propagated to surface S is propagatedStates[Ti*surfaces.size()+S], once propagated[] is set
+    std::vector<TrajectoryStateOnSurface> propagatedStates;
+    std::vector<char> propagated;
+    /// the TrackingParticle states prepared for theQualityEstimator, grouped by surface: those of surface S are
+    /// in slots [surfaceBegin[S], surfaceBegin[S+1]), the slot of TrackingParticle TPi is simSlots[TPi]
+    std::vector<unsigned int> surfaceBegin;
+    std::vector<unsigned int> simSlots;
+    std::vector<QualityState> surfaceSimQualityStates;
+    /// quality of track Ti with the TrackingParticle in slot k is qualities[Ti*surfaceSimQualityStates.size()+k]:
+    /// when a track is propagated to a surface, it is compared at once to all the TrackingParticles there
+    std::vector<double> qualities;
+    /// with thePreselection or thePrePropagation, the pairs Ti*simStates.size()+TPi that are compared:
+    /// 1 kept, 0 rejected, 2 rejected and already checked by theValidatePreselection
+    std::vector<char> preselected;
+    /// with thePrePropagation, whether the pair passed QCut after the analytical propagation (0 or 1),
+    /// 2 if it was not compared then or has already been counted in prePropagationCounters.agreeing
+    std::vector<char> prePropagationQCut;
+    PrePropagationCounters prePropagationCounters;
+  };
+  void fillStateCache(const edm::RefToBaseVector<reco::Track>&,
+		      const edm::RefVector<TrackingParticleCollection>&,
+		      const edm::Event *,
+		      StateCache&) const;
+  /// the track Ti propagated to the surface of the state of TrackingParticle TPi, which must be valid
+  const TrajectoryStateOnSurface & propagatedState(StateCache&, unsigned int Ti, unsigned int TPi) const;
+  /// propagates and fills the qualities of the track with all the TrackingParticles of the surface
+  void propagate(StateCache&, unsigned int Ti, unsigned int TPi) const;
+  /// quality of the pair, propagatedState must have been called and be valid
+  double quality(const StateCache&, unsigned int Ti, unsigned int TPi) const;
+
+  /// Preselection: the direction of the track at its initial state is compared to the reference direction of the
+  /// TrackingParticle, its momentum for momdr and its position otherwise. The pair is kept if |deta| and |dphi|
+  /// are within thePreselectionMargin plus the angle QCut stands for at the reference state (QCut for the dr
+  /// methods, QCut seen from the origin for dist, nothing for chi2), plus for dphi the largest bending of
+  /// the track up to the radius of the state in the field bz found at the origin.
+  void fillPreselection(StateCache&) const;
+  void preselectionWindows(double pt, double bz, double rPerp, double rMag, double& etaWindow, double& phiWindow) const;
+  /// false if the preselection rejects the pair, which is then treated as a failed propagation
+  bool preselected(StateCache&, unsigned int Ti, unsigned int TPi) const;
+
+  /// first stage of the two stage mode: rejects the preselected pairs whose quality after the analytical
+  /// propagation is above thePrePropagationCutFactor*QCut, the pairs it can not or does not propagate are kept
+  void fillPrePropagation(StateCache&) const;
+  /// counts the pair, compared with quality dQ after the propagation by thePropagator, in the counters
+  void countRefinement(StateCache&, unsigned int Ti, unsigned int TPi, double dQ) const;
+  /// LogInfo of the counters of the call
+  void logPrePropagation(const StateCache&) const;
+
+  /// the association loops, the output is not post_insert'ed
+  void fillRecoToSim(const edm::RefToBaseVector<reco::Track>&,
+		     const edm::RefVector<TrackingParticleCollection>&,
+		     StateCache&,
+		     reco::RecoToSimCollection&) const;
+  void fillSimToReco(const edm::RefToBaseVector<reco::Track>&,
+		     const edm::RefVector<TrackingParticleCollection>&,
+		     StateCache&,
+		     reco::SimToRecoCollection&) const;
 
 };
 
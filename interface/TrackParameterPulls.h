@@ -0,0 +1,48 @@
+#ifndef TrackParameterPulls_h
+#define TrackParameterPulls_h
+
+/** \class TrackParameterPulls
+ *  Event product with the pulls of the (track, TrackingParticle) pairs associated by TrackAssociatorByChi2:
+ *  (reco - sim)/sigma for qoverp, lambda, phi, dxy and dsz, the sim parameters being those of the TrackingParticle
+ *  at the beam line used for the chi2, sigma the square root of the diagonal term of the track covariance.
+ *  The pairs are identified by the keys of the track and of the TrackingParticle in the collections given to the
+ *  associator, and are the same as in its Association Maps. It is filled by TrackAssociatorEDProducer with
+ *  producePulls = True, so that the validation does not have to propagate the TrackingParticles again.
+ */
+
+#include <stdint.h>
+#include <vector>
+
+class TrackParameterPulls {
+
+ public:
+  struct Entry {
+    Entry() : trackKey(0), trackingParticleKey(0) { for (unsigned int i=0; i<5; i++) pulls[i] = 0; }
+    uint32_t trackKey;
+    uint32_t trackingParticleKey;
+    float pulls[5];
+    bool operator<(const Entry& other) const {
+      if (trackKey!=other.trackKey) return trackKey<other.trackKey;
+      return trackingParticleKey<other.trackingParticleKey;
+    }
+  };
+  typedef std::vector<Entry>::const_iterator const_iterator;
+
+  /// Add the pulls of a pair; post_insert has to be called once all the pairs are in
+  void insert(uint32_t trackKey, uint32_t trackingParticleKey, const float (&pulls)[5]);
+
+  /// Sorts the entries by track then TrackingParticle key to make them searchable
+  void post_insert();
+
+  /// Entry of the pair, 0 if the pair was not associated
+  const Entry* find(uint32_t trackKey, uint32_t trackingParticleKey) const;
+
+  const_iterator begin() const { return entries_.begin(); }
+  const_iterator end() const { return entries_.end(); }
+  size_t size() const { return entries_.size(); }
+
+ private:
+  std::vector<Entry> entries_;
+};
+
+#endif
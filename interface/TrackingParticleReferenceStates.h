@@ -0,0 +1,58 @@
+#ifndef TrackingParticleReferenceStates_h
+#define TrackingParticleReferenceStates_h
+
+/** \class TrackingParticleReferenceStates
+ *  Event product with the reference state of every TrackingParticle of a collection, as used by
+ *  TrackAssociatorByPosition: the simhit farthest from the origin beyond positionMinimumDistance (among the
+ *  tracker hits, or all the hits with ConsiderAllSimHits), given by its DetId, global position, momentum at
+ *  entry and charge. It is filled by TrackingParticleReferenceStateProducer, so that the position associators
+ *  of the different track collections do not each look up the GeomDet of every simhit again.
+ */
+
+#include "DataFormats/Provenance/interface/ProductID.h"
+#include "SimDataFormats/TrackingAnalysis/interface/TrackingParticleFwd.h"
+
+#include <stdint.h>
+#include <vector>
+
+class TrackingGeometry;
+
+class TrackingParticleReferenceStates {
+
+ public:
+  struct Entry {
+    Entry() : detId(0), charge(0) { for (unsigned int i=0; i<3; i++) position[i] = momentum[i] = 0; }
+    /// 0 if the particle has no simhit beyond positionMinimumDistance
+    uint32_t detId;
+    float position[3];
+    float momentum[3];
+    int charge;
+  };
+
+  TrackingParticleReferenceStates() : positionMinimumDistance_(0), considerAllSimHits_(false) {}
+  TrackingParticleReferenceStates(const edm::ProductID& trackingParticles, double positionMinimumDistance, bool considerAllSimHits) :
+    trackingParticles_(trackingParticles), positionMinimumDistance_(positionMinimumDistance), considerAllSimHits_(considerAllSimHits) {}
+
+  /// Fills the entry of the particle. Returns false if it has no simhit beyond positionMinimumDistance.
+  static bool makeEntry(const TrackingParticle& trackingParticle, const TrackingGeometry& geometry,
+			double positionMinimumDistance, bool considerAllSimHits, Entry& entry);
+
+  /// the entries are added in the order of the TrackingParticle collection
+  void push_back(const Entry& entry) { entries_.push_back(entry); }
+
+  /// entry of the TrackingParticle with this key in the collection
+  const Entry& operator[](size_t key) const { return entries_[key]; }
+  size_t size() const { return entries_.size(); }
+
+  const edm::ProductID& trackingParticles() const { return trackingParticles_; }
+  double positionMinimumDistance() const { return positionMinimumDistance_; }
+  bool considerAllSimHits() const { return considerAllSimHits_; }
+
+ private:
+  edm::ProductID trackingParticles_;
+  double positionMinimumDistance_;
+  bool considerAllSimHits_;
+  std::vector<Entry> entries_;
+};
+
+#endif
@@ -0,0 +1,81 @@
+
+// system include files
+#include <memory>
+#include <set>
+
+// user include files
+#include "FWCore/Framework/interface/Frameworkfwd.h"
+#include "FWCore/Framework/interface/EDProducer.h"
+
+#include "FWCore/Framework/interface/Event.h"
+#include "FWCore/Framework/interface/MakerMacros.h"
+
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+
+#include "DataFormats/Common/interface/View.h"
+#include "DataFormats/TrackReco/interface/Track.h"
+#include "SimTracker/TrackerHitAssociation/interface/TrackerHitAssociator.h"
+#include "SimTracker/TrackAssociation/interface/RecHitSimTrackIdMap.h"
+
+/** Runs TrackerHitAssociator::associateHitId once for every distinct rechit found on the
+ *  tracks of the configured collections and stores the result in a RecHitSimTrackIdMap,
+ *  which the hit associators then use for all of these collections.
+ */
+class RecHitSimTrackIdMapProducer : public edm::EDProducer {
+    public:
+        RecHitSimTrackIdMapProducer(const edm::ParameterSet &iConfig) ;
+        ~RecHitSimTrackIdMapProducer();
+
+        virtual void produce(edm::Event&, const edm::EventSetup&);
+
+    private:
+        edm::ParameterSet          conf_;
+        std::vector<edm::InputTag> trackCollections_;
+};
+
+RecHitSimTrackIdMapProducer::RecHitSimTrackIdMapProducer(const edm::ParameterSet &iConfig) :
+    conf_(iConfig),
+    trackCollections_(iConfig.getParameter<std::vector<edm::InputTag> >("trackCollections"))
+{
+    produces<RecHitSimTrackIdMap>();
+}
+
+RecHitSimTrackIdMapProducer::~RecHitSimTrackIdMapProducer()
+{
+}
+
+void
+RecHitSimTrackIdMapProducer::produce(edm::Event & iEvent, const edm::EventSetup&)
+{
+    TrackerHitAssociator associator(iEvent, conf_);
+
+    std::auto_ptr<RecHitSimTrackIdMap> output(new RecHitSimTrackIdMap);
+    std::set<RecHitSimTrackIdMap::Key> done;
+    std::vector<RecHitSimTrackIdMap::SimTrackIdentifiers> simTrackIds;
+
+    for (std::vector<edm::InputTag>::const_iterator tag = trackCollections_.begin(); tag != trackCollections_.end(); ++tag) {
+        edm::Handle<edm::View<reco::Track> > tracks;
+        // not all the collections are there in every workflow; the associators fall back to TrackerHitAssociator for them
+        if (!iEvent.getByLabel(*tag, tracks)) {
+            LogDebug("RecHitSimTrackIdMapProducer") << "No track collection " << tag->encode() << ", skipping it";
+            continue;
+        }
+        for (edm::View<reco::Track>::const_iterator track = tracks->begin(); track != tracks->end(); ++track) {
+            for (trackingRecHit_iterator hit = track->recHitsBegin(); hit != track->recHitsEnd(); ++hit) {
+                if (!(*hit)->isValid()) continue;
+                RecHitSimTrackIdMap::Key key;
+                if (!RecHitSimTrackIdMap::makeKey(**hit, key)) continue;
+                if (!done.insert(key).second) continue;
+                associator.associateHitId(**hit, simTrackIds);
+                output->insert(key, simTrackIds);
+            }
+        }
+    }
+    output->post_insert();
+
+    LogDebug("RecHitSimTrackIdMapProducer") << "Stored the SimTrack ids of " << output->size() << " rechits";
+    iEvent.put(output);
+}
+
+DEFINE_FWK_MODULE(RecHitSimTrackIdMapProducer);
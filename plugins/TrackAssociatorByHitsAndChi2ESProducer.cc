@@ -0,0 +1,50 @@
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "SimTracker/Records/interface/TrackAssociatorRecord.h"
+#include "SimTracker/TrackAssociation/plugins/TrackAssociatorByHitsAndChi2ESProducer.h"
+#include "SimTracker/TrackAssociation/interface/TrackAssociatorByHitsAndChi2.h"
+
+// system include files
+#include <memory>
+#include "boost/shared_ptr.hpp"
+
+#include "FWCore/Framework/interface/ModuleFactory.h"
+#include "FWCore/Framework/interface/ESProducer.h"
+#include "FWCore/Framework/interface/ESHandle.h"
+
+#include "MagneticField/Engine/interface/MagneticField.h"
+#include "MagneticField/Records/interface/IdealMagneticFieldRecord.h"
+
+
+
+TrackAssociatorByHitsAndChi2ESProducer::TrackAssociatorByHitsAndChi2ESProducer(const edm::ParameterSet& iConfig)
+{
+  //the following line is needed to tell the framework what
+  // data is being produced
+  std::string myName=iConfig.getParameter<std::string>("ComponentName");
+  setWhatProduced(this,myName);
+
+  conf_=iConfig;
+}
+
+
+TrackAssociatorByHitsAndChi2ESProducer::~TrackAssociatorByHitsAndChi2ESProducer()
+{
+}
+
+
+//
+// member functions
+//
+
+// ------------ method called to produce the data  ------------
+TrackAssociatorByHitsAndChi2ESProducer::ReturnType
+TrackAssociatorByHitsAndChi2ESProducer::produce(const TrackAssociatorRecord& iRecord)
+{
+  edm::ESHandle<MagneticField> theMF;
+  iRecord.getRecord<IdealMagneticFieldRecord>().get(theMF);
+  ReturnType associator (new TrackAssociatorByHitsAndChi2(theMF,conf_));
+  return associator ;
+}
+
+//define this as a plug-in
+DEFINE_FWK_EVENTSETUP_MODULE(TrackAssociatorByHitsAndChi2ESProducer);
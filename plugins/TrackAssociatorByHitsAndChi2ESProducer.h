@@ -0,0 +1,27 @@
+#ifndef TrackAssociation_TrackAssociatorByHitsAndChi2ESProducer_h
+#define TrackAssociation_TrackAssociatorByHitsAndChi2ESProducer_h
+
+
+#include "SimTracker/TrackAssociation/interface/TrackAssociatorBase.h"
+#include "SimTracker/Records/interface/TrackAssociatorRecord.h"
+
+#include "FWCore/Framework/interface/ESProducer.h"
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+
+
+#include <boost/shared_ptr.hpp>
+
+class  TrackAssociatorByHitsAndChi2ESProducer: public edm::ESProducer{
+  typedef boost::shared_ptr<TrackAssociatorBase> ReturnType;
+
+ public:
+  TrackAssociatorByHitsAndChi2ESProducer(const edm::ParameterSet & p);
+  virtual ~TrackAssociatorByHitsAndChi2ESProducer(); 
+  boost::shared_ptr<TrackAssociatorBase> produce(const TrackAssociatorRecord &);
+
+ private:
+  edm::ParameterSet conf_;
+};
+
+
+#endif
@@ -21,10 +21,13 @@
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 
 #include "SimTracker/TrackAssociation/interface/TrackAssociatorBase.h"
+#include "SimTracker/TrackAssociation/interface/TrackAssociatorByChi2.h"
+#include "SimTracker/TrackAssociation/interface/TrackParameterPulls.h"
 #include "SimTracker/Records/interface/TrackAssociatorRecord.h"
 
 #include "SimDataFormats/TrackingAnalysis/interface/TrackingParticle.h"
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
+#include "FWCore/Utilities/interface/Exception.h"
 
 //
 // class decleration
@@ -46,6 +49,7 @@ private:
   edm::InputTag label_tp;
   std::string associator;
   bool  theIgnoremissingtrackcollection;
+  bool producePulls;
 };
 
 TrackAssociatorEDProducer::TrackAssociatorEDProducer(const edm::ParameterSet& pset):
@@ -53,10 +57,14 @@ TrackAssociatorEDProducer::TrackAssociatorEDProducer(const edm::ParameterSet& ps
   label_tr(pset.getParameter< edm::InputTag >("label_tr")),
   label_tp(pset.getParameter< edm::InputTag >("label_tp")),
   associator(pset.getParameter< std::string >("associator")),
-  theIgnoremissingtrackcollection(pset.getUntrackedParameter<bool>("ignoremissingtrackcollection",false))
+  theIgnoremissingtrackcollection(pset.getUntrackedParameter<bool>("ignoremissingtrackcollection",false)),
+  producePulls(pset.exists("producePulls") ? pset.getParameter<bool>("producePulls") : false)
 {
+  //producePulls is optional: the modules configured without trackingParticleRecoTrackAsssociation_cfi,
+  //in the validation packages, don't set it
   produces<reco::SimToRecoCollection>();
   produces<reco::RecoToSimCollection>();
+  if (producePulls) produces<TrackParameterPulls>();
 }
 
 
@@ -90,18 +98,28 @@ TrackAssociatorEDProducer::produce(edm::Event& iEvent, const edm::EventSetup& iS
      //the track collection is not in the event and we're being told to ignore this.
      //do not output anything to the event, other wise this would be considered as inefficiency.
    }else{
-     //associate tracks
-     LogTrace("TrackValidator") << "Calling associateRecoToSim method" << "\n";
-     reco::RecoToSimCollection recSimColl=theAssociator->associateRecoToSim(trackCollection,
-									    TPCollection,
-									    &iEvent, &iSetup);
-     LogTrace("TrackValidator") << "Calling associateSimToReco method" << "\n";
-     reco::SimToRecoCollection simRecColl=theAssociator->associateSimToReco(trackCollection,
-									    TPCollection, 
-									    &iEvent, &iSetup);
-     
-     rts.reset(new reco::RecoToSimCollection(recSimColl));
-     str.reset(new reco::SimToRecoCollection(simRecColl));
+     //associate tracks in both directions at once, so that the associator can share the work
+     LogTrace("TrackValidator") << "Calling associateBoth method" << "\n";
+     rts.reset(new reco::RecoToSimCollection);
+     str.reset(new reco::SimToRecoCollection);
+     if (producePulls) {
+       //the pulls are computed by the chi2 associator with the chi2 of the pairs
+       const TrackAssociatorByChi2 * chi2Associator = dynamic_cast<const TrackAssociatorByChi2 *>(theAssociator.product());
+       if (chi2Associator==0)
+	 throw cms::Exception("Configuration") << "producePulls needs a TrackAssociatorByChi2, which associator "
+					       << associator << " is not\n";
+       std::auto_ptr<TrackParameterPulls> pulls(new TrackParameterPulls);
+       chi2Associator->associateBoth(trackCollection,
+				     TPCollection,
+				     &iEvent, &iSetup,
+				     *rts, *str, *pulls);
+       iEvent.put(pulls);
+     } else {
+       theAssociator->associateBoth(trackCollection,
+				    TPCollection,
+				    &iEvent, &iSetup,
+				    *rts, *str);
+     }
 
      iEvent.put(rts);
      iEvent.put(str);
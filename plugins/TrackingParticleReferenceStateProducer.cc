@@ -0,0 +1,71 @@
+// system include files
+#include <memory>
+
+// user include files
+#include "FWCore/Framework/interface/Frameworkfwd.h"
+#include "FWCore/Framework/interface/EDProducer.h"
+
+#include "FWCore/Framework/interface/Event.h"
+#include "FWCore/Framework/interface/EventSetup.h"
+#include "FWCore/Framework/interface/ESHandle.h"
+#include "FWCore/Framework/interface/MakerMacros.h"
+
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+
+#include "Geometry/Records/interface/GlobalTrackingGeometryRecord.h"
+#include "Geometry/CommonDetUnit/interface/GlobalTrackingGeometry.h"
+#include "SimDataFormats/TrackingAnalysis/interface/TrackingParticle.h"
+#include "SimTracker/TrackAssociation/interface/TrackingParticleReferenceStates.h"
+
+/** Looks once per event for the reference simhit of every TrackingParticle, the one TrackAssociatorByPosition
+ *  compares the tracks to, and stores it in a TrackingParticleReferenceStates that all the position associators
+ *  configured with the same positionMinimumDistance and ConsiderAllSimHits then read.
+ */
+class TrackingParticleReferenceStateProducer : public edm::EDProducer {
+    public:
+        TrackingParticleReferenceStateProducer(const edm::ParameterSet &iConfig) ;
+        ~TrackingParticleReferenceStateProducer();
+
+        virtual void produce(edm::Event&, const edm::EventSetup&);
+
+    private:
+        edm::InputTag trackingParticles_;
+        double        positionMinimumDistance_;
+        bool          considerAllSimHits_;
+};
+
+TrackingParticleReferenceStateProducer::TrackingParticleReferenceStateProducer(const edm::ParameterSet &iConfig) :
+    trackingParticles_(iConfig.getParameter<edm::InputTag>("trackingParticles")),
+    positionMinimumDistance_(iConfig.getParameter<double>("positionMinimumDistance")),
+    considerAllSimHits_(iConfig.getParameter<bool>("ConsiderAllSimHits"))
+{
+    produces<TrackingParticleReferenceStates>();
+}
+
+TrackingParticleReferenceStateProducer::~TrackingParticleReferenceStateProducer()
+{
+}
+
+void
+TrackingParticleReferenceStateProducer::produce(edm::Event & iEvent, const edm::EventSetup& iSetup)
+{
+    edm::ESHandle<GlobalTrackingGeometry> geometry;
+    iSetup.get<GlobalTrackingGeometryRecord>().get(geometry);
+
+    edm::Handle<TrackingParticleCollection> trackingParticles;
+    iEvent.getByLabel(trackingParticles_, trackingParticles);
+
+    std::auto_ptr<TrackingParticleReferenceStates> output(new TrackingParticleReferenceStates(trackingParticles.id(), positionMinimumDistance_, considerAllSimHits_));
+    unsigned int nFound = 0;
+    for (TrackingParticleCollection::const_iterator tp = trackingParticles->begin(); tp != trackingParticles->end(); ++tp) {
+        TrackingParticleReferenceStates::Entry entry;
+        if (TrackingParticleReferenceStates::makeEntry(*tp, *geometry, positionMinimumDistance_, considerAllSimHits_, entry)) ++nFound;
+        output->push_back(entry);
+    }
+
+    LogDebug("TrackingParticleReferenceStateProducer") << "Found the reference hit of " << nFound << " out of " << output->size() << " TrackingParticles";
+    iEvent.put(output);
+}
+
+DEFINE_FWK_MODULE(TrackingParticleReferenceStateProducer);
@@ -4,6 +4,17 @@ TrackAssociatorByChi2ESProducer = cms.ESProducer("TrackAssociatorByChi2ESProduce
     chi2cut = cms.double(25.0),
     beamSpot = cms.InputTag("offlineBeamSpot"),
     onlyDiagonal = cms.bool(False),
+    # chi2 loop in single precision: faster, the chi2 values change in the last digits
+    useFloatPrecision = cms.bool(False),
+    # only evaluate the chi2 of the particles close enough in (phi, lambda) to pass chi2cut: same output
+    useSimParameterIndex = cms.bool(True),
+    # closed form helix to the beam line in the field at the beam spot instead of TSCBLBuilderNoMaterial;
+    # test/testTrackAssociator_cfg.py compares the two before it is switched on
+    useAnalyticalPCA = cms.bool(False),
+    # associate tracks to the status 1 GenParticles only, not to the intermediate ones
+    onlyStableGenParticles = cms.bool(True),
+    # chi2 loop over the tracks in a tbb::parallel_for, the result is the same
+    parallelTrackLoop = cms.bool(False),
     ComponentName = cms.string('TrackAssociatorByChi2')
 )
 
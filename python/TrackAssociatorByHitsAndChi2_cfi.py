@@ -0,0 +1,15 @@
+import FWCore.ParameterSet.Config as cms
+
+from SimTracker.TrackAssociation.quickTrackAssociatorByHits_cfi import quickTrackAssociatorByHits
+from SimTracker.TrackAssociation.TrackAssociatorByChi2_cfi import TrackAssociatorByChi2ESProducer
+
+# chi2 of TrackAssociatorByChi2 evaluated only for the pairs that QuickTrackAssociatorByHits associates
+TrackAssociatorByHitsAndChi2ESProducer = cms.ESProducer("TrackAssociatorByHitsAndChi2ESProducer",
+    hitAssociation = cms.PSet(
+        **quickTrackAssociatorByHits.parameters_()
+    ),
+    chi2Association = cms.PSet(
+        **TrackAssociatorByChi2ESProducer.parameters_()
+    ),
+    ComponentName = cms.string('TrackAssociatorByHitsAndChi2')
+)
@@ -4,4 +4,6 @@ from SimTracker.TrackAssociation.TrackAssociatorByHits_cfi import TrackAssociato
 TrackAssociatorByHitsCompact = TrackAssociatorByHits.clone(
     ComponentName = cms.string('TrackAssociatorByHitsCompact'),
     useCompactStripLinks = cms.bool(True),
+    # the shared map is made from the standard links
+    recHitSimTrackIdMap = cms.InputTag(""),
 )
@@ -21,6 +21,14 @@ TrackAssociatorByHits = cms.ESProducer("TrackAssociatorByHitsESProducer",
     ComponentName = cms.string('TrackAssociatorByHits'),
     UsePixels = cms.bool(True),
     ThreeHitTracksAreSpecial = cms.bool(True),
+    # count the shared hits through an index of the TrackingParticle sim track ids
+    # instead of comparing every track with every TrackingParticle (same result)
+    UseIndexedHitCounting = cms.bool(True),
+    # sim track ids of the hits made once per event by recHitSimTrackIdMap_cfi,
+    # the TrackerHitAssociator is used for the hits that are not in it
+    recHitSimTrackIdMap = cms.InputTag("recHitSimTrackIdMap"),
+    # strip hit to sim track links of the TrackerHitAssociator, the compact ones in TrackAssociatorByHitsCompact_cfi
+    useCompactStripLinks = cms.bool(False),
     AbsoluteNumberOfHits = cms.bool(False),
     associateStrip = cms.bool(True),
     Purity_SimToReco = cms.double(0.75),
@@ -5,3 +5,7 @@ from TrackPropagation.SteppingHelixPropagator.SteppingHelixPropagatorAlong_cfi i
 
 from SimTracker.TrackAssociation.TrackAssociatorByPosition_cfi import *
 
+# reference hits read by the position associators through referenceStates: put this sequence before
+# the modules that call them, the associators look for the hits themselves if the product is missing
+from SimTracker.TrackAssociation.trackingParticleReferenceStates_cfi import *
+trackingParticleReferenceStatesSequence = cms.Sequence(trackingParticleReferenceStates)
@@ -17,7 +17,20 @@ TrackAssociatorByPosition = cms.ESProducer("TrackAssociatorByPositionESProducer"
     method = cms.string('dist'),
     QCut = cms.double(10.0),
     # False is the old behavior, True will use also the muon simhits to do the matching.                                       
-    ConsiderAllSimHits = cms.bool(False)
+    ConsiderAllSimHits = cms.bool(False),
+    # reference hits of the TrackingParticles made once per event by trackingParticleReferenceStates_cfi,
+    # each associator looks for them itself if it's not there or was made with other settings
+    referenceStates = cms.InputTag("trackingParticleReferenceStates"),
+    # only propagate the pairs close in eta-phi: the margin (rad) comes on top of the angle QCut stands for and of the bending;
+    # switched off with MinIfNoMatch, whose best pair may be far away
+    usePreselection = cms.bool(False),
+    preselectionMargin = cms.double(0.3),
+    # also compare the pairs rejected by the preselection and report the ones that pass QCut
+    validatePreselection = cms.bool(False),
+    # dist, momdr and posdr without MinIfNoMatch: first propagate with an analytical helix and reject the pairs above prePropagationCutFactor*QCut;
+    # only inside the solenoid, the pairs with a track state or a reference hit beyond it (ConsiderAllSimHits) are always propagated
+    usePrePropagation = cms.bool(False),
+    prePropagationCutFactor = cms.double(5.0)
 )
 
 
@@ -9,5 +9,9 @@ quickTrackAssociatorByHits = cms.ESProducer("QuickTrackAssociatorByHitsESProduce
 	ThreeHitTracksAreSpecial = cms.bool(True),
 	associatePixel = cms.bool(True),
 	associateStrip = cms.bool(True),
+	# sim track ids of the hits made once per event by recHitSimTrackIdMap_cfi, the hit associator is used if it's not there
+	recHitSimTrackIdMap = cms.InputTag("recHitSimTrackIdMap"),
+	# associate the tracks that have all their hits in the map in a tbb::parallel_for, the result is the same
+	parallelTrackLoop = cms.bool(False),
     ComponentName = cms.string('quickTrackAssociatorByHits')
 )
@@ -0,0 +1,19 @@
+import FWCore.ParameterSet.Config as cms
+
+# SimTrack ids of the rechits of all the track collections associated in trackMCMatchSequence,
+# computed once per event and read by the hit associators through their recHitSimTrackIdMap parameter
+recHitSimTrackIdMap = cms.EDProducer("RecHitSimTrackIdMapProducer",
+    trackCollections = cms.VInputTag(
+        cms.InputTag("generalTracks"),
+        cms.InputTag("secStep"),
+        cms.InputTag("thStep"),
+        cms.InputTag("electronGsfTracks"),
+        cms.InputTag("ckfOutInTracksFromConversions"),
+        cms.InputTag("ckfInOutTracksFromConversions"),
+        cms.InputTag("globalMuons")
+    ),
+    # must match the settings of the associators that read the map
+    associatePixel = cms.bool(True),
+    associateStrip = cms.bool(True),
+    associateRecoTracks = cms.bool(True)
+)
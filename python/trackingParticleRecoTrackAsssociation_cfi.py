@@ -4,7 +4,9 @@ trackingParticleRecoTrackAsssociation = cms.EDProducer("TrackAssociatorEDProduce
     associator = cms.string('quickTrackAssociatorByHits'),
     label_tp = cms.InputTag("mergedtruth","MergedTrackTruth"),
     label_tr = cms.InputTag("generalTracks"),
-    ignoremissingtrackcollection=cms.untracked.bool(False)
+    ignoremissingtrackcollection=cms.untracked.bool(False),
+    # also put the pulls of the associated pairs in the event (TrackParameterPulls), only with TrackAssociatorByChi2
+    producePulls = cms.bool(False)
 )
 
 
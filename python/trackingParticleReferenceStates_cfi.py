@@ -0,0 +1,10 @@
+import FWCore.ParameterSet.Config as cms
+
+# reference hit of each TrackingParticle for TrackAssociatorByPosition, looked for once per event
+# and read by the position associators through their referenceStates parameter
+trackingParticleReferenceStates = cms.EDProducer("TrackingParticleReferenceStateProducer",
+    trackingParticles = cms.InputTag("mergedtruth","MergedTrackTruth"),
+    # must match the settings of the associators that read it
+    positionMinimumDistance = cms.double(0.0),
+    ConsiderAllSimHits = cms.bool(False)
+)
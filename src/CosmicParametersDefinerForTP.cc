@@ -12,11 +12,39 @@
 #include <DataFormats/GeometrySurface/interface/Surface.h>
 #include <DataFormats/GeometrySurface/interface/GloballyPositioned.h>
 #include <Geometry/CommonDetUnit/interface/GeomDet.h>
+#include "DataFormats/BeamSpot/interface/BeamSpot.h"
 #include "FWCore/Framework/interface/Event.h"
 #include <FWCore/Framework/interface/ESHandle.h>
 
 class TrajectoryStateClosestToBeamLineBuilder;
 
+namespace {
+  const TrackingParticle& particle(const TrackingParticleCollection& tPC, unsigned int i) { return tPC[i]; }
+  const TrackingParticle& particle(const TrackingParticleRefVector& tPC, unsigned int i) { return *tPC[i]; }
+}
+
+bool CosmicParametersDefinerForTP::closestHit(const TrackingParticle& tp, const TrackerGeometry& tracker, GlobalPoint& position, GlobalVector& momentum){
+  using namespace std;
+
+  double radius(9999);
+  bool found(0);
+
+  const vector<PSimHit> & simHits = tp.trackPSimHit(DetId::Tracker);
+  for(vector<PSimHit>::const_iterator it=simHits.begin(); it!=simHits.end(); ++it){
+    const GeomDet* tmpDet  = tracker.idToDet( DetId(it->detUnitId()) ) ;
+    LocalVector  lv = it->momentumAtEntry();
+    Local3DPoint lp = it->localPosition ();
+    GlobalVector gv = tmpDet->surface().toGlobal( lv );
+    GlobalPoint  gp = tmpDet->surface().toGlobal( lp );
+    if(gp.perp()<radius){
+      found=true;
+      radius = gp.perp();
+      momentum = gv;
+      position = gp;
+    }
+  }
+  return found;
+}
 
 ParticleBase::Vector
  CosmicParametersDefinerForTP::momentum(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticle& tp) const{
@@ -40,40 +68,16 @@ ParticleBase::Vector
   
   GlobalVector finalGV;
   GlobalPoint finalGP;
-  double radius(9999);
-  bool found(0);
   ParticleBase::Vector momentum(0,0,0);
+  ParticleBase::Point vertex(0,0,0);
   
-  const vector<PSimHit> & simHits = tp.trackPSimHit(DetId::Tracker);
-  for(vector<PSimHit>::const_iterator it=simHits.begin(); it!=simHits.end(); ++it){
-    const GeomDet* tmpDet  = tracker->idToDet( DetId(it->detUnitId()) ) ;
-    LocalVector  lv = it->momentumAtEntry();
-    Local3DPoint lp = it->localPosition ();
-    GlobalVector gv = tmpDet->surface().toGlobal( lv );
-    GlobalPoint  gp = tmpDet->surface().toGlobal( lp );
-    if(gp.perp()<radius){
-      found=true;
-      radius = gp.perp();
-      finalGV = gv;
-      finalGP = gp;
-    }
-  }
+  bool found = closestHit(tp, *tracker, finalGP, finalGV);
 
   //cout<<"found = "<<found<<endl;
   // cout<<"Closest Hit Position: ("<<finalGP.x()<<", "<<finalGP.y()<<", "<<finalGP.z()<<")"<<endl;
   //cout<<"Momentum at Closest Hit to BL: ("<<finalGV.x()<<", "<<finalGV.y()<<", "<<finalGV.z()<<")"<<endl;
 
-  if(found) 
-    {
-      FreeTrajectoryState ftsAtProduction(finalGP,finalGV,TrackCharge(tp.charge()),theMF.product());
-      TSCBLBuilderNoMaterial tscblBuilder;
-      TrajectoryStateClosestToBeamLine tsAtClosestApproach = tscblBuilder(ftsAtProduction,*bs);//as in TrackProducerAlgorithm
-      if(tsAtClosestApproach.isValid()){
-	GlobalVector p = tsAtClosestApproach.trackStateAtPCA().momentum();
-	momentum = ParticleBase::Vector(p.x(), p.y(), p.z());
-      }
-      return momentum;
-    }
+  if(found) momentumAndVertexAtPCA(finalGP, finalGV, tp.charge(), *theMF, *bs, momentum, vertex);
   return momentum;
 }
 
@@ -94,37 +98,48 @@ ParticleBase::Point CosmicParametersDefinerForTP::vertex(const edm::Event& iEven
 
   GlobalVector finalGV;
   GlobalPoint finalGP;
-  double radius(9999);
-  bool found(0);
+  ParticleBase::Vector momentum(0,0,0);
   ParticleBase::Point vertex(0,0,0);
 
-  const vector<PSimHit> & simHits = tp.trackPSimHit(DetId::Tracker);
-  for(vector<PSimHit>::const_iterator it=simHits.begin(); it!=simHits.end(); ++it){
-    const GeomDet* tmpDet  = tracker->idToDet( DetId(it->detUnitId()) ) ;
-    LocalVector  lv = it->momentumAtEntry();
-    Local3DPoint lp = it->localPosition ();
-    GlobalVector gv = tmpDet->surface().toGlobal( lv );
-    GlobalPoint  gp = tmpDet->surface().toGlobal( lp );
-    if(gp.perp()<radius){
-      found=true;
-      radius = gp.perp();
-      finalGV = gv;
-      finalGP = gp;
-    }
-  }
-  if(found)
-    {
-      FreeTrajectoryState ftsAtProduction(finalGP,finalGV,TrackCharge(tp.charge()),theMF.product());
-      TSCBLBuilderNoMaterial tscblBuilder;
-      TrajectoryStateClosestToBeamLine tsAtClosestApproach = tscblBuilder(ftsAtProduction,*bs);//as in TrackProducerAlgorithm
-      if(tsAtClosestApproach.isValid()){
-	GlobalPoint v = tsAtClosestApproach.trackStateAtPCA().position();
-	vertex = ParticleBase::Point(v.x()-bs->x0(),v.y()-bs->y0(),v.z()-bs->z0());
-      }
-      return vertex;
-    }
+  if(closestHit(tp, *tracker, finalGP, finalGV))
+    momentumAndVertexAtPCA(finalGP, finalGV, tp.charge(), *theMF, *bs, momentum, vertex);
   return vertex;
 }
 
+template <typename Collection>
+void CosmicParametersDefinerForTP::fillMomentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const Collection& tPC,
+							 std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const{
+  using namespace edm;
+
+  ESHandle<TrackerGeometry> tracker;
+  iSetup.get<TrackerDigiGeometryRecord>().get(tracker);
+  
+  edm::ESHandle<MagneticField> theMF;
+  iSetup.get<IdealMagneticFieldRecord>().get(theMF);
+  
+  edm::Handle<reco::BeamSpot> bs;
+  iEvent.getByLabel(InputTag("offlineBeamSpot"),bs);
+
+  momenta.assign(tPC.size(), ParticleBase::Vector(0,0,0));
+  vertices.assign(tPC.size(), ParticleBase::Point(0,0,0));
+  GlobalVector finalGV;
+  GlobalPoint finalGP;
+  for (unsigned int i=0; i<tPC.size(); ++i){
+    const TrackingParticle& tp = particle(tPC,i);
+    if(closestHit(tp, *tracker, finalGP, finalGV))
+      momentumAndVertexAtPCA(finalGP, finalGV, tp.charge(), *theMF, *bs, momenta[i], vertices[i]);
+  }
+}
+
+void CosmicParametersDefinerForTP::momentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticleCollection& tPC,
+						     std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const{
+  fillMomentumAndVertex(iEvent, iSetup, tPC, momenta, vertices);
+}
+
+void CosmicParametersDefinerForTP::momentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticleRefVector& tPC,
+						     std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const{
+  fillMomentumAndVertex(iEvent, iSetup, tPC, momenta, vertices);
+}
+
 
 TYPELOOKUP_DATA_REG(CosmicParametersDefinerForTP);
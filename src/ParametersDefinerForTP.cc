@@ -7,10 +7,38 @@
 #include "TrackingTools/PatternTools/interface/TSCPBuilderNoMaterial.h"
 #include "MagneticField/Engine/interface/MagneticField.h" 
 #include "MagneticField/Records/interface/IdealMagneticFieldRecord.h"
+#include "DataFormats/BeamSpot/interface/BeamSpot.h"
 #include "FWCore/Framework/interface/Event.h"
 #include <FWCore/Framework/interface/ESHandle.h>
 class TrajectoryStateClosestToBeamLineBuilder;
 
+namespace {
+  template <typename T>
+  GlobalPoint globalVertex(const T& tp) { return GlobalPoint(tp.vertex().x(),tp.vertex().y(),tp.vertex().z()); }
+  template <typename T>
+  GlobalVector globalMomentum(const T& tp) { return GlobalVector(tp.momentum().x(),tp.momentum().y(),tp.momentum().z()); }
+  const TrackingParticle& particle(const TrackingParticleCollection& tPC, unsigned int i) { return tPC[i]; }
+  const TrackingParticle& particle(const TrackingParticleRefVector& tPC, unsigned int i) { return *tPC[i]; }
+}
+
+void ParametersDefinerForTP::momentumAndVertexAtPCA(const GlobalPoint& position, const GlobalVector& momentum, int charge,
+						    const MagneticField& field, const reco::BeamSpot& bs,
+						    ParticleBase::Vector& momentumAtPCA, ParticleBase::Point& vertexAtPCA) {
+  momentumAtPCA = ParticleBase::Vector(0, 0, 0);
+  vertexAtPCA = ParticleBase::Point(0, 0, 0);
+
+  FreeTrajectoryState ftsAtProduction(position,momentum,TrackCharge(charge),&field);
+        
+  TSCBLBuilderNoMaterial tscblBuilder;
+  TrajectoryStateClosestToBeamLine tsAtClosestApproach = tscblBuilder(ftsAtProduction,bs);//as in TrackProducerAlgorithm
+  if(tsAtClosestApproach.isValid()){
+    GlobalVector p = tsAtClosestApproach.trackStateAtPCA().momentum();
+    momentumAtPCA = ParticleBase::Vector(p.x(), p.y(), p.z());
+    GlobalPoint v = tsAtClosestApproach.trackStateAtPCA().position();
+    vertexAtPCA = ParticleBase::Point(v.x()-bs.x0(),v.y()-bs.y0(),v.z()-bs.z0());
+  }
+}
+
 ParticleBase::Vector
 ParametersDefinerForTP::momentum(const edm::Event& iEvent, const edm::EventSetup& iSetup, const ParticleBase& tp) const{
   // to add a new implementation for cosmic. For the moment, it is just as for the base class:
@@ -23,19 +51,9 @@ ParametersDefinerForTP::momentum(const edm::Event& iEvent, const edm::EventSetup
   edm::Handle<reco::BeamSpot> bs;
   iEvent.getByLabel(InputTag("offlineBeamSpot"),bs);
 
-  ParticleBase::Vector momentum(0, 0, 0); 
-
-  FreeTrajectoryState ftsAtProduction(GlobalPoint(tp.vertex().x(),tp.vertex().y(),tp.vertex().z()),
-				      GlobalVector(tp.momentum().x(),tp.momentum().y(),tp.momentum().z()),
-				      TrackCharge(tp.charge()),
-				      theMF.product());
-        
-  TSCBLBuilderNoMaterial tscblBuilder;
-  TrajectoryStateClosestToBeamLine tsAtClosestApproach = tscblBuilder(ftsAtProduction,*bs);//as in TrackProducerAlgorithm
-  if(tsAtClosestApproach.isValid()){
-    GlobalVector p = tsAtClosestApproach.trackStateAtPCA().momentum();
-    momentum = ParticleBase::Vector(p.x(), p.y(), p.z());
-  }
+  ParticleBase::Vector momentum;
+  ParticleBase::Point vertex;
+  momentumAndVertexAtPCA(globalVertex(tp), globalMomentum(tp), tp.charge(), *theMF, *bs, momentum, vertex);
   return momentum;
 }
 
@@ -49,20 +67,39 @@ ParticleBase::Point ParametersDefinerForTP::vertex(const edm::Event& iEvent, con
   edm::Handle<reco::BeamSpot> bs;
   iEvent.getByLabel(InputTag("offlineBeamSpot"),bs);
 
-  ParticleBase::Point vertex(0, 0, 0);
+  ParticleBase::Vector momentum;
+  ParticleBase::Point vertex;
+  momentumAndVertexAtPCA(globalVertex(tp), globalMomentum(tp), tp.charge(), *theMF, *bs, momentum, vertex);
+  return vertex;
+}
+
+template <typename Collection>
+void ParametersDefinerForTP::fillMomentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const Collection& tPC,
+						   std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const{
+  using namespace edm;
+
+  edm::ESHandle<MagneticField> theMF;
+  iSetup.get<IdealMagneticFieldRecord>().get(theMF);
   
-  FreeTrajectoryState ftsAtProduction(GlobalPoint(tp.vertex().x(),tp.vertex().y(),tp.vertex().z()),
-				      GlobalVector(tp.momentum().x(),tp.momentum().y(),tp.momentum().z()),
-				      TrackCharge(tp.charge()),
-				      theMF.product());
-        
-  TSCBLBuilderNoMaterial tscblBuilder;
-  TrajectoryStateClosestToBeamLine tsAtClosestApproach = tscblBuilder(ftsAtProduction,*bs);//as in TrackProducerAlgorithm
-  if(tsAtClosestApproach.isValid()){
-    GlobalPoint v = tsAtClosestApproach.trackStateAtPCA().position();
-    vertex = ParticleBase::Point(v.x()-bs->x0(),v.y()-bs->y0(),v.z()-bs->z0());
+  edm::Handle<reco::BeamSpot> bs;
+  iEvent.getByLabel(InputTag("offlineBeamSpot"),bs);
+
+  momenta.resize(tPC.size());
+  vertices.resize(tPC.size());
+  for (unsigned int i=0; i<tPC.size(); ++i){
+    const TrackingParticle& tp = particle(tPC,i);
+    momentumAndVertexAtPCA(globalVertex(tp), globalMomentum(tp), tp.charge(), *theMF, *bs, momenta[i], vertices[i]);
   }
-  return vertex;
+}
+
+void ParametersDefinerForTP::momentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticleCollection& tPC,
+					       std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const{
+  fillMomentumAndVertex(iEvent, iSetup, tPC, momenta, vertices);
+}
+
+void ParametersDefinerForTP::momentumAndVertex(const edm::Event& iEvent, const edm::EventSetup& iSetup, const TrackingParticleRefVector& tPC,
+					       std::vector<ParticleBase::Vector>& momenta, std::vector<ParticleBase::Point>& vertices) const{
+  fillMomentumAndVertex(iEvent, iSetup, tPC, momenta, vertices);
 }
 
 
@@ -1,15 +1,44 @@
 #include "SimTracker/TrackAssociation/interface/QuickTrackAssociatorByHits.h"
 
 #include "SimTracker/TrackerHitAssociation/interface/TrackerHitAssociator.h"
+#include "FWCore/Framework/interface/Event.h"
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
 
+#include <algorithm>
+
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
+namespace
+{
+	/** @brief Looks the hits up in the RecHitSimTrackIdMap only, for the tracks whose hits are all in it.
+	 *
+	 * It's const and never touches the hit associator, so one of them is shared by all the threads of the parallel track loop.
+	 */
+	class MapOnlyHitIdLookup
+	{
+	public:
+		explicit MapOnlyHitIdLookup( const RecHitSimTrackIdFinder& simTrackIdFinder ) : simTrackIdFinder_( simTrackIdFinder ) {}
+		bool find( const TrackingRecHit& hit, std::vector<RecHitSimTrackIdFinder::SimTrackIdentifiers>& simTrackIdentifiers ) const
+		{
+			return simTrackIdFinder_.findInMap( hit, simTrackIdentifiers );
+		}
+		void associateHitId( const TrackingRecHit& hit, std::vector<RecHitSimTrackIdFinder::SimTrackIdentifiers>& simTrackIdentifiers ) const
+		{
+			find( hit, simTrackIdentifiers );
+		}
+	private:
+		const RecHitSimTrackIdFinder& simTrackIdFinder_;
+	};
+}
+
 QuickTrackAssociatorByHits::QuickTrackAssociatorByHits( const edm::ParameterSet& config )
-	: pHitAssociator_(NULL), pEventForWhichAssociatorIsValid_(NULL),
-	  absoluteNumberOfHits_( config.getParameter<bool>( "AbsoluteNumberOfHits" ) ),
+	: absoluteNumberOfHits_( config.getParameter<bool>( "AbsoluteNumberOfHits" ) ),
 	  qualitySimToReco_( config.getParameter<double>( "Quality_SimToReco" ) ),
 	  puritySimToReco_( config.getParameter<double>( "Purity_SimToReco" ) ),
 	  cutRecoToSim_( config.getParameter<double>( "Cut_RecoToSim" ) ),
-	  threeHitTracksAreSpecial_( config.getParameter<bool> ( "ThreeHitTracksAreSpecial" ) )
+	  threeHitTracksAreSpecial_( config.getParameter<bool> ( "ThreeHitTracksAreSpecial" ) ),
+	  parallelTrackLoop_( config.getParameter<bool>( "parallelTrackLoop" ) )
 {
 	//
 	// Check whether the denominator when working out the percentage of shared hits should
@@ -30,6 +59,14 @@ QuickTrackAssociatorByHits::QuickTrackAssociatorByHits( const edm::ParameterSet&
 	// and the EncodedEventId eventId) so I'm not interested in matching that to the PSimHit objects.
 	hitAssociatorParameters_.addParameter<bool>("associateRecoTracks",true);
 
+	// The RecHitSimTrackIdMap is made with both pixel and strip association, so it can't stand in for the hit associator otherwise
+	recHitSimTrackIdMapTag_=config.getParameter<edm::InputTag>("recHitSimTrackIdMap");
+	if( !recHitSimTrackIdMapTag_.label().empty() && !(config.getParameter<bool>("associatePixel") && config.getParameter<bool>("associateStrip")) )
+	{
+		edm::LogWarning("QuickTrackAssociatorByHits") << "recHitSimTrackIdMap ignored because associatePixel or associateStrip is false.";
+		recHitSimTrackIdMapTag_=edm::InputTag();
+	}
+
 	//
 	// Do some checks on whether UseGrouped or UseSplitting have been set. They're not used
 	// unlike the standard TrackAssociatorByHits so show a warning.
@@ -51,60 +88,13 @@ QuickTrackAssociatorByHits::QuickTrackAssociatorByHits( const edm::ParameterSet&
 
 QuickTrackAssociatorByHits::~QuickTrackAssociatorByHits()
 {
-	delete pHitAssociator_;
-}
-
-QuickTrackAssociatorByHits::QuickTrackAssociatorByHits( const QuickTrackAssociatorByHits& otherAssociator )
-	: pEventForWhichAssociatorIsValid_(otherAssociator.pEventForWhichAssociatorIsValid_),
-	  hitAssociatorParameters_(otherAssociator.hitAssociatorParameters_),
-	  absoluteNumberOfHits_(otherAssociator.absoluteNumberOfHits_),
-	  qualitySimToReco_(otherAssociator.qualitySimToReco_),
-	  puritySimToReco_(otherAssociator.puritySimToReco_),
-	  cutRecoToSim_(otherAssociator.cutRecoToSim_),
-	  threeHitTracksAreSpecial_(otherAssociator.threeHitTracksAreSpecial_),
-	  simToRecoDenominator_(otherAssociator.simToRecoDenominator_),
-	  pTrackCollectionHandle_(otherAssociator.pTrackCollectionHandle_),
-	  pTrackCollection_(otherAssociator.pTrackCollection_),
-	  pTrackingParticleCollectionHandle_(otherAssociator.pTrackingParticleCollectionHandle_),
-	  pTrackingParticleCollection_(otherAssociator.pTrackingParticleCollection_)
-
-{
-	// No operation other than the initialiser list. That copies everything straight from the other
-	// associator, except for pHitAssociator_ which needs a deep copy or both instances will try
-	// and free it on deletion.  If it wasn't for pHitAssociator_ the default copy constructor and
-	// assignment operator would be sufficient.
-
-	// Actually, need to check the other hit associator isn't null or the pointer dereference would
-	// probably cause a segmentation fault.
-	if( otherAssociator.pHitAssociator_ ) pHitAssociator_=new TrackerHitAssociator(*otherAssociator.pHitAssociator_);
-	else pHitAssociator_=NULL;
 }
 
-QuickTrackAssociatorByHits& QuickTrackAssociatorByHits::operator=( const QuickTrackAssociatorByHits& otherAssociator )
+QuickTrackAssociatorByHits::Context::Context( const edm::Event& event, const edm::ParameterSet& hitAssociatorParameters, const edm::InputTag& recHitSimTrackIdMapTag )
+	: simTrackIdFinder( event, hitAssociatorParameters, recHitSimTrackIdMapTag ),
+	  pTrackCollectionHandle(NULL), pTrackCollection(NULL),
+	  pTrackingParticleCollectionHandle(NULL), pTrackingParticleCollection(NULL)
 {
-	// Free up the old pHitAssociator_
-	delete pHitAssociator_;
-
-	//
-	// pHitAssociator_ needs to be given a deep copy of the object, but everything else can
-	// can be shallow copied from the other associator.
-	//
-	if( otherAssociator.pHitAssociator_ ) pHitAssociator_=new TrackerHitAssociator(*otherAssociator.pHitAssociator_);
-	else pHitAssociator_=NULL;
-	pEventForWhichAssociatorIsValid_=otherAssociator.pEventForWhichAssociatorIsValid_;
-	hitAssociatorParameters_=otherAssociator.hitAssociatorParameters_;
-	absoluteNumberOfHits_=otherAssociator.absoluteNumberOfHits_;
-	qualitySimToReco_=otherAssociator.qualitySimToReco_;
-	puritySimToReco_=otherAssociator.puritySimToReco_;
-	cutRecoToSim_=otherAssociator.cutRecoToSim_;
-	threeHitTracksAreSpecial_=otherAssociator.threeHitTracksAreSpecial_;
-	simToRecoDenominator_=otherAssociator.simToRecoDenominator_;
-	pTrackCollectionHandle_=otherAssociator.pTrackCollectionHandle_;
-	pTrackCollection_=otherAssociator.pTrackCollection_;
-	pTrackingParticleCollectionHandle_=otherAssociator.pTrackingParticleCollectionHandle_;
-	pTrackingParticleCollection_=otherAssociator.pTrackingParticleCollection_;
-
-	return *this;
 }
 
 reco::RecoToSimCollection QuickTrackAssociatorByHits::associateRecoToSim( edm::Handle<edm::View<reco::Track> >& trackCollectionHandle,
@@ -112,14 +102,14 @@ reco::RecoToSimCollection QuickTrackAssociatorByHits::associateRecoToSim( edm::H
                                                                               const edm::Event* pEvent,
                                                                               const edm::EventSetup* pSetup ) const
 {
-	initialiseHitAssociator( pEvent );
-	pTrackCollectionHandle_=&trackCollectionHandle;
-	pTrackingParticleCollectionHandle_=&trackingParticleCollectionHandle;
-	pTrackCollection_=NULL;
-	pTrackingParticleCollection_=NULL;
+	Context context( *pEvent, hitAssociatorParameters_, recHitSimTrackIdMapTag_ );
+	context.pTrackCollectionHandle=&trackCollectionHandle;
+	context.pTrackingParticleCollectionHandle=&trackingParticleCollectionHandle;
 
 	// This method checks which collection type is set to NULL, and uses the other one.
-	return associateRecoToSimImplementation();
+	reco::RecoToSimCollection returnValue;
+	associateImplementation( context, &returnValue, NULL );
+	return returnValue;
 }
 
 reco::SimToRecoCollection QuickTrackAssociatorByHits::associateSimToReco( edm::Handle<edm::View<reco::Track> >& trackCollectionHandle,
@@ -127,14 +117,14 @@ reco::SimToRecoCollection QuickTrackAssociatorByHits::associateSimToReco( edm::H
                                                                               const edm::Event * pEvent,
                                                                               const edm::EventSetup * pSetup ) const
 {
-	initialiseHitAssociator( pEvent );
-	pTrackCollectionHandle_=&trackCollectionHandle;
-	pTrackingParticleCollectionHandle_=&trackingParticleCollectionHandle;
-	pTrackCollection_=NULL;
-	pTrackingParticleCollection_=NULL;
+	Context context( *pEvent, hitAssociatorParameters_, recHitSimTrackIdMapTag_ );
+	context.pTrackCollectionHandle=&trackCollectionHandle;
+	context.pTrackingParticleCollectionHandle=&trackingParticleCollectionHandle;
 
 	// This method checks which collection type is set to NULL, and uses the other one.
-	return associateSimToRecoImplementation();
+	reco::SimToRecoCollection returnValue;
+	associateImplementation( context, NULL, &returnValue );
+	return returnValue;
 }
 
 
@@ -143,14 +133,14 @@ reco::RecoToSimCollection QuickTrackAssociatorByHits::associateRecoToSim(const e
                                                                              const edm::Event* pEvent,
                                                                              const edm::EventSetup* pSetup ) const
 {
-	initialiseHitAssociator( pEvent );
-	pTrackCollectionHandle_=NULL;
-	pTrackingParticleCollectionHandle_=NULL;
-	pTrackCollection_=&trackCollection;
-	pTrackingParticleCollection_=&trackingParticleCollection;
+	Context context( *pEvent, hitAssociatorParameters_, recHitSimTrackIdMapTag_ );
+	context.pTrackCollection=&trackCollection;
+	context.pTrackingParticleCollection=&trackingParticleCollection;
 
 	// This method checks which collection type is set to NULL, and uses the other one.
-	return associateRecoToSimImplementation();
+	reco::RecoToSimCollection returnValue;
+	associateImplementation( context, &returnValue, NULL );
+	return returnValue;
 }
 
 reco::SimToRecoCollection QuickTrackAssociatorByHits::associateSimToReco(const edm::RefToBaseVector<reco::Track>& trackCollection,
@@ -158,118 +148,177 @@ reco::SimToRecoCollection QuickTrackAssociatorByHits::associateSimToReco(const e
                                                                              const edm::Event* pEvent,
                                                                              const edm::EventSetup* pSetup ) const
 {
-	initialiseHitAssociator( pEvent );
-	pTrackCollectionHandle_=NULL;
-	pTrackingParticleCollectionHandle_=NULL;
-	pTrackCollection_=&trackCollection;
-	pTrackingParticleCollection_=&trackingParticleCollection;
+	Context context( *pEvent, hitAssociatorParameters_, recHitSimTrackIdMapTag_ );
+	context.pTrackCollection=&trackCollection;
+	context.pTrackingParticleCollection=&trackingParticleCollection;
 
 	// This method checks which collection type is set to NULL, and uses the other one.
-	return associateSimToRecoImplementation();
+	reco::SimToRecoCollection returnValue;
+	associateImplementation( context, NULL, &returnValue );
+	return returnValue;
 }
 
-reco::RecoToSimCollection QuickTrackAssociatorByHits::associateRecoToSimImplementation() const
+void QuickTrackAssociatorByHits::associateBoth( edm::Handle<edm::View<reco::Track> >& trackCollectionHandle,
+                                                edm::Handle<TrackingParticleCollection>& trackingParticleCollectionHandle,
+                                                const edm::Event* pEvent,
+                                                const edm::EventSetup* pSetup,
+                                                reco::RecoToSimCollection& recoToSim,
+                                                reco::SimToRecoCollection& simToReco ) const
 {
-	reco::RecoToSimCollection returnValue;
+	Context context( *pEvent, hitAssociatorParameters_, recHitSimTrackIdMapTag_ );
+	context.pTrackCollectionHandle=&trackCollectionHandle;
+	context.pTrackingParticleCollectionHandle=&trackingParticleCollectionHandle;
+
+	recoToSim=reco::RecoToSimCollection();
+	simToReco=reco::SimToRecoCollection();
+	// This method checks which collection type is set to NULL, and uses the other one.
+	associateImplementation( context, &recoToSim, &simToReco );
+}
+
+void QuickTrackAssociatorByHits::associateBoth( const edm::RefToBaseVector<reco::Track>& trackCollection,
+                                                const edm::RefVector<TrackingParticleCollection>& trackingParticleCollection,
+                                                const edm::Event* pEvent,
+                                                const edm::EventSetup* pSetup,
+                                                reco::RecoToSimCollection& recoToSim,
+                                                reco::SimToRecoCollection& simToReco ) const
+{
+	Context context( *pEvent, hitAssociatorParameters_, recHitSimTrackIdMapTag_ );
+	context.pTrackCollection=&trackCollection;
+	context.pTrackingParticleCollection=&trackingParticleCollection;
+
+	recoToSim=reco::RecoToSimCollection();
+	simToReco=reco::SimToRecoCollection();
+	// This method checks which collection type is set to NULL, and uses the other one.
+	associateImplementation( context, &recoToSim, &simToReco );
+}
+
+void QuickTrackAssociatorByHits::associateImplementation( Context& context, reco::RecoToSimCollection* pRecoToSim, reco::SimToRecoCollection* pSimToReco ) const
+{
+	SimTrackToTrackingParticleIndex trackingParticleIndex;
+	fillTrackingParticleIndex( context, trackingParticleIndex );
 
 	size_t collectionSize;
 	// Need to check which pointer is valid to get the collection size
-	if( pTrackCollection_ ) collectionSize=pTrackCollection_->size();
-	else collectionSize=(*pTrackCollectionHandle_)->size();
+	if( context.pTrackCollection ) collectionSize=context.pTrackCollection->size();
+	else collectionSize=(*context.pTrackCollectionHandle)->size();
 
+	std::vector<const reco::Track*> tracks( collectionSize ); // Get normal pointers for ease of use.
 	for( size_t i=0; i<collectionSize; ++i )
 	{
-		const reco::Track* pTrack; // Get a normal pointer for ease of use.
-		if( pTrackCollection_ ) pTrack=&*(*pTrackCollection_)[i]; // Possibly the most obscure dereference I've ever had to write
-		else pTrack=&(*pTrackCollectionHandle_->product())[i];
+		if( context.pTrackCollection ) tracks[i]=&*(*context.pTrackCollection)[i]; // Possibly the most obscure dereference I've ever had to write
+		else tracks[i]=&(*context.pTrackCollectionHandle->product())[i];
+	}
 
-		// The return of this function has first as the index and second as the number of associated hits
-		std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > trackingParticleQualityPairs=associateTrack( pTrack->recHitsBegin(),pTrack->recHitsEnd() );
-		for( std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> >::const_iterator iTrackingParticleQualityPair=trackingParticleQualityPairs.begin();
-						iTrackingParticleQualityPair!=trackingParticleQualityPairs.end(); ++iTrackingParticleQualityPair )
+	// The entries of this vector have first as an edm:Ref to the associated TrackingParticle, and second as the number of associated hits,
+	// with one entry per track. This is the expensive part, so it's only done once even if both association maps are required. Each track
+	// is independent so they can be done in parallel; the slots are filled by track index and the association maps are then filled
+	// serially in track order below, so the output is exactly the same whatever the number of threads.
+	std::vector< std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > > trackingParticleQualityPairsPerTrack( collectionSize );
+	if( parallelTrackLoop_ && context.simTrackIdFinder.recHitSimTrackIdMap() && collectionSize>1 )
+	{
+		// The hit associator can't be used from several threads, so only the tracks that have all their valid hits in the
+		// RecHitSimTrackIdMap go in the parallel loop, and they only read the map. Sorting them out goes through every hit
+		// of every track, so the track extras and rechit collections behind the refs are all loaded here in this thread and
+		// never lazily from the workers (the map lookup only uses the cluster indices, not the clusters).
+		const MapOnlyHitIdLookup mapOnlyHitIdLookup( context.simTrackIdFinder );
+		std::vector<size_t> tracksInMap;
+		std::vector<SimTrackIdentifiers> simTrackIdentifiers;
+		for( size_t i=0; i<collectionSize; ++i )
 		{
-			const edm::Ref<TrackingParticleCollection>& trackingParticleRef=iTrackingParticleQualityPair->first;
-			size_t numberOfSharedHits=iTrackingParticleQualityPair->second;
-			size_t numberOfValidTrackHits=pTrack->found();
-
-			if( numberOfSharedHits==0 ) continue; // No point in continuing if there was no association
-
-			//if electron subtract double counting
-			if( abs(trackingParticleRef->pdgId())==11 && (trackingParticleRef->g4Track_end() - trackingParticleRef->g4Track_begin()) > 1 )
+			bool allHitsInMap=true;
+			for( trackingRecHit_iterator iRecHit=tracks[i]->recHitsBegin(); iRecHit!=tracks[i]->recHitsEnd(); ++iRecHit )
 			{
-				numberOfSharedHits-=getDoubleCount( pTrack->recHitsBegin(), pTrack->recHitsEnd(), *trackingParticleRef );
+				const TrackingRecHit* pHit=getHitFromIter( iRecHit );
+				if( pHit->isValid() && !mapOnlyHitIdLookup.find( *pHit, simTrackIdentifiers ) ) allHitsInMap=false;
 			}
+			if( allHitsInMap ) tracksInMap.push_back( i );
+			else trackingParticleQualityPairsPerTrack[i]=associateTrack( context, context, trackingParticleIndex, tracks[i]->recHitsBegin(), tracks[i]->recHitsEnd() );
+		}
 
-			double quality;
-			if( absoluteNumberOfHits_ ) quality=static_cast<double>( numberOfSharedHits );
-			else if( numberOfValidTrackHits != 0 ) quality=(static_cast<double>(numberOfSharedHits) / static_cast<double>(numberOfValidTrackHits) );
-			else quality=0;
-
-			if( quality > cutRecoToSim_ && !( threeHitTracksAreSpecial_ && numberOfValidTrackHits==3 && numberOfSharedHits<3 ) )
+		const Context& sharedContext=context;
+		tbb::parallel_for( tbb::blocked_range<size_t>( 0, tracksInMap.size() ), [&]( const tbb::blocked_range<size_t>& range )
+		{
+			for( size_t j=range.begin(); j!=range.end(); ++j )
 			{
-				if( pTrackCollection_ ) returnValue.insert( (*pTrackCollection_)[i], std::make_pair( trackingParticleRef, quality ));
-				else returnValue.insert( edm::RefToBase<reco::Track>(*pTrackCollectionHandle_,i), std::make_pair( trackingParticleRef, quality ));
+				const size_t i=tracksInMap[j];
+				trackingParticleQualityPairsPerTrack[i]=associateTrack( sharedContext, mapOnlyHitIdLookup, trackingParticleIndex, tracks[i]->recHitsBegin(), tracks[i]->recHitsEnd() );
 			}
+		} );
+	}
+	else
+	{
+		for( size_t i=0; i<collectionSize; ++i )
+		{
+			trackingParticleQualityPairsPerTrack[i]=associateTrack( context, context, trackingParticleIndex, tracks[i]->recHitsBegin(), tracks[i]->recHitsEnd() );
 		}
 	}
-	return returnValue;
-}
-
-reco::SimToRecoCollection QuickTrackAssociatorByHits::associateSimToRecoImplementation() const
-{
-	reco::SimToRecoCollection returnValue;
-
-	size_t collectionSize;
-	// Need to check which pointer is valid to get the collection size
-	if( pTrackCollection_ ) collectionSize=pTrackCollection_->size();
-	else collectionSize=(*pTrackCollectionHandle_)->size();
 
 	for( size_t i=0; i<collectionSize; ++i )
 	{
-		const reco::Track* pTrack; // Get a normal pointer for ease of use.
-		if( pTrackCollection_ ) pTrack=&*(*pTrackCollection_)[i]; // Possibly the most obscure dereference I've ever had to write
-		else pTrack=&(*pTrackCollectionHandle_->product())[i];
-
-		// The return of this function has first as an edm:Ref to the associated TrackingParticle, and second as the number of associated hits
-		std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > trackingParticleQualityPairs=associateTrack( pTrack->recHitsBegin(),pTrack->recHitsEnd() );
+		const reco::Track* pTrack=tracks[i];
+		const std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> >& trackingParticleQualityPairs=trackingParticleQualityPairsPerTrack[i];
 		for( std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> >::const_iterator iTrackingParticleQualityPair=trackingParticleQualityPairs.begin();
 				iTrackingParticleQualityPair!=trackingParticleQualityPairs.end(); ++iTrackingParticleQualityPair )
 		{
 			const edm::Ref<TrackingParticleCollection>& trackingParticleRef=iTrackingParticleQualityPair->first;
-			size_t numberOfSharedHits=iTrackingParticleQualityPair->second;
 			size_t numberOfValidTrackHits=pTrack->found();
-			size_t numberOfSimulatedHits=0; // Set a few lines below, but only if required.
 
-			if( numberOfSharedHits==0 ) continue; // No point in continuing if there was no association
+			if( iTrackingParticleQualityPair->second==0 ) continue; // No point in continuing if there was no association
 
-			if( simToRecoDenominator_==denomsim || (numberOfSharedHits<3 && threeHitTracksAreSpecial_) ) // the numberOfSimulatedHits is not always required, so can skip counting in some circumstances
+			if( pRecoToSim )
 			{
-				// Note that in the standard TrackAssociatorByHits, all of the hits in associatedTrackingParticleHits are checked for
-				// various things.  I'm not sure what these checks are for but they depend on the UseGrouping and UseSplitting settings.
-				// This associator works as though both UseGrouping and UseSplitting were set to true, i.e. just counts the number of
-				// hits in the tracker.
-				numberOfSimulatedHits=trackingParticleRef->trackPSimHit(DetId::Tracker).size();
-			}
+				size_t numberOfSharedHits=iTrackingParticleQualityPair->second;
 
-			double purity=static_cast<double>(numberOfSharedHits)/static_cast<double>(numberOfValidTrackHits);
-			double quality;
-			if( absoluteNumberOfHits_ ) quality=static_cast<double>(numberOfSharedHits);
-			else if( simToRecoDenominator_==denomsim && numberOfSimulatedHits != 0 ) quality=static_cast<double>(numberOfSharedHits)/static_cast<double>(numberOfSimulatedHits);
-			else if( simToRecoDenominator_==denomreco && numberOfValidTrackHits != 0 ) quality=purity;
-			else quality=0;
+				//if electron subtract double counting
+				if( abs(trackingParticleRef->pdgId())==11 && (trackingParticleRef->g4Track_end() - trackingParticleRef->g4Track_begin()) > 1 )
+				{
+					numberOfSharedHits-=getDoubleCount( context, pTrack->recHitsBegin(), pTrack->recHitsEnd(), *trackingParticleRef );
+				}
+
+				double quality;
+				if( absoluteNumberOfHits_ ) quality=static_cast<double>( numberOfSharedHits );
+				else if( numberOfValidTrackHits != 0 ) quality=(static_cast<double>(numberOfSharedHits) / static_cast<double>(numberOfValidTrackHits) );
+				else quality=0;
+
+				if( quality > cutRecoToSim_ && !( threeHitTracksAreSpecial_ && numberOfValidTrackHits==3 && numberOfSharedHits<3 ) )
+				{
+					if( context.pTrackCollection ) pRecoToSim->insert( (*context.pTrackCollection)[i], std::make_pair( trackingParticleRef, quality ));
+					else pRecoToSim->insert( edm::RefToBase<reco::Track>(*context.pTrackCollectionHandle,i), std::make_pair( trackingParticleRef, quality ));
+				}
+			}
 
-			if( quality>qualitySimToReco_ && !( threeHitTracksAreSpecial_ && numberOfSimulatedHits==3 && numberOfSharedHits<3 ) && ( absoluteNumberOfHits_ || (purity>puritySimToReco_) ) )
+			if( pSimToReco )
 			{
-				if( pTrackCollection_ ) returnValue.insert( trackingParticleRef, std::make_pair( (*pTrackCollection_)[i], quality ) );
-				else returnValue.insert( trackingParticleRef, std::make_pair( edm::RefToBase<reco::Track>(*pTrackCollectionHandle_,i) , quality ) );
+				size_t numberOfSharedHits=iTrackingParticleQualityPair->second;
+				size_t numberOfSimulatedHits=0; // Set a few lines below, but only if required.
+
+				if( simToRecoDenominator_==denomsim || (numberOfSharedHits<3 && threeHitTracksAreSpecial_) ) // the numberOfSimulatedHits is not always required, so can skip counting in some circumstances
+				{
+					// Note that in the standard TrackAssociatorByHits, all of the hits in associatedTrackingParticleHits are checked for
+					// various things.  I'm not sure what these checks are for but they depend on the UseGrouping and UseSplitting settings.
+					// This associator works as though both UseGrouping and UseSplitting were set to true, i.e. just counts the number of
+					// hits in the tracker.
+					numberOfSimulatedHits=trackingParticleRef->trackPSimHit(DetId::Tracker).size();
+				}
+
+				double purity=static_cast<double>(numberOfSharedHits)/static_cast<double>(numberOfValidTrackHits);
+				double quality;
+				if( absoluteNumberOfHits_ ) quality=static_cast<double>(numberOfSharedHits);
+				else if( simToRecoDenominator_==denomsim && numberOfSimulatedHits != 0 ) quality=static_cast<double>(numberOfSharedHits)/static_cast<double>(numberOfSimulatedHits);
+				else if( simToRecoDenominator_==denomreco && numberOfValidTrackHits != 0 ) quality=purity;
+				else quality=0;
+
+				if( quality>qualitySimToReco_ && !( threeHitTracksAreSpecial_ && numberOfSimulatedHits==3 && numberOfSharedHits<3 ) && ( absoluteNumberOfHits_ || (purity>puritySimToReco_) ) )
+				{
+					if( context.pTrackCollection ) pSimToReco->insert( trackingParticleRef, std::make_pair( (*context.pTrackCollection)[i], quality ) );
+					else pSimToReco->insert( trackingParticleRef, std::make_pair( edm::RefToBase<reco::Track>(*context.pTrackCollectionHandle,i) , quality ) );
+				}
 			}
 		}
 	}
-	return returnValue;
-
 }
 
-template<typename iter> std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > QuickTrackAssociatorByHits::associateTrack( iter begin, iter end ) const
+template<typename iter, typename HitIdLookup> std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > QuickTrackAssociatorByHits::associateTrack( const Context& context, HitIdLookup& hitIdLookup, const SimTrackToTrackingParticleIndex& trackingParticleIndex, iter begin, iter end ) const
 {
 	// The pairs in this vector have a Ref to the associated TrackingParticle as "first" and the number of associated hits as "second"
 	std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > returnValue;
@@ -277,41 +326,71 @@ template<typename iter> std::vector< std::pair<edm::Ref<TrackingParticleCollecti
 	// The pairs in this vector have first as the sim track identifiers, and second the number of reco hits associated to that sim track.
 	// Most reco hits will probably have come from the same sim track, so the number of entries in this vector should be fewer than the
 	// number of reco hits.  The pair::second entries should add up to the total number of reco hits though.
-	std::vector< std::pair<SimTrackIdentifiers,size_t> > hitIdentifiers=getAllSimTrackIdentifiers(begin, end);
+	std::vector< std::pair<SimTrackIdentifiers,size_t> > hitIdentifiers=getAllSimTrackIdentifiers( hitIdLookup, begin, end );
+
+	// The pairs in this vector have the index of the TrackingParticle in the collection as "first" and the number of associated
+	// hits as "second". Look up each of the sim track identifiers in the index and add the number of reco hits associated to that
+	// sim track to every TrackingParticle that contains it. There are only ever a few TrackingParticles per track so a linear
+	// search is fine.
+	std::vector< std::pair<size_t,size_t> > indexCountPairs;
+	for( std::vector< std::pair<SimTrackIdentifiers,size_t> >::const_iterator iIdentifierCountPair=hitIdentifiers.begin(); iIdentifierCountPair!=hitIdentifiers.end(); ++iIdentifierCountPair )
+	{
+		const SimTrackToTrackingParticleIndex::IndexList* pTrackingParticleIndices=trackingParticleIndex.find( iIdentifierCountPair->first.first, iIdentifierCountPair->first.second );
+		if( pTrackingParticleIndices==NULL ) continue;
+
+		for( SimTrackToTrackingParticleIndex::IndexList::const_iterator iIndex=pTrackingParticleIndices->begin(); iIndex!=pTrackingParticleIndices->end(); ++iIndex )
+		{
+			std::vector< std::pair<size_t,size_t> >::iterator iIndexCountPair;
+			for( iIndexCountPair=indexCountPairs.begin(); iIndexCountPair!=indexCountPairs.end(); ++iIndexCountPair )
+			{
+				if( iIndexCountPair->first==*iIndex ) break;
+			}
+			if( iIndexCountPair==indexCountPairs.end() ) indexCountPairs.push_back( std::make_pair(*iIndex,iIdentifierCountPair->second) );
+			else iIndexCountPair->second+=iIdentifierCountPair->second;
+		}
+	}
+
+	// Keep the order of the TrackingParticle collection, so that the association maps come out exactly the same as
+	// when every TrackingParticle was checked in turn.
+	std::sort( indexCountPairs.begin(), indexCountPairs.end() );
+
+	for( std::vector< std::pair<size_t,size_t> >::const_iterator iIndexCountPair=indexCountPairs.begin(); iIndexCountPair!=indexCountPairs.end(); ++iIndexCountPair )
+	{
+		if( context.pTrackingParticleCollection ) returnValue.push_back( std::make_pair( (*context.pTrackingParticleCollection)[iIndexCountPair->first], iIndexCountPair->second ) );
+		else returnValue.push_back( std::make_pair( edm::Ref<TrackingParticleCollection>( *context.pTrackingParticleCollectionHandle, iIndexCountPair->first ), iIndexCountPair->second ) );
+	}
+
+	return returnValue;
+}
+
+void QuickTrackAssociatorByHits::fillTrackingParticleIndex( const Context& context, SimTrackToTrackingParticleIndex& trackingParticleIndex ) const
+{
+	trackingParticleIndex.clear();
 
-	// Loop over the TrackingParticles
 	size_t collectionSize;
-	if( pTrackingParticleCollection_ ) collectionSize=pTrackingParticleCollection_->size();
-	else collectionSize=(*pTrackingParticleCollectionHandle_)->size();
+	if( context.pTrackingParticleCollection ) collectionSize=context.pTrackingParticleCollection->size();
+	else collectionSize=(*context.pTrackingParticleCollectionHandle)->size();
+
+	trackingParticleIndex.reserve( collectionSize );
 
 	for( size_t i=0; i<collectionSize; ++i )
 	{
 		const TrackingParticle* pTrackingParticle; // Convert to raw pointer for ease of use
-		if( pTrackingParticleCollection_ ) pTrackingParticle=&*(*pTrackingParticleCollection_)[i];
-		else pTrackingParticle=&(*pTrackingParticleCollectionHandle_->product())[i];
+		if( context.pTrackingParticleCollection ) pTrackingParticle=&*(*context.pTrackingParticleCollection)[i];
+		else pTrackingParticle=&(*context.pTrackingParticleCollectionHandle->product())[i];
 
 		// Ignore TrackingParticles with no hits
 		if( pTrackingParticle->trackPSimHit().empty() ) continue;
 
-		size_t numberOfAssociatedHits=0;
-		// Loop over all of the sim track identifiers and see if any of them are part of this TrackingParticle. If they are, add
-		// the number of reco hits associated to that sim track to the total number of associated hits.
-		for( std::vector< std::pair<SimTrackIdentifiers,size_t> >::const_iterator iIdentifierCountPair=hitIdentifiers.begin(); iIdentifierCountPair!=hitIdentifiers.end(); ++iIdentifierCountPair )
+		// A TrackingParticle only counts once for each sim track identifier, even if more than one of its g4 tracks has it.
+		for( std::vector<SimTrack>::const_iterator iSimTrack=pTrackingParticle->g4Track_begin(); iSimTrack!=pTrackingParticle->g4Track_end(); ++iSimTrack )
 		{
-			if( trackingParticleContainsIdentifier( pTrackingParticle, iIdentifierCountPair->first ) ) numberOfAssociatedHits+=iIdentifierCountPair->second;
-		}
-
-		if( numberOfAssociatedHits>0 )
-		{
-			if( pTrackingParticleCollection_ ) returnValue.push_back( std::make_pair( (*pTrackingParticleCollection_)[i], numberOfAssociatedHits ) );
-			else returnValue.push_back( std::make_pair( edm::Ref<TrackingParticleCollection>( *pTrackingParticleCollectionHandle_, i ), numberOfAssociatedHits ) );
+			trackingParticleIndex.insertOnce( iSimTrack->trackId(), iSimTrack->eventId(), i );
 		}
 	}
-
-	return returnValue;
 }
 
-template<typename iter> std::vector< std::pair<QuickTrackAssociatorByHits::SimTrackIdentifiers,size_t> > QuickTrackAssociatorByHits::getAllSimTrackIdentifiers( iter begin, iter end ) const
+template<typename iter, typename HitIdLookup> std::vector< std::pair<QuickTrackAssociatorByHits::SimTrackIdentifiers,size_t> > QuickTrackAssociatorByHits::getAllSimTrackIdentifiers( HitIdLookup& hitIdLookup, iter begin, iter end ) const
 {
 	// The pairs in this vector have first as the sim track identifiers, and second the number of reco hits associated to that sim track.
 	std::vector< std::pair<SimTrackIdentifiers,size_t> > returnValue;
@@ -327,7 +406,7 @@ template<typename iter> std::vector< std::pair<QuickTrackAssociatorByHits::SimTr
 
 			// Get the identifiers for the sim track that this hit came from. There should only be one entry unless clusters
 			// have merged (as far as I know).
-                        pHitAssociator_->associateHitId( *(getHitFromIter(iRecHit)), simTrackIdentifiers ); // This call fills simTrackIdentifiers
+			hitIdLookup.associateHitId( *(getHitFromIter(iRecHit)), simTrackIdentifiers ); // This call fills simTrackIdentifiers
 
 			// Loop over each identifier, and add it to the return value only if it's not already in there
 			for( std::vector<SimTrackIdentifiers>::const_iterator iIdentifier=simTrackIdentifiers.begin(); iIdentifier!=simTrackIdentifiers.end(); ++iIdentifier )
@@ -350,24 +429,7 @@ template<typename iter> std::vector< std::pair<QuickTrackAssociatorByHits::SimTr
 	return returnValue;
 }
 
-bool QuickTrackAssociatorByHits::trackingParticleContainsIdentifier( const TrackingParticle* pTrackingParticle, const SimTrackIdentifiers& identifier ) const
-{
-	// Loop over all of the g4 tracks in the tracking particle
-	for( std::vector<SimTrack>::const_iterator iSimTrack=pTrackingParticle->g4Track_begin(); iSimTrack!=pTrackingParticle->g4Track_end(); ++iSimTrack )
-	{
-		// And see if the sim track identifiers match
-		if( iSimTrack->eventId()==identifier.second && iSimTrack->trackId()==identifier.first )
-		{
-			return true;
-		}
-	}
-
-	// If control has made it this far then none of the identifiers were found in
-	// any of the g4 tracks, so return false.
-	return false;
-}
-
-template<typename iter> int QuickTrackAssociatorByHits::getDoubleCount( iter startIterator, iter endIterator, const TrackingParticle& associatedTrackingParticle ) const
+template<typename iter> int QuickTrackAssociatorByHits::getDoubleCount( Context& context, iter startIterator, iter endIterator, const TrackingParticle& associatedTrackingParticle ) const
 {
 	// This method is largely copied from the standard TrackAssociatorByHits. Once I've tested how much difference
 	// it makes I'll go through and comment it properly.
@@ -379,7 +441,7 @@ template<typename iter> int QuickTrackAssociatorByHits::getDoubleCount( iter sta
 	{
 		int idcount=0;
 		SimTrackIdsDC.clear();
-		pHitAssociator_->associateHitId( *(getHitFromIter(iHit)), SimTrackIdsDC );
+		context.associateHitId( *(getHitFromIter(iHit)), SimTrackIdsDC );
 
 		if( SimTrackIdsDC.size() > 1 )
 		{
@@ -399,21 +461,9 @@ template<typename iter> int QuickTrackAssociatorByHits::getDoubleCount( iter sta
 }
 
 
-void QuickTrackAssociatorByHits::initialiseHitAssociator( const edm::Event* pEvent ) const
+void QuickTrackAssociatorByHits::Context::associateHitId( const TrackingRecHit& hit, std::vector<SimTrackIdentifiers>& simTrackIdentifiers )
 {
-	// The intention of this function was to check whether the hit associator is still valid
-	// (since in general associateSimToReco and associateRecoToSim are called for the same
-	// event). I was doing this by recording the event pointer and checking it hasn't changed
-	// but this doesn't appear to work. Until I find a way of uniquely identifying an event
-	// I'll just create it anew each time.
-//	if( pEventForWhichAssociatorIsValid_==pEvent && pEventForWhichAssociatorIsValid_!=NULL ) return; // Already set up so no need to do anything
-
-	// Free up the previous instantiation
-	delete pHitAssociator_;
-
-	// Create a new instantiation using the new event
-	pHitAssociator_=new TrackerHitAssociator( *pEvent, hitAssociatorParameters_ );
-	pEventForWhichAssociatorIsValid_=pEvent;
+	simTrackIdFinder.associateHitId( hit, simTrackIdentifiers );
 }
 
 
@@ -427,14 +477,14 @@ QuickTrackAssociatorByHits::associateRecoToSim(edm::Handle<edm::View<TrajectoryS
   edm::LogVerbatim("TrackAssociator") << "Starting TrackAssociatorByHits::associateRecoToSim - #seeds="
                                       << pSeedCollectionHandle_->size()<<" #TPs="<<trackingParticleCollectionHandle->size();
 
-  initialiseHitAssociator( pEvent );
-  pTrackCollectionHandle_=NULL;
-  pTrackingParticleCollectionHandle_=&trackingParticleCollectionHandle;
-  pTrackCollection_=NULL;
-  pTrackingParticleCollection_=NULL;
+  Context context( *pEvent, hitAssociatorParameters_, recHitSimTrackIdMapTag_ );
+  context.pTrackingParticleCollectionHandle=&trackingParticleCollectionHandle;
 
   reco::RecoToSimCollectionSeed  returnValue;
 
+  SimTrackToTrackingParticleIndex trackingParticleIndex;
+  fillTrackingParticleIndex( context, trackingParticleIndex );
+
   size_t collectionSize=pSeedCollectionHandle_->size();
   
   for( size_t i=0; i<collectionSize; ++i )
@@ -442,7 +492,7 @@ QuickTrackAssociatorByHits::associateRecoToSim(edm::Handle<edm::View<TrajectoryS
       const TrajectorySeed* pSeed = &(*pSeedCollectionHandle_)[i];
       
       // The return of this function has first as the index and second as the number of associated hits
-      std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > trackingParticleQualityPairs=associateTrack( pSeed->recHits().first,pSeed->recHits().second );
+      std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > trackingParticleQualityPairs=associateTrack( context, context, trackingParticleIndex, pSeed->recHits().first, pSeed->recHits().second );
       for( std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> >::const_iterator iTrackingParticleQualityPair=trackingParticleQualityPairs.begin();
 	   iTrackingParticleQualityPair!=trackingParticleQualityPairs.end(); ++iTrackingParticleQualityPair )
 	{
@@ -455,7 +505,7 @@ QuickTrackAssociatorByHits::associateRecoToSim(edm::Handle<edm::View<TrajectoryS
 	  //if electron subtract double counting
 	  if( abs(trackingParticleRef->pdgId())==11 && (trackingParticleRef->g4Track_end() - trackingParticleRef->g4Track_begin()) > 1 )
 	    {
-	      numberOfSharedHits-=getDoubleCount( pSeed->recHits().first, pSeed->recHits().second, *trackingParticleRef );
+	      numberOfSharedHits-=getDoubleCount( context, pSeed->recHits().first, pSeed->recHits().second, *trackingParticleRef );
 	    }
 	  
 	  double quality;
@@ -486,14 +536,14 @@ QuickTrackAssociatorByHits::associateSimToReco(edm::Handle<edm::View<TrajectoryS
   edm::LogVerbatim("TrackAssociator") << "Starting TrackAssociatorByHits::associateSimToReco - #seeds="
                                       <<pSeedCollectionHandle_->size()<<" #TPs="<<trackingParticleCollectionHandle->size();
 
-  initialiseHitAssociator( pEvent );
-  pTrackCollectionHandle_=NULL;
-  pTrackingParticleCollectionHandle_=&trackingParticleCollectionHandle;
-  pTrackCollection_=NULL;
-  pTrackingParticleCollection_=NULL;
+  Context context( *pEvent, hitAssociatorParameters_, recHitSimTrackIdMapTag_ );
+  context.pTrackingParticleCollectionHandle=&trackingParticleCollectionHandle;
 
   reco::SimToRecoCollectionSeed  returnValue;
 
+  SimTrackToTrackingParticleIndex trackingParticleIndex;
+  fillTrackingParticleIndex( context, trackingParticleIndex );
+
   size_t collectionSize=pSeedCollectionHandle_->size();
   
   for( size_t i=0; i<collectionSize; ++i )
@@ -501,7 +551,7 @@ QuickTrackAssociatorByHits::associateSimToReco(edm::Handle<edm::View<TrajectoryS
       const TrajectorySeed* pSeed=&(*pSeedCollectionHandle_)[i];
       
       // The return of this function has first as an edm:Ref to the associated TrackingParticle, and second as the number of associated hits
-      std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > trackingParticleQualityPairs=associateTrack( pSeed->recHits().first,pSeed->recHits().second );
+      std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> > trackingParticleQualityPairs=associateTrack( context, context, trackingParticleIndex, pSeed->recHits().first, pSeed->recHits().second );
       for( std::vector< std::pair<edm::Ref<TrackingParticleCollection>,size_t> >::const_iterator iTrackingParticleQualityPair=trackingParticleQualityPairs.begin();
 	   iTrackingParticleQualityPair!=trackingParticleQualityPairs.end(); ++iTrackingParticleQualityPair )
 	{
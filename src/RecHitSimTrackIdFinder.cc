@@ -0,0 +1,34 @@
+#include "SimTracker/TrackAssociation/interface/RecHitSimTrackIdFinder.h"
+
+#include "SimTracker/TrackerHitAssociation/interface/TrackerHitAssociator.h"
+#include "FWCore/Framework/interface/Event.h"
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+
+RecHitSimTrackIdFinder::RecHitSimTrackIdFinder(const edm::Event& event, const edm::ParameterSet& hitAssociatorParameters,
+					       const edm::InputTag& recHitSimTrackIdMapTag) :
+  event_(&event), hitAssociatorParameters_(&hitAssociatorParameters), map_(0), hitAssociator_(0) {
+  if (recHitSimTrackIdMapTag.label().empty()) return;
+  edm::Handle<RecHitSimTrackIdMap> map;
+  if (event.getByLabel(recHitSimTrackIdMapTag, map)) map_ = map.product();
+}
+
+RecHitSimTrackIdFinder::RecHitSimTrackIdFinder(TrackerHitAssociator& hitAssociator) :
+  event_(0), hitAssociatorParameters_(0), map_(0), hitAssociator_(&hitAssociator) {
+}
+
+RecHitSimTrackIdFinder::~RecHitSimTrackIdFinder() {
+}
+
+void RecHitSimTrackIdFinder::associateHitId(const TrackingRecHit& hit, std::vector<SimTrackIdentifiers>& simTrackIds) {
+  if (findInMap(hit, simTrackIds)) return;
+  if (!hitAssociator_) {
+    ownedHitAssociator_.reset(new TrackerHitAssociator(*event_, *hitAssociatorParameters_));
+    hitAssociator_ = ownedHitAssociator_.get();
+  }
+  hitAssociator_->associateHitId(hit, simTrackIds);
+}
+
+bool RecHitSimTrackIdFinder::findInMap(const TrackingRecHit& hit, std::vector<SimTrackIdentifiers>& simTrackIds) const {
+  RecHitSimTrackIdMap::Key key;
+  return map_ && RecHitSimTrackIdMap::makeKey(hit, key) && map_->find(key, simTrackIds);
+}
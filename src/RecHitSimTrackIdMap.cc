@@ -0,0 +1,74 @@
+#include "SimTracker/TrackAssociation/interface/RecHitSimTrackIdMap.h"
+
+#include "DataFormats/TrackingRecHit/interface/TrackingRecHit.h"
+#include "DataFormats/TrackerRecHit2D/interface/TrackerSingleRecHit.h"
+#include "DataFormats/TrackerRecHit2D/interface/SiStripMatchedRecHit2D.h"
+
+#include <algorithm>
+
+bool RecHitSimTrackIdMap::Key::operator<(const Key& other) const {
+  if (detId!=other.detId) return detId<other.detId;
+  if (clusters!=other.clusters) return clusters<other.clusters;
+  if (nClusters!=other.nClusters) return nClusters<other.nClusters;
+  if (firstCluster!=other.firstCluster) return firstCluster<other.firstCluster;
+  return secondCluster<other.secondCluster;
+}
+
+bool RecHitSimTrackIdMap::Key::operator==(const Key& other) const {
+  return detId==other.detId && clusters==other.clusters && nClusters==other.nClusters &&
+    firstCluster==other.firstCluster && secondCluster==other.secondCluster;
+}
+
+bool RecHitSimTrackIdMap::makeKey(const TrackingRecHit& hit, Key& key) {
+  key = Key();
+  key.detId = hit.geographicalId().rawId();
+
+  //pixel, strip 1D and 2D hits, and projected strip hits
+  if (const TrackerSingleRecHit * single = dynamic_cast<const TrackerSingleRecHit *>(&hit)) {
+    if (!single->omniClusterRef().isValid()) return false;
+    key.clusters = single->omniClusterRef().id();
+    key.nClusters = 1;
+    key.firstCluster = single->omniClusterRef().rawIndex();
+    return true;
+  }
+  //matched strip hits come from two clusters
+  if (const SiStripMatchedRecHit2D * matched = dynamic_cast<const SiStripMatchedRecHit2D *>(&hit)) {
+    if (!matched->monoClusterRef().isValid() || !matched->stereoClusterRef().isValid()) return false;
+    if (matched->monoClusterRef().id()!=matched->stereoClusterRef().id()) return false;
+    key.clusters = matched->monoClusterRef().id();
+    key.nClusters = 2;
+    key.firstCluster = matched->monoClusterRef().rawIndex();
+    key.secondCluster = matched->stereoClusterRef().rawIndex();
+    return true;
+  }
+  //anything else (multi rechits, fast sim hits, muon hits...) is not cached
+  return false;
+}
+
+void RecHitSimTrackIdMap::insert(const Key& key, const std::vector<SimTrackIdentifiers>& simTrackIds) {
+  Entry entry;
+  entry.key = key;
+  entry.begin = trackIds_.size();
+  for (std::vector<SimTrackIdentifiers>::const_iterator id = simTrackIds.begin(); id != simTrackIds.end(); ++id) {
+    trackIds_.push_back(id->first);
+    eventIds_.push_back(id->second);
+  }
+  entry.end = trackIds_.size();
+  entries_.push_back(entry);
+}
+
+void RecHitSimTrackIdMap::post_insert() {
+  std::sort(entries_.begin(), entries_.end());
+}
+
+bool RecHitSimTrackIdMap::find(const Key& key, std::vector<SimTrackIdentifiers>& simTrackIds) const {
+  simTrackIds.clear();
+  Entry searched;
+  searched.key = key;
+  std::vector<Entry>::const_iterator entry = std::lower_bound(entries_.begin(), entries_.end(), searched);
+  if (entry==entries_.end() || !(entry->key==key)) return false;
+  for (uint32_t i = entry->begin; i != entry->end; ++i) {
+    simTrackIds.push_back(SimTrackIdentifiers(trackIds_[i], eventIds_[i]));
+  }
+  return true;
+}
@@ -0,0 +1,21 @@
+#include "SimTracker/TrackAssociation/interface/SimTrackToTrackingParticleIndex.h"
+
+void SimTrackToTrackingParticleIndex::insert( uint32_t trackId, const EncodedEventId& eventId, size_t trackingParticleIndex )
+{
+	index_[key(trackId,eventId)].push_back( trackingParticleIndex );
+}
+
+void SimTrackToTrackingParticleIndex::insertOnce( uint32_t trackId, const EncodedEventId& eventId, size_t trackingParticleIndex )
+{
+	IndexList& trackingParticleIndices=index_[key(trackId,eventId)];
+	// The indices are inserted in increasing order, so if this TrackingParticle already has these
+	// identifiers it can only be the last entry.
+	if( trackingParticleIndices.empty() || trackingParticleIndices.back()!=trackingParticleIndex ) trackingParticleIndices.push_back( trackingParticleIndex );
+}
+
+const SimTrackToTrackingParticleIndex::IndexList* SimTrackToTrackingParticleIndex::find( uint32_t trackId, const EncodedEventId& eventId ) const
+{
+	std::unordered_map<uint64_t,IndexList>::const_iterator iEntry=index_.find( key(trackId,eventId) );
+	if( iEntry==index_.end() ) return NULL;
+	else return &iEntry->second;
+}
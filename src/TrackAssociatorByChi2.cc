@@ -2,15 +2,192 @@
 #include "SimDataFormats/TrackingAnalysis/interface/TrackingParticle.h"
 
 #include "DataFormats/Math/interface/deltaPhi.h"
+#include "DataFormats/Math/interface/invertPosDefMatrix.h"
 #include "DataFormats/GeometrySurface/interface/Line.h"
 #include "DataFormats/GeometryVector/interface/Pi.h"
 #include "TrackingTools/TrajectoryState/interface/FreeTrajectoryState.h"
 #include "TrackingTools/PatternTools/interface/TSCBLBuilderNoMaterial.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
 using namespace edm;
 using namespace reco;
 using namespace std;
 
+namespace {
+  /// d.invCov.d with the full inverted covariance, the sums are done in the same order as ROOT::Math::Dot(d * invCov, d).
+  /// Written out so that the loop over the particles, not these five terms, is the one that gets vectorised.
+  struct FullCovariance {
+    template<typename T>
+    static T column(const T (&d)[5], const T (&invCov)[5][5], unsigned int j) {
+      return d[0]*invCov[0][j] + d[1]*invCov[1][j] + d[2]*invCov[2][j] + d[3]*invCov[3][j] + d[4]*invCov[4][j];
+    }
+    template<typename T>
+    static T quadraticForm(const T (&d)[5], const T (&invCov)[5][5]) {
+      T sum = column(d, invCov, 0)*d[0];
+      sum += column(d, invCov, 1)*d[1];
+      sum += column(d, invCov, 2)*d[2];
+      sum += column(d, invCov, 3)*d[3];
+      sum += column(d, invCov, 4)*d[4];
+      return sum;
+    }
+  };
+
+  /// d.invCov.d when invCov is diagonal (onlyDiagonal): its diagonal holds the reciprocals of the variances.
+  /// Same value as FullCovariance, which only adds zeros.
+  struct DiagonalCovariance {
+    template<typename T>
+    static T quadraticForm(const T (&d)[5], const T (&invCov)[5][5]) {
+      T sum = (d[0]*invCov[0][0])*d[0];
+      sum += (d[1]*invCov[1][1])*d[1];
+      sum += (d[2]*invCov[2][2])*d[2];
+      sum += (d[3]*invCov[3][3])*d[3];
+      sum += (d[4]*invCov[4][4])*d[4];
+      return sum;
+    }
+  };
+
+  /// (x+value)-value is x rounded to the nearest integer for |x| well below 2^22 (float) or 2^51 (double),
+  /// as long as the compiler does not reassociate (no -ffast-math). The phi difference is brought into [-pi,pi]
+  /// with arithmetic only, which is vectorised without -fno-trapping-math (the comparisons need it) and,
+  /// unlike a conversion to int, is defined for NaN and inf.
+  template<typename T> struct RoundMagic;
+  template<> struct RoundMagic<float> { static constexpr float value = 12582912.f; };
+  template<> struct RoundMagic<double> { static constexpr double value = 6755399441055744.; };
+
+  /// chi2/5 of one track (parameters rPar, inverted covariance invCov) with n particles whose parameters are
+  /// in the five arrays sPar. There are no calls and no branches in the loop so that the compiler vectorises it.
+  template<typename Covariance, typename T>
+  void chi2Kernel(const T (&rPar)[5], const T (&invCov)[5][5], const T* const (&sPar)[5], size_t n, T* chi2) {
+    const T twoPi = 2*M_PI;
+    const T invTwoPi = 0.5/M_PI;
+    const T roundMagic = RoundMagic<T>::value;
+    const T* const qoverp = sPar[0];
+    const T* const lambda = sPar[1];
+    const T* const phi = sPar[2];
+    const T* const dxy = sPar[3];
+    const T* const dsz = sPar[4];
+    for (size_t k=0; k<n; ++k) {
+      T d[5];
+      d[0] = rPar[0]-qoverp[k];
+      d[1] = rPar[1]-lambda[k];
+      d[2] = rPar[2]-phi[k];
+      d[3] = rPar[3]-dxy[k];
+      d[4] = rPar[4]-dsz[k];
+      //same as reco::deltaPhi(d[2],0.), except for the sign of a difference within rounding of +-pi
+      d[2] -= twoPi*((d[2]*invTwoPi+roundMagic)-roundMagic);
+      chi2[k] = Covariance::quadraticForm(d, invCov)/5;
+    }
+  }
+
+  /// (reco - sim)/sigma of the five parameters of one track (parameters rPar, 1/sigma inverseError) with n particles,
+  /// with the same phi difference as chi2Kernel; pulls[i][k] is the pull of parameter i for particle k
+  template<typename T>
+  void pullKernel(const T (&rPar)[5], const T (&inverseError)[5], const T* const (&sPar)[5], size_t n, T* const (&pulls)[5]) {
+    const T twoPi = 2*M_PI;
+    const T invTwoPi = 0.5/M_PI;
+    const T roundMagic = RoundMagic<T>::value;
+    for (size_t k=0; k<n; ++k) {
+      T dphi = rPar[2]-sPar[2][k];
+      dphi -= twoPi*((dphi*invTwoPi+roundMagic)-roundMagic);
+      pulls[0][k] = (rPar[0]-sPar[0][k])*inverseError[0];
+      pulls[1][k] = (rPar[1]-sPar[1][k])*inverseError[1];
+      pulls[2][k] = dphi*inverseError[2];
+      pulls[3][k] = (rPar[3]-sPar[3][k])*inverseError[3];
+      pulls[4][k] = (rPar[4]-sPar[4][k])*inverseError[4];
+    }
+  }
+
+  /// floor(x/binWidth) limited to [first, last] before the conversion to int, which would overflow for a
+  /// large x; x must be finite
+  int clampedBin(double x, double binWidth, int first, int last) {
+    return int(std::max(double(first), std::min(std::floor(x/binWidth), double(last))));
+  }
+
+  /// Cholesky decomposition of the covariance: d.C^-1.d < r only constrains every |d_i| to sqrt(r*C_ii)
+  /// if C is positive definite
+  bool isPositiveDefinite(const TrackBase::CovarianceMatrix& cov) {
+    double l[5][5];
+    for (unsigned int j=0; j<5; j++) {
+      double diag = cov(j,j);
+      for (unsigned int k=0; k<j; k++) diag -= l[j][k]*l[j][k];
+      if (!(diag>0)) return false;
+      l[j][j] = std::sqrt(diag);
+      for (unsigned int i=j+1; i<5; i++) {
+	double offDiag = cov(i,j);
+	for (unsigned int k=0; k<j; k++) offDiag -= l[i][k]*l[j][k];
+	l[i][j] = offDiag/l[j][j];
+      }
+    }
+    return true;
+  }
+
+  /// qoverp, lambda, phi, dxy and dsz of the state with position v and momentum p
+  TrackBase::ParameterVector parametersAtPCA(const GlobalPoint& v, const GlobalVector& p, double charge) {
+    TrackBase::ParameterVector sParameters;
+    sParameters[0] = charge/p.mag();
+    sParameters[1] = Geom::halfPi() - p.theta();
+    sParameters[2] = p.phi();
+    sParameters[3] = (-v.x()*sin(p.phi())+v.y()*cos(p.phi()));
+    sParameters[4] = v.z()*p.perp()/p.mag() - (v.x()*p.x()+v.y()*p.y())/p.perp() * p.z()/p.mag();
+    return sParameters;
+  }
+
+  /// Position and momentum at the point of closest approach to the beam line of the helix starting at vertex
+  /// with momentum momAtVtx in the uniform field bz (Tesla). In the transverse plane the closest point of the
+  /// circle to the beam is where the line from the centre to the beam crosses it; the turn nearest to the
+  /// vertex is taken. The position of the tilted beam line is updated at the z of the solution twice.
+  /// Returns false if there is no such point (no transverse momentum, beam at the centre of the circle).
+  bool helixClosestApproachToBeamLine(const Basic3DVector<double>& vertex,
+				      const Basic3DVector<double>& momAtVtx,
+				      double charge, double bz,
+				      const reco::BeamSpot& bs,
+				      GlobalPoint& position, GlobalVector& momentum) {
+    const double pt = std::sqrt(momAtVtx.x()*momAtVtx.x()+momAtVtx.y()*momAtVtx.y());
+    if (!(pt>0)) return false;
+    const double cosPhi0 = momAtVtx.x()/pt;
+    const double sinPhi0 = momAtVtx.y()/pt;
+    //signed curvature dphi/ds, 0.0029979... GeV/(T cm) for a unit charge
+    const double w = -0.0029979245*charge*bz/pt;
+    const bool straight = std::abs(w)<1e-8;
+    const double xc = vertex.x() - (straight ? 0 : sinPhi0/w);
+    const double yc = vertex.y() + (straight ? 0 : cosPhi0/w);
+
+    double x = vertex.x(), y = vertex.y(), z = vertex.z();
+    double cosPhi = cosPhi0, sinPhi = sinPhi0;
+    for (unsigned int iteration=0; iteration<3; ++iteration) {
+      const double xb = bs.x0() + bs.dxdz()*(z-bs.z0());
+      const double yb = bs.y0() + bs.dydz()*(z-bs.z0());
+      double s;
+      if (straight) {
+	s = (xb-vertex.x())*cosPhi0 + (yb-vertex.y())*sinPhi0;
+	x = vertex.x() + s*cosPhi0;
+	y = vertex.y() + s*sinPhi0;
+      } else {
+	const double dx = xb-xc, dy = yb-yc;
+	const double d = std::sqrt(dx*dx+dy*dy);
+	if (!(d>0)) return false;
+	const double radius = 1/std::abs(w);
+	x = xc + radius*dx/d;
+	y = yc + radius*dy/d;
+	sinPhi = w*(x-xc);
+	cosPhi = -w*(y-yc);
+	s = std::atan2(sinPhi*cosPhi0-cosPhi*sinPhi0, cosPhi*cosPhi0+sinPhi*sinPhi0)/w;
+      }
+      z = vertex.z() + s*momAtVtx.z()/pt;
+    }
+    if (!(std::isfinite(x) && std::isfinite(y) && std::isfinite(z))) return false;
+    position = GlobalPoint(x, y, z);
+    momentum = GlobalVector(pt*cosPhi, pt*sinPhi, momAtVtx.z());
+    return true;
+  }
+}
+
 double TrackAssociatorByChi2::compareTracksParam ( TrackCollection::const_iterator rt, 
 						   SimTrackContainer::const_iterator st, 
 						   const math::XYZTLorentzVectorD vertexPosition, 
@@ -45,40 +222,43 @@ TrackAssociatorByChi2::compareTracksParam(const TrackCollection& rtColl,
   
   RecoToSimPairAssociation outputVec;
 
-  for (TrackCollection::const_iterator track=rtColl.begin(); track!=rtColl.end(); track++){
-     Chi2SimMap outMap;
-
-    TrackBase::ParameterVector rParameters = track->parameters();
+  TrackSimTrackChi2Collection pairs;
+  compareTracksParam(rtColl, stColl, svColl, bs, pairs);
 
-    TrackBase::CovarianceMatrix recoTrackCovMatrix = track->covariance();
-    if (onlyDiagonal){
-      for (unsigned int i=0;i<5;i++){
-	for (unsigned int j=0;j<5;j++){
-	  if (i!=j) recoTrackCovMatrix(i,j)=0;
-	}
-      }
-    }
-    recoTrackCovMatrix.Invert();
-
-    for (SimTrackContainer::const_iterator st=stColl.begin(); st!=stColl.end(); st++){
-
-      Basic3DVector<double> momAtVtx(st->momentum().x(),st->momentum().y(),st->momentum().z());
-      Basic3DVector<double> vert = (Basic3DVector<double>)  svColl[st->vertIndex()].position();
+  //within a track the pairs are sorted by chi2 then SimTrack index, so as before the last SimTrack with a given chi2 is kept
+  TrackSimTrackChi2Collection::const_iterator entry=pairs.begin();
+  for (unsigned int tindex=0; tindex<rtColl.size(); ++tindex){
+    Chi2SimMap outMap;
+    for (; entry!=pairs.end() && entry->trackIndex==tindex; ++entry) outMap[entry->chi2]=stColl[entry->simTrackIndex];
+    outputVec.push_back(RecoToSimPair(rtColl[tindex],outMap));
+  }
+  return outputVec;
+}
 
-      std::pair<bool,reco::TrackBase::ParameterVector> params = parametersAtClosestApproach(vert, momAtVtx, st->charge(), bs);
-      if (params.first){
-	TrackBase::ParameterVector sParameters = params.second;
-      
-	TrackBase::ParameterVector diffParameters = rParameters - sParameters;
-        diffParameters[2] = reco::deltaPhi(diffParameters[2],0.f);
-	double chi2 = ROOT::Math::Dot(diffParameters * recoTrackCovMatrix, diffParameters);
-	chi2/=5;
-	if (chi2<chi2cut) outMap[chi2]=*st;
-      }
+void TrackAssociatorByChi2::compareTracksParam(const TrackCollection& rtColl,
+					       const SimTrackContainer& stColl,
+					       const SimVertexContainer& svColl,
+					       const reco::BeamSpot& bs,
+					       TrackSimTrackChi2Collection& output) const{
+  output.clear();
+
+  TrackCache trackCache;
+  fillTrackCache(rtColl, trackCache);
+  SimParameterCache simCache;
+  fillSimParameterCache(stColl, svColl, bs, simCache);
+  SimParameterIndex simIndex;
+  if (useSimParameterIndex) simIndex.fill(simCache);
+  PassingPairs passing;
+  getPassingPairs(trackCache, simCache, useSimParameterIndex ? &simIndex : 0, passing);
+
+  for (unsigned int tindex=0; tindex<rtColl.size(); ++tindex){
+    size_t first = output.size();
+    for (std::vector<std::pair<unsigned int,double> >::const_iterator match=passing[tindex].begin(); match!=passing[tindex].end(); ++match){
+      TrackSimTrackChi2 entry = {tindex, match->first, match->second};
+      output.push_back(entry);
     }
-    outputVec.push_back(RecoToSimPair(*track,outMap));
+    std::sort(output.begin()+first, output.end());
   }
-  return outputVec;
 }
 
 double TrackAssociatorByChi2::getChi2(TrackBase::ParameterVector& rParameters,
@@ -88,59 +268,412 @@ double TrackAssociatorByChi2::getChi2(TrackBase::ParameterVector& rParameters,
 				      int& charge,
 				      const reco::BeamSpot& bs) const{
   
-  double chi2;
-  
   std::pair<bool,reco::TrackBase::ParameterVector> params = parametersAtClosestApproach(vert, momAtVtx, charge, bs);
   if (params.first){
-    TrackBase::ParameterVector sParameters=params.second;
-    
-    TrackBase::ParameterVector diffParameters = rParameters - sParameters;
-    diffParameters[2] = reco::deltaPhi(diffParameters[2],0.f);
-    chi2 = ROOT::Math::Dot(diffParameters * recoTrackCovMatrix, diffParameters);
-    chi2 /= 5;
-    
-    LogDebug("TrackAssociator") << "====NEW RECO TRACK WITH PT=" << sin(rParameters[1])*float(charge)/rParameters[0] << "====\n" 
-				<< "qoverp sim: " << sParameters[0] << "\n" 
-				<< "lambda sim: " << sParameters[1] << "\n" 
-				<< "phi    sim: " << sParameters[2] << "\n" 
-				<< "dxy    sim: " << sParameters[3] << "\n" 
-				<< "dsz    sim: " << sParameters[4] << "\n" 
-				<< ": " /*<< */ << "\n" 
-				<< "qoverp rec: " << rParameters[0] << "\n" 
-				<< "lambda rec: " << rParameters[1] << "\n" 
-				<< "phi    rec: " << rParameters[2] << "\n" 
-				<< "dxy    rec: " << rParameters[3] << "\n" 
-				<< "dsz    rec: " << rParameters[4] << "\n" 
-				<< ": " /*<< */ << "\n" 
-				<< "chi2: " << chi2 << "\n";
-    
-    return chi2;  
+    return getChi2(rParameters, recoTrackCovMatrix, params.second);
   } else {
     return 10000000000.;
   }
 }
 
+double TrackAssociatorByChi2::getChi2(const TrackBase::ParameterVector& rParameters,
+				      const TrackBase::CovarianceMatrix& recoTrackCovMatrix,
+				      const TrackBase::ParameterVector& sParameters) const{
+  
+  //the loop of getChi2s with a single particle
+  double rPar[5], invCov[5][5];
+  const double* sPar[5];
+  for (unsigned int i=0; i<5; i++) {
+    rPar[i] = rParameters[i];
+    sPar[i] = &sParameters[i];
+    for (unsigned int j=0; j<5; j++) invCov[i][j] = recoTrackCovMatrix(i,j);
+  }
+  double chi2;
+  doubleChi2Kernel(rPar, invCov, sPar, 1, &chi2);
+  
+  LogDebug("TrackAssociator") << "qoverp sim: " << sParameters[0] << "\n" 
+			      << "lambda sim: " << sParameters[1] << "\n" 
+			      << "phi    sim: " << sParameters[2] << "\n" 
+			      << "dxy    sim: " << sParameters[3] << "\n" 
+			      << "dsz    sim: " << sParameters[4] << "\n" 
+			      << ": " /*<< */ << "\n" 
+			      << "qoverp rec: " << rParameters[0] << "\n" 
+			      << "lambda rec: " << rParameters[1] << "\n" 
+			      << "phi    rec: " << rParameters[2] << "\n" 
+			      << "dxy    rec: " << rParameters[3] << "\n" 
+			      << "dsz    rec: " << rParameters[4] << "\n" 
+			      << ": " /*<< */ << "\n" 
+			      << "chi2: " << chi2 << "\n";
+  
+  return chi2;  
+}
+
+
+void TrackAssociatorByChi2::SimParameterCache::resize(size_t n){
+  for (unsigned int i=0; i<5; i++) parameters[i].assign(n, 0.);
+  for (unsigned int i=0; i<5; i++) floatParameters[i].clear();
+  valid.assign(n, 0);
+}
+
+void TrackAssociatorByChi2::SimParameterCache::set(size_t index,
+						   const TrackBase::ParameterVector& sParameters,
+						   bool isValid){
+  for (unsigned int i=0; i<5; i++) parameters[i][index] = sParameters[i];
+  valid[index] = isValid;
+}
+
+void TrackAssociatorByChi2::SimParameterCache::fillFloatParameters(){
+  for (unsigned int i=0; i<5; i++) floatParameters[i].assign(parameters[i].begin(), parameters[i].end());
+}
+
+void TrackAssociatorByChi2::SimParameterIndex::fill(const SimParameterCache& simCache){
+  const double phiBinWidth = 2*M_PI/nPhiBins;
+  const double lambdaBinWidth = M_PI/nLambdaBins;
+  const unsigned int nCells = nPhiBins*nLambdaBins;
+  const size_t n = simCache.valid.size();
+
+  std::vector<unsigned int> cells(n, nCells);
+  cellBegin.assign(nCells+1, 0);
+  unbinned.clear();
+  for (size_t k=0; k<n; ++k) {
+    if (!simCache.valid[k]) continue;
+    const double phi = simCache.parameters[2][k];
+    const double lambda = simCache.parameters[1][k];
+    if (!(std::isfinite(phi) && std::isfinite(lambda))) {
+      unbinned.push_back(k);
+      continue;
+    }
+    int phiBin = clampedBin(phi+M_PI, phiBinWidth, 0, nPhiBins-1);
+    int lambdaBin = clampedBin(lambda+M_PI/2, lambdaBinWidth, 0, nLambdaBins-1);
+    cells[k] = lambdaBin*nPhiBins + phiBin;
+    ++cellBegin[cells[k]+1];
+  }
+  for (unsigned int c=0; c<nCells; ++c) cellBegin[c+1] += cellBegin[c];
+
+  //the particles are added in increasing index order, so each cell is sorted
+  entries.resize(cellBegin[nCells]);
+  std::vector<unsigned int> next(cellBegin.begin(), cellBegin.end()-1);
+  for (size_t k=0; k<n; ++k) {
+    if (cells[k]!=nCells) entries[next[cells[k]]++] = k;
+  }
+}
+
+bool TrackAssociatorByChi2::SimParameterIndex::getCandidates(double phi, double phiWindow,
+							     double lambda, double lambdaWindow,
+							     std::vector<unsigned int>& candidates) const{
+  const double phiBinWidth = 2*M_PI/nPhiBins;
+  const double lambdaBinWidth = M_PI/nLambdaBins;
+  candidates.clear();
+  //the bins of phi are taken modulo nPhiBins below, which needs a phi in [-pi,pi]
+  if (!(std::isfinite(lambda) && std::isfinite(lambdaWindow) && std::abs(phi)<=M_PI && phiWindow>=0)) return false;
+
+  int lambdaFirst = clampedBin(lambda-lambdaWindow+M_PI/2, lambdaBinWidth, 0, nLambdaBins);
+  int lambdaLast = clampedBin(lambda+lambdaWindow+M_PI/2, lambdaBinWidth, -1, nLambdaBins-1);
+
+  //phi wraps around: the bins outside [0, nPhiBins) are taken modulo nPhiBins
+  int phiFirst = 0;
+  int phiLast = nPhiBins-1;
+  if (phiWindow<M_PI) {
+    phiFirst = clampedBin(phi-phiWindow+M_PI, phiBinWidth, -int(nPhiBins), 2*nPhiBins-1);
+    phiLast = clampedBin(phi+phiWindow+M_PI, phiBinWidth, -int(nPhiBins), 2*nPhiBins-1);
+    if (phiLast-phiFirst+1>=int(nPhiBins)) {
+      phiFirst = 0;
+      phiLast = nPhiBins-1;
+    }
+  }
+
+  for (int lambdaBin=lambdaFirst; lambdaBin<=lambdaLast; ++lambdaBin) {
+    for (int phiBin=phiFirst; phiBin<=phiLast; ++phiBin) {
+      unsigned int cell = lambdaBin*nPhiBins + (phiBin+int(nPhiBins))%nPhiBins;
+      candidates.insert(candidates.end(), entries.begin()+cellBegin[cell], entries.begin()+cellBegin[cell+1]);
+    }
+  }
+  candidates.insert(candidates.end(), unbinned.begin(), unbinned.end());
+  std::sort(candidates.begin(), candidates.end());
+  return true;
+}
+
+void TrackAssociatorByChi2::getChi2s(const TrackCache& trackCache,
+				     size_t trackIndex,
+				     const SimParameterCache& simCache,
+				     const SimParameterIndex* simIndex,
+				     Chi2Workspace& workspace) const{
+  const TrackBase::ParameterVector& rParameters = trackCache.parameters[trackIndex];
+  const TrackBase::CovarianceMatrix& recoTrackCovMatrix = trackCache.invertedCovariances[trackIndex];
+
+  //without an index, or if the covariance or the parameters give no finite window, all the particles are
+  //evaluated in place; otherwise the parameters of the particles in the window are first copied next to each other
+  bool gather = simIndex!=0 && simIndex->getCandidates(rParameters[2], trackCache.phiWindows[trackIndex],
+							rParameters[1], trackCache.lambdaWindows[trackIndex],
+							workspace.candidates);
+  if (!gather) {
+    workspace.candidates.resize(simCache.valid.size());
+    for (size_t k=0; k<workspace.candidates.size(); ++k) workspace.candidates[k] = k;
+  }
+  size_t n = workspace.candidates.size();
+  workspace.chi2s.resize(n);
+  if (n==0) return;
+
+  if (useFloatPrecision) {
+    float rPar[5], invCov[5][5];
+    const float* sPar[5];
+    for (unsigned int i=0; i<5; i++) {
+      rPar[i] = rParameters[i];
+      for (unsigned int j=0; j<5; j++) invCov[i][j] = recoTrackCovMatrix(i,j);
+      if (gather) {
+	workspace.floatParameters[i].resize(n);
+	for (size_t k=0; k<n; ++k) workspace.floatParameters[i][k] = simCache.floatParameters[i][workspace.candidates[k]];
+	sPar[i] = &workspace.floatParameters[i][0];
+      } else {
+	sPar[i] = &simCache.floatParameters[i][0];
+      }
+    }
+    workspace.floatChi2s.resize(n);
+    floatChi2Kernel(rPar, invCov, sPar, n, &workspace.floatChi2s[0]);
+    std::copy(workspace.floatChi2s.begin(), workspace.floatChi2s.end(), workspace.chi2s.begin());
+  } else {
+    double rPar[5], invCov[5][5];
+    const double* sPar[5];
+    for (unsigned int i=0; i<5; i++) {
+      rPar[i] = rParameters[i];
+      for (unsigned int j=0; j<5; j++) invCov[i][j] = recoTrackCovMatrix(i,j);
+      if (gather) {
+	workspace.parameters[i].resize(n);
+	for (size_t k=0; k<n; ++k) workspace.parameters[i][k] = simCache.parameters[i][workspace.candidates[k]];
+	sPar[i] = &workspace.parameters[i][0];
+      } else {
+	sPar[i] = &simCache.parameters[i][0];
+      }
+    }
+    doubleChi2Kernel(rPar, invCov, sPar, n, &workspace.chi2s[0]);
+  }
+}
+
+void TrackAssociatorByChi2::fillPassingPairs(const TrackCache& trackCache,
+					     size_t trackIndex,
+					     const SimParameterCache& simCache,
+					     const SimParameterIndex* simIndex,
+					     Chi2Workspace& workspace,
+					     std::vector<std::pair<unsigned int,double> >& passing,
+					     std::vector<float>* pulls) const{
+  getChi2s(trackCache, trackIndex, simCache, simIndex, workspace);
+  passing.clear();
+  for (size_t c=0; c<workspace.candidates.size(); ++c){
+    unsigned int index = workspace.candidates[c];
+    //skip tps with a very small pt
+    //if (sqrt(tPC[index].momentum().perp2())<0.5) continue;
+    //neutral particles and failed propagations are not valid
+    if (!simCache.valid[index]) continue;
+    double chi2 = workspace.chi2s[c];
+    if (chi2<chi2cut) passing.push_back(std::make_pair(index, chi2));
+  }
+  if (!pulls) return;
+
+  //the parameters of the passing particles are gathered, as for the chi2, and their pulls computed in one loop
+  size_t n = passing.size();
+  pulls->resize(5*n);
+  if (n==0) return;
+  double rPar[5], inverseError[5];
+  const double* sPar[5];
+  double* pull[5];
+  for (unsigned int i=0; i<5; i++) {
+    rPar[i] = trackCache.parameters[trackIndex][i];
+    inverseError[i] = trackCache.inverseErrors[trackIndex][i];
+    workspace.parameters[i].resize(n);
+    for (size_t k=0; k<n; ++k) workspace.parameters[i][k] = simCache.parameters[i][passing[k].first];
+    workspace.pulls[i].resize(n);
+    sPar[i] = &workspace.parameters[i][0];
+    pull[i] = &workspace.pulls[i][0];
+  }
+  pullKernel(rPar, inverseError, sPar, n, pull);
+  for (size_t k=0; k<n; ++k) {
+    for (unsigned int i=0; i<5; i++) (*pulls)[5*k+i] = workspace.pulls[i][k];
+  }
+}
+
+void TrackAssociatorByChi2::getPassingPairs(const TrackCache& trackCache,
+					    const SimParameterCache& simCache,
+					    const SimParameterIndex* simIndex,
+					    PassingPairs& passing,
+					    PassingPulls* pulls) const{
+  const size_t nTracks = trackCache.parameters.size();
+  passing.assign(nTracks, std::vector<std::pair<unsigned int,double> >());
+  if (pulls) pulls->assign(nTracks, std::vector<float>());
+
+  if (parallelTrackLoop && nTracks>1) {
+    //the tracks are independent: chunks of consecutive tracks are shared out by the TBB work stealing, each chunk
+    //with its own buffers, and every track writes its own slot so the merge by the caller is in track order
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, nTracks, 16), [&](const tbb::blocked_range<size_t>& range){
+      Chi2Workspace workspace;
+      for (size_t tindex=range.begin(); tindex!=range.end(); ++tindex){
+	fillPassingPairs(trackCache, tindex, simCache, simIndex, workspace, passing[tindex], pulls ? &(*pulls)[tindex] : 0);
+      }
+    });
+  } else {
+    Chi2Workspace workspace;
+    for (size_t tindex=0; tindex<nTracks; ++tindex){
+      fillPassingPairs(trackCache, tindex, simCache, simIndex, workspace, passing[tindex], pulls ? &(*pulls)[tindex] : 0);
+    }
+  }
+}
+
+void TrackAssociatorByChi2::getChi2s(const edm::RefToBaseVector<reco::Track>& tC,
+				     const std::vector<TrackIndexTrackingParticlePair>& pairs,
+				     const reco::BeamSpot& bs,
+				     std::vector<double>& chi2s) const{
+  TrackCache trackCache;
+  fillTrackCache(tC, trackCache);
+
+  //cache index of each TrackingParticle key, filled the first time it is used
+  const unsigned int notPropagated = std::numeric_limits<unsigned int>::max();
+  std::vector<unsigned int> cacheIndices;
+  std::vector<reco::TrackBase::ParameterVector> simParameters;
+  std::vector<char> valid;
+  double bz = beamSpotBz(bs);
+
+  chi2s.resize(pairs.size());
+  for (size_t i=0; i<pairs.size(); ++i){
+    const edm::Ref<TrackingParticleCollection>& tp = pairs[i].second;
+    if (tp.key()>=cacheIndices.size()) cacheIndices.resize(tp.key()+1, notPropagated);
+    if (cacheIndices[tp.key()]==notPropagated) {
+      int charge = tp->charge();
+      std::pair<bool,reco::TrackBase::ParameterVector> params(false, reco::TrackBase::ParameterVector());
+      if (charge!=0) {
+	Basic3DVector<double> momAtVtx(tp->momentum().x(),tp->momentum().y(),tp->momentum().z());
+	Basic3DVector<double> vert(tp->vertex().x(),tp->vertex().y(),tp->vertex().z());
+	params = simParametersAtClosestApproach(vert, momAtVtx, charge, bs, bz);
+      }
+      cacheIndices[tp.key()] = simParameters.size();
+      simParameters.push_back(params.second);
+      valid.push_back(params.first);
+    }
+    unsigned int cacheIndex = cacheIndices[tp.key()];
+    unsigned int tindex = pairs[i].first;
+    chi2s[i] = valid[cacheIndex] ?
+      getChi2(trackCache.parameters[tindex], trackCache.invertedCovariances[tindex], simParameters[cacheIndex]) :
+      10000000000.;
+  }
+}
 
 double TrackAssociatorByChi2::associateRecoToSim( TrackCollection::const_iterator rt, 
 						  TrackingParticleCollection::const_iterator tp, 
 						  const reco::BeamSpot& bs) const{  
   TrackBase::ParameterVector rParameters = rt->parameters();
-  TrackBase::CovarianceMatrix recoTrackCovMatrix = rt->covariance();
-  if (onlyDiagonal){
-    for (unsigned int i=0;i<5;i++){
-      for (unsigned int j=0;j<5;j++){
-	if (i!=j) recoTrackCovMatrix(i,j)=0;
-      }
-    }
-  } 
-  
-  recoTrackCovMatrix.Invert();
+  TrackBase::CovarianceMatrix recoTrackCovMatrix = invertedCovariance(*rt);
   Basic3DVector<double> momAtVtx(tp->momentum().x(),tp->momentum().y(),tp->momentum().z());
   Basic3DVector<double> vert(tp->vertex().x(),tp->vertex().y(),tp->vertex().z());
   int charge = tp->charge();
   return getChi2(rParameters,recoTrackCovMatrix,momAtVtx,vert,charge,bs);
 }
 
+TrackBase::CovarianceMatrix TrackAssociatorByChi2::invertedCovariance(const reco::Track& track) const{
+  if (onlyDiagonal){
+    TrackBase::CovarianceMatrix recoTrackCovMatrix;
+    for (unsigned int i=0;i<5;i++) recoTrackCovMatrix(i,i) = 1./track.covariance(i,i);
+    return recoTrackCovMatrix;
+  }
+  TrackBase::CovarianceMatrix recoTrackCovMatrix = track.covariance();
+  //Cholesky, the general inversion is only needed if the covariance is not positive definite
+  if (!invertPosDefMatrix(recoTrackCovMatrix)) {
+    recoTrackCovMatrix = track.covariance();
+    recoTrackCovMatrix.Invert();
+  }
+  return recoTrackCovMatrix;
+}
+
+void TrackAssociatorByChi2::bindChi2Kernels(){
+  if (onlyDiagonal) {
+    floatChi2Kernel = &chi2Kernel<DiagonalCovariance,float>;
+    doubleChi2Kernel = &chi2Kernel<DiagonalCovariance,double>;
+  } else {
+    floatChi2Kernel = &chi2Kernel<FullCovariance,float>;
+    doubleChi2Kernel = &chi2Kernel<FullCovariance,double>;
+  }
+}
+
+void TrackAssociatorByChi2::fillTrackCache(const edm::RefToBaseVector<reco::Track>& tC,
+					   TrackCache& trackCache) const{
+  trackCache.parameters.clear();
+  trackCache.invertedCovariances.clear();
+  trackCache.inverseErrors.clear();
+  trackCache.phiWindows.clear();
+  trackCache.lambdaWindows.clear();
+  for (RefToBaseVector<reco::Track>::const_iterator rt=tC.begin(); rt!=tC.end(); rt++){
+    addToTrackCache(**rt, trackCache);
+  }
+}
+
+void TrackAssociatorByChi2::fillTrackCache(const reco::TrackCollection& rtColl,
+					   TrackCache& trackCache) const{
+  trackCache.parameters.clear();
+  trackCache.invertedCovariances.clear();
+  trackCache.inverseErrors.clear();
+  trackCache.phiWindows.clear();
+  trackCache.lambdaWindows.clear();
+  for (TrackCollection::const_iterator track=rtColl.begin(); track!=rtColl.end(); track++){
+    addToTrackCache(*track, trackCache);
+  }
+}
+
+void TrackAssociatorByChi2::addToTrackCache(const reco::Track& track, TrackCache& trackCache) const{
+  trackCache.parameters.push_back(track.parameters());
+  trackCache.invertedCovariances.push_back(invertedCovariance(track));
+  TrackBase::ParameterVector inverseErrors;
+  for (unsigned int i=0;i<5;i++) inverseErrors[i] = 1./track.error(i);
+  trackCache.inverseErrors.push_back(inverseErrors);
+
+  const TrackBase::CovarianceMatrix& recoTrackCovMatrix = track.covariance();
+  bool positiveDefinite = true;
+  if (onlyDiagonal){
+    for (unsigned int i=0;i<5;i++) positiveDefinite &= recoTrackCovMatrix(i,i)>0;
+  } else {
+    positiveDefinite = isPositiveDefinite(recoTrackCovMatrix);
+  }
+  if (positiveDefinite) {
+    //the relative margin covers the rounding of the inversion and of the single precision chi2
+    trackCache.phiWindows.push_back(1.001*std::sqrt(5*chi2cut*recoTrackCovMatrix(2,2)) + 1e-9);
+    trackCache.lambdaWindows.push_back(1.001*std::sqrt(5*chi2cut*recoTrackCovMatrix(1,1)) + 1e-9);
+  } else {
+    trackCache.phiWindows.push_back(-1.);
+    trackCache.lambdaWindows.push_back(-1.);
+  }
+}
+
+template<typename C>
+void TrackAssociatorByChi2::fillSimParameterCache(const C& collection,
+						  const reco::BeamSpot& bs,
+						  SimParameterCache& simCache) const{
+  simCache.resize(collection.size());
+  double bz = beamSpotBz(bs);
+  int index=0;
+  for (typename C::const_iterator tp=collection.begin(); tp!=collection.end(); tp++, ++index){
+    //the neutral particles are skipped by the association loops
+    int charge = tp->charge();
+    if (charge==0) continue;
+    Basic3DVector<double> momAtVtx(tp->momentum().x(),tp->momentum().y(),tp->momentum().z());
+    Basic3DVector<double> vert(tp->vertex().x(),tp->vertex().y(),tp->vertex().z());
+    std::pair<bool,reco::TrackBase::ParameterVector> params = simParametersAtClosestApproach(vert, momAtVtx, charge, bs, bz);
+    simCache.set(index, params.second, params.first);
+  }
+  if (useFloatPrecision) simCache.fillFloatParameters();
+}
+
+void TrackAssociatorByChi2::fillSimParameterCache(const SimTrackContainer& stColl,
+						  const SimVertexContainer& svColl,
+						  const reco::BeamSpot& bs,
+						  SimParameterCache& simCache) const{
+  simCache.resize(stColl.size());
+  double bz = beamSpotBz(bs);
+  int index=0;
+  for (SimTrackContainer::const_iterator st=stColl.begin(); st!=stColl.end(); st++, ++index){
+    Basic3DVector<double> momAtVtx(st->momentum().x(),st->momentum().y(),st->momentum().z());
+    Basic3DVector<double> vert = (Basic3DVector<double>)  svColl[st->vertIndex()].position();
+    std::pair<bool,reco::TrackBase::ParameterVector> params = simParametersAtClosestApproach(vert, momAtVtx, st->charge(), bs, bz);
+    simCache.set(index, params.second, params.first);
+  }
+  if (useFloatPrecision) simCache.fillFloatParameters();
+}
+
 pair<bool,TrackBase::ParameterVector> 
 TrackAssociatorByChi2::parametersAtClosestApproach(Basic3DVector<double> vertex,
 						   Basic3DVector<double> momAtVtx,
@@ -158,11 +691,7 @@ TrackAssociatorByChi2::parametersAtClosestApproach(Basic3DVector<double> vertex,
     
     GlobalPoint v = tsAtClosestApproach.trackStateAtPCA().position();
     GlobalVector p = tsAtClosestApproach.trackStateAtPCA().momentum();
-    sParameters[0] = tsAtClosestApproach.trackStateAtPCA().charge()/p.mag();
-    sParameters[1] = Geom::halfPi() - p.theta();
-    sParameters[2] = p.phi();
-    sParameters[3] = (-v.x()*sin(p.phi())+v.y()*cos(p.phi()));
-    sParameters[4] = v.z()*p.perp()/p.mag() - (v.x()*p.x()+v.y()*p.y())/p.perp() * p.z()/p.mag();
+    sParameters = parametersAtPCA(v, p, tsAtClosestApproach.trackStateAtPCA().charge());
     
     return pair<bool,TrackBase::ParameterVector>(true,sParameters);
   } catch ( ... ) {
@@ -170,19 +699,144 @@ TrackAssociatorByChi2::parametersAtClosestApproach(Basic3DVector<double> vertex,
   }
 }
 
+pair<bool,TrackBase::ParameterVector> 
+TrackAssociatorByChi2::helixParametersAtClosestApproach(const Basic3DVector<double>& vertex,
+							const Basic3DVector<double>& momAtVtx,
+							float charge,
+							const BeamSpot& bs,
+							double bz) const{
+  TrackBase::ParameterVector sParameters;
+  GlobalPoint v;
+  GlobalVector p;
+  if (!helixClosestApproachToBeamLine(vertex, momAtVtx, charge, bz, bs, v, p))
+    return pair<bool,TrackBase::ParameterVector>(false,sParameters);
+  sParameters = parametersAtPCA(v, p, charge);
+  return pair<bool,TrackBase::ParameterVector>(true,sParameters);
+}
+
+pair<bool,TrackBase::ParameterVector> 
+TrackAssociatorByChi2::analyticalParametersAtClosestApproach(const Basic3DVector<double>& vertex,
+							     const Basic3DVector<double>& momAtVtx,
+							     float charge,
+							     const BeamSpot& bs) const{
+  double bz = theMF->inTesla(GlobalPoint(bs.x0(),bs.y0(),bs.z0())).z();
+  return helixParametersAtClosestApproach(vertex, momAtVtx, charge, bs, bz);
+}
+
+pair<bool,TrackBase::ParameterVector> 
+TrackAssociatorByChi2::simParametersAtClosestApproach(const Basic3DVector<double>& vertex,
+						      const Basic3DVector<double>& momAtVtx,
+						      float charge,
+						      const BeamSpot& bs,
+						      double bz) const{
+  if (useAnalyticalPCA) return helixParametersAtClosestApproach(vertex, momAtVtx, charge, bs, bz);
+  return parametersAtClosestApproach(vertex, momAtVtx, charge, bs);
+}
+
+double TrackAssociatorByChi2::beamSpotBz(const reco::BeamSpot& bs) const{
+  return useAnalyticalPCA ? theMF->inTesla(GlobalPoint(bs.x0(),bs.y0(),bs.z0())).z() : 0.;
+}
+
 RecoToSimCollection TrackAssociatorByChi2::associateRecoToSim(const edm::RefToBaseVector<reco::Track>& tC, 
 							      const edm::RefVector<TrackingParticleCollection>& tPCH,
 							      const edm::Event * e,
                                                               const edm::EventSetup *setup ) const{
+  RecoToSimCollection  outputCollection;
+  associateImplementation(tC, tPCH, e, &outputCollection, 0, 0);
+  return outputCollection;
+}
+
+
+SimToRecoCollection TrackAssociatorByChi2::associateSimToReco(const edm::RefToBaseVector<reco::Track>& tC, 
+							      const edm::RefVector<TrackingParticleCollection>& tPCH,
+							      const edm::Event * e,
+                                                              const edm::EventSetup *setup ) const {
+  SimToRecoCollection  outputCollection;
+  associateImplementation(tC, tPCH, e, 0, &outputCollection, 0);
+  return outputCollection;
+}
+
+void TrackAssociatorByChi2::associateBoth(edm::Handle<edm::View<reco::Track> >& tCH,
+					  edm::Handle<TrackingParticleCollection>& tPCH,
+					  const edm::Event * e,
+					  const edm::EventSetup *setup,
+					  reco::RecoToSimCollection& recoToSim,
+					  reco::SimToRecoCollection& simToReco) const{
+  edm::RefToBaseVector<reco::Track> tc(tCH);
+  for (unsigned int j=0; j<tCH->size();j++)
+    tc.push_back(edm::RefToBase<reco::Track>(tCH,j));
+
+  edm::RefVector<TrackingParticleCollection> tpc(tPCH.id());
+  for (unsigned int j=0; j<tPCH->size();j++)
+    tpc.push_back(edm::Ref<TrackingParticleCollection>(tPCH,j));
+
+  associateImplementation(tc, tpc, e, &recoToSim, &simToReco, 0);
+}
+
+void TrackAssociatorByChi2::associateBoth(const edm::RefToBaseVector<reco::Track>& tC,
+					  const edm::RefVector<TrackingParticleCollection>& tPCH,
+					  const edm::Event * e,
+					  const edm::EventSetup *setup,
+					  reco::RecoToSimCollection& recoToSim,
+					  reco::SimToRecoCollection& simToReco) const{
+  associateImplementation(tC, tPCH, e, &recoToSim, &simToReco, 0);
+}
+
+void TrackAssociatorByChi2::associateBoth(edm::Handle<edm::View<reco::Track> >& tCH,
+					  edm::Handle<TrackingParticleCollection>& tPCH,
+					  const edm::Event * e,
+					  const edm::EventSetup *setup,
+					  reco::RecoToSimCollection& recoToSim,
+					  reco::SimToRecoCollection& simToReco,
+					  TrackParameterPulls& pulls) const{
+  edm::RefToBaseVector<reco::Track> tc(tCH);
+  for (unsigned int j=0; j<tCH->size();j++)
+    tc.push_back(edm::RefToBase<reco::Track>(tCH,j));
+
+  edm::RefVector<TrackingParticleCollection> tpc(tPCH.id());
+  for (unsigned int j=0; j<tPCH->size();j++)
+    tpc.push_back(edm::Ref<TrackingParticleCollection>(tPCH,j));
+
+  associateImplementation(tc, tpc, e, &recoToSim, &simToReco, &pulls);
+}
+
+void TrackAssociatorByChi2::associateBoth(const edm::RefToBaseVector<reco::Track>& tC,
+					  const edm::RefVector<TrackingParticleCollection>& tPCH,
+					  const edm::Event * e,
+					  const edm::EventSetup *setup,
+					  reco::RecoToSimCollection& recoToSim,
+					  reco::SimToRecoCollection& simToReco,
+					  TrackParameterPulls& pulls) const{
+  associateImplementation(tC, tPCH, e, &recoToSim, &simToReco, &pulls);
+}
+
+void TrackAssociatorByChi2::associateImplementation(const edm::RefToBaseVector<reco::Track>& tC, 
+						    const edm::RefVector<TrackingParticleCollection>& tPCH,
+						    const edm::Event * e,
+						    reco::RecoToSimCollection* recoToSim,
+						    reco::SimToRecoCollection* simToReco,
+						    TrackParameterPulls* pulls) const{
   edm::Handle<reco::BeamSpot> recoBeamSpotHandle;
   e->getByLabel(bsSrc,recoBeamSpotHandle);
   reco::BeamSpot bs = *recoBeamSpotHandle;      
 
-  RecoToSimCollection  outputCollection;
+  TrackCache trackCache;
+  fillTrackCache(tC, trackCache);
 
   TrackingParticleCollection tPC;
   if (tPCH.size()!=0)  tPC = *tPCH.product();
 
+  SimParameterCache simCache;
+  fillSimParameterCache(tPC, bs, simCache);
+  SimParameterIndex simIndex;
+  if (useSimParameterIndex) simIndex.fill(simCache);
+
+  //the tracks are the outer loop so that the chi2 of a track with all the particles is computed in one go;
+  //the tracks of each particle are still inserted in track order
+  PassingPairs passing;
+  PassingPulls passingPulls;
+  getPassingPairs(trackCache, simCache, useSimParameterIndex ? &simIndex : 0, passing, pulls ? &passingPulls : 0);
+
   int tindex=0;
   for (RefToBaseVector<reco::Track>::const_iterator rt=tC.begin(); rt!=tC.end(); rt++, tindex++){
 
@@ -190,113 +844,88 @@ RecoToSimCollection TrackAssociatorByChi2::associateRecoToSim(const edm::RefToBa
 				<< "rec::Track #"<<tindex<<" with pt=" << (*rt)->pt() <<  "\n"
 				<< "===========================================" << "\n";
  
-    TrackBase::ParameterVector rParameters = (*rt)->parameters();
-
-    TrackBase::CovarianceMatrix recoTrackCovMatrix = (*rt)->covariance();
-    if (onlyDiagonal){
-      for (unsigned int i=0;i<5;i++){
-	for (unsigned int j=0;j<5;j++){
-	  if (i!=j) recoTrackCovMatrix(i,j)=0;
-	}
-      }
-    } 
-
-    recoTrackCovMatrix.Invert();
-
-    int tpindex =0;
-    for (TrackingParticleCollection::const_iterator tp=tPC.begin(); tp!=tPC.end(); tp++, ++tpindex){
-	
-      //skip tps with a very small pt
-      //if (sqrt(tp->momentum().perp2())<0.5) continue;
-      int charge = tp->charge();
-      if (charge==0) continue;
-      Basic3DVector<double> momAtVtx(tp->momentum().x(),tp->momentum().y(),tp->momentum().z());
-      Basic3DVector<double> vert=(Basic3DVector<double>) tp->vertex();
-
-      double chi2 = getChi2(rParameters,recoTrackCovMatrix,momAtVtx,vert,charge,bs);
-      
-      if (chi2<chi2cut) {
-	outputCollection.insert(tC[tindex], 
-				std::make_pair(edm::Ref<TrackingParticleCollection>(tPCH, tpindex),
-					       -chi2));//-chi2 because the Association Map is ordered using std::greater
+    //the neutral particles are not valid, so they are never in passing
+    for (size_t m=0; m<passing[tindex].size(); ++m){
+      const std::pair<unsigned int,double>& match = passing[tindex][m];
+      edm::Ref<TrackingParticleCollection> tp(tPCH, match.first);
+      //-chi2 because the Association Map is ordered using std::greater
+      if (recoToSim) recoToSim->insert(tC[tindex], std::make_pair(tp, -match.second));
+      if (simToReco) simToReco->insert(tp, std::make_pair(tC[tindex], -match.second));
+      if (pulls) {
+	float pairPulls[5];
+	for (unsigned int i=0; i<5; i++) pairPulls[i] = passingPulls[tindex][5*m+i];
+	pulls->insert(tC[tindex].key(), match.first, pairPulls);
       }
     }
   }
-  outputCollection.post_insert();
-  return outputCollection;
+  if (recoToSim) recoToSim->post_insert();
+  if (simToReco) simToReco->post_insert();
+  if (pulls) pulls->post_insert();
 }
 
 
-SimToRecoCollection TrackAssociatorByChi2::associateSimToReco(const edm::RefToBaseVector<reco::Track>& tC, 
-							      const edm::RefVector<TrackingParticleCollection>& tPCH,
-							      const edm::Event * e,
-                                                              const edm::EventSetup *setup ) const {
+void TrackAssociatorByChi2::prepareGenParticles(const edm::RefVector<GenParticleCollection>& tPCH,
+						const edm::Event * e,
+						GenParticleCandidates& candidates) const{
   edm::Handle<reco::BeamSpot> recoBeamSpotHandle;
   e->getByLabel(bsSrc,recoBeamSpotHandle);
-  reco::BeamSpot bs = *recoBeamSpotHandle;      
-
-  SimToRecoCollection  outputCollection;
-
-  TrackingParticleCollection tPC;
-  if (tPCH.size()!=0)  tPC = *tPCH.product();
-
-  int tpindex =0;
-  for (TrackingParticleCollection::const_iterator tp=tPC.begin(); tp!=tPC.end(); tp++, ++tpindex){
-    
-    //skip tps with a very small pt
-    //if (sqrt(tp->momentum().perp2())<0.5) continue;
-    int charge = tp->charge();
-    if (charge==0) continue;
-    
-    LogDebug("TrackAssociator") << "=========LOOKING FOR ASSOCIATION===========" << "\n"
-				<< "TrackingParticle #"<<tpindex<<" with pt=" << sqrt(tp->momentum().perp2()) << "\n"
-				<< "===========================================" << "\n";
-    
-    Basic3DVector<double> momAtVtx(tp->momentum().x(),tp->momentum().y(),tp->momentum().z());
-    Basic3DVector<double> vert(tp->vertex().x(),tp->vertex().y(),tp->vertex().z());
-      
-    int tindex=0;
-    for (RefToBaseVector<reco::Track>::const_iterator rt=tC.begin(); rt!=tC.end(); rt++, tindex++){
-      
-      TrackBase::ParameterVector rParameters = (*rt)->parameters();      
-      TrackBase::CovarianceMatrix recoTrackCovMatrix = (*rt)->covariance();
-      if (onlyDiagonal) {
-	for (unsigned int i=0;i<5;i++){
-	  for (unsigned int j=0;j<5;j++){
-	    if (i!=j) recoTrackCovMatrix(i,j)=0;
-	  }
-	}
-      }
-      recoTrackCovMatrix.Invert();
-      
-      double chi2 = getChi2(rParameters,recoTrackCovMatrix,momAtVtx,vert,charge,bs);
-      
-      if (chi2<chi2cut) {
-	outputCollection.insert(edm::Ref<TrackingParticleCollection>(tPCH, tpindex),
-				std::make_pair(tC[tindex],
-					       -chi2));//-chi2 because the Association Map is ordered using std::greater
-      }
+  const reco::BeamSpot& bs = *recoBeamSpotHandle;      
+
+  candidates.genParticles = &tPCH;
+  candidates.indices.clear();
+  if (tPCH.size()!=0) {
+    const GenParticleCollection& tPC = *tPCH.product();
+    for (size_t tpindex=0; tpindex<tPC.size(); ++tpindex){
+      const GenParticle& tp = tPC[tpindex];
+      if (tp.charge()==0) continue;
+      if (onlyStableGenParticles && tp.status()!=1) continue;
+      candidates.indices.push_back(tpindex);
     }
   }
-  outputCollection.post_insert();
-  return outputCollection;
-}
-
 
+  SimParameterCache& simCache = candidates.parameters;
+  simCache.resize(candidates.indices.size());
+  double bz = beamSpotBz(bs);
+  for (size_t c=0; c<candidates.indices.size(); ++c){
+    const GenParticle& tp = (*tPCH.product())[candidates.indices[c]];
+    Basic3DVector<double> momAtVtx(tp.momentum().x(),tp.momentum().y(),tp.momentum().z());
+    Basic3DVector<double> vert(tp.vertex().x(),tp.vertex().y(),tp.vertex().z());
+    std::pair<bool,reco::TrackBase::ParameterVector> params = simParametersAtClosestApproach(vert, momAtVtx, tp.charge(), bs, bz);
+    simCache.set(c, params.second, params.first);
+  }
+  if (useFloatPrecision) simCache.fillFloatParameters();
 
+  if (useSimParameterIndex) candidates.index.fill(simCache);
+}
 
 RecoToGenCollection TrackAssociatorByChi2::associateRecoToGen(const edm::RefToBaseVector<reco::Track>& tC, 
 							      const edm::RefVector<GenParticleCollection>& tPCH,
 							      const edm::Event * e,
                                                               const edm::EventSetup *setup ) const{
-  edm::Handle<reco::BeamSpot> recoBeamSpotHandle;
-  e->getByLabel(bsSrc,recoBeamSpotHandle);
-  reco::BeamSpot bs = *recoBeamSpotHandle;      
+  GenParticleCandidates candidates;
+  prepareGenParticles(tPCH, e, candidates);
+  return associateRecoToGen(tC, candidates);
+}
+
+GenToRecoCollection TrackAssociatorByChi2::associateGenToReco(const edm::RefToBaseVector<reco::Track>& tC, 
+							      const edm::RefVector<GenParticleCollection>& tPCH,
+							      const edm::Event * e,
+							      const edm::EventSetup *setup ) const {
+  GenParticleCandidates candidates;
+  prepareGenParticles(tPCH, e, candidates);
+  return associateGenToReco(tC, candidates);
+}
 
+RecoToGenCollection TrackAssociatorByChi2::associateRecoToGen(const edm::RefToBaseVector<reco::Track>& tC, 
+							      const GenParticleCandidates& candidates) const{
   RecoToGenCollection  outputCollection;
 
-  GenParticleCollection tPC;
-  if (tPCH.size()!=0)  tPC = *tPCH.product();
+  TrackCache trackCache;
+  fillTrackCache(tC, trackCache);
+
+  const edm::RefVector<GenParticleCollection>& tPCH = *candidates.genParticles;
+  PassingPairs passing;
+  getPassingPairs(trackCache, candidates.parameters, useSimParameterIndex ? &candidates.index : 0, passing);
 
   int tindex=0;
   for (RefToBaseVector<reco::Track>::const_iterator rt=tC.begin(); rt!=tC.end(); rt++, tindex++){
@@ -305,93 +934,35 @@ RecoToGenCollection TrackAssociatorByChi2::associateRecoToGen(const edm::RefToBa
 				<< "rec::Track #"<<tindex<<" with pt=" << (*rt)->pt() <<  "\n"
 				<< "===========================================" << "\n";
  
-    TrackBase::ParameterVector rParameters = (*rt)->parameters();
-
-    TrackBase::CovarianceMatrix recoTrackCovMatrix = (*rt)->covariance();
-    if (onlyDiagonal){
-      for (unsigned int i=0;i<5;i++){
-	for (unsigned int j=0;j<5;j++){
-	  if (i!=j) recoTrackCovMatrix(i,j)=0;
-	}
-      }
-    } 
-
-    recoTrackCovMatrix.Invert();
-
-    int tpindex =0;
-    for (GenParticleCollection::const_iterator tp=tPC.begin(); tp!=tPC.end(); tp++, ++tpindex){
-	
-      //skip tps with a very small pt
-      //if (sqrt(tp->momentum().perp2())<0.5) continue;
-      int charge = tp->charge();
-      if (charge==0) continue;
-      Basic3DVector<double> momAtVtx(tp->momentum().x(),tp->momentum().y(),tp->momentum().z());
-      Basic3DVector<double> vert=(Basic3DVector<double>) tp->vertex();
-
-      double chi2 = getChi2(rParameters,recoTrackCovMatrix,momAtVtx,vert,charge,bs);
-      
-      if (chi2<chi2cut) {
-	outputCollection.insert(tC[tindex], 
-				std::make_pair(edm::Ref<GenParticleCollection>(tPCH, tpindex),
-					       -chi2));//-chi2 because the Association Map is ordered using std::greater
-      }
+    for (std::vector<std::pair<unsigned int,double> >::const_iterator match=passing[tindex].begin(); match!=passing[tindex].end(); ++match){
+      outputCollection.insert(tC[tindex], 
+			      std::make_pair(edm::Ref<GenParticleCollection>(tPCH, candidates.indices[match->first]),
+					     -match->second));//-chi2 because the Association Map is ordered using std::greater
     }
   }
   outputCollection.post_insert();
   return outputCollection;
 }
 
-
 GenToRecoCollection TrackAssociatorByChi2::associateGenToReco(const edm::RefToBaseVector<reco::Track>& tC, 
-							      const edm::RefVector<GenParticleCollection>& tPCH,
-							      const edm::Event * e,
-							      const edm::EventSetup *setup ) const {
+							      const GenParticleCandidates& candidates) const{
+  GenToRecoCollection  outputCollection;
 
-  edm::Handle<reco::BeamSpot> recoBeamSpotHandle;
-  e->getByLabel(bsSrc,recoBeamSpotHandle);
-  reco::BeamSpot bs = *recoBeamSpotHandle;      
+  TrackCache trackCache;
+  fillTrackCache(tC, trackCache);
 
-  GenToRecoCollection  outputCollection;
+  const edm::RefVector<GenParticleCollection>& tPCH = *candidates.genParticles;
 
-  GenParticleCollection tPC;
-  if (tPCH.size()!=0)  tPC = *tPCH.product();
+  //the tracks are the outer loop so that the chi2 of a track with all the particles is computed in one go;
+  //the tracks of each particle are still inserted in track order
+  PassingPairs passing;
+  getPassingPairs(trackCache, candidates.parameters, useSimParameterIndex ? &candidates.index : 0, passing);
 
-  int tpindex =0;
-  for (GenParticleCollection::const_iterator tp=tPC.begin(); tp!=tPC.end(); tp++, ++tpindex){
-    
-    //skip tps with a very small pt
-    //if (sqrt(tp->momentum().perp2())<0.5) continue;
-    int charge = tp->charge();
-    if (charge==0) continue;
-    
-    LogDebug("TrackAssociator") << "=========LOOKING FOR ASSOCIATION===========" << "\n"
-				<< "TrackingParticle #"<<tpindex<<" with pt=" << sqrt(tp->momentum().perp2()) << "\n"
-				<< "===========================================" << "\n";
-    
-    Basic3DVector<double> momAtVtx(tp->momentum().x(),tp->momentum().y(),tp->momentum().z());
-    Basic3DVector<double> vert(tp->vertex().x(),tp->vertex().y(),tp->vertex().z());
-      
-    int tindex=0;
-    for (RefToBaseVector<reco::Track>::const_iterator rt=tC.begin(); rt!=tC.end(); rt++, tindex++){
-      
-      TrackBase::ParameterVector rParameters = (*rt)->parameters();      
-      TrackBase::CovarianceMatrix recoTrackCovMatrix = (*rt)->covariance();
-      if (onlyDiagonal) {
-	for (unsigned int i=0;i<5;i++){
-	  for (unsigned int j=0;j<5;j++){
-	    if (i!=j) recoTrackCovMatrix(i,j)=0;
-	  }
-	}
-      }
-      recoTrackCovMatrix.Invert();
-      
-      double chi2 = getChi2(rParameters,recoTrackCovMatrix,momAtVtx,vert,charge,bs);
-      
-      if (chi2<chi2cut) {
-	outputCollection.insert(edm::Ref<GenParticleCollection>(tPCH, tpindex),
-				std::make_pair(tC[tindex],
-					       -chi2));//-chi2 because the Association Map is ordered using std::greater
-      }
+  for (unsigned int tindex=0; tindex<tC.size(); ++tindex){
+    for (std::vector<std::pair<unsigned int,double> >::const_iterator match=passing[tindex].begin(); match!=passing[tindex].end(); ++match){
+      outputCollection.insert(edm::Ref<GenParticleCollection>(tPCH, candidates.indices[match->first]),
+			      std::make_pair(tC[tindex],
+					     -match->second));//-chi2 because the Association Map is ordered using std::greater
     }
   }
   outputCollection.post_insert();
@@ -27,6 +27,10 @@
 #include "DataFormats/SiPixelDetId/interface/PixelSubdetector.h"
 #include "DataFormats/TrackerCommon/interface/TrackerTopology.h"
 #include "Geometry/Records/interface/IdealGeometryRecord.h"
+#include "SimTracker/TrackAssociation/interface/RecHitSimTrackIdFinder.h"
+
+#include <algorithm>
+
 using namespace reco;
 using namespace std;
 
@@ -41,7 +45,9 @@ TrackAssociatorByHits::TrackAssociatorByHits (const edm::ParameterSet& conf) :
   UsePixels(conf_.getParameter<bool>("UsePixels")),
   UseGrouped(conf_.getParameter<bool>("UseGrouped")),
   UseSplitting(conf_.getParameter<bool>("UseSplitting")),
-  ThreeHitTracksAreSpecial(conf_.getParameter<bool>("ThreeHitTracksAreSpecial"))
+  ThreeHitTracksAreSpecial(conf_.getParameter<bool>("ThreeHitTracksAreSpecial")),
+  UseIndexedHitCounting(conf_.getParameter<bool>("UseIndexedHitCounting")),
+  recHitSimTrackIdMapTag(conf_.getParameter<edm::InputTag>("recHitSimTrackIdMap"))
 {
   std::string tmp = conf_.getParameter<string>("SimToRecoDenominator");
   if (tmp=="sim") {
@@ -54,6 +60,13 @@ TrackAssociatorByHits::TrackAssociatorByHits (const edm::ParameterSet& conf) :
     throw cms::Exception("TrackAssociatorByHits") << "SimToRecoDenominator not specified as sim or reco";
   }
 
+  //the RecHitSimTrackIdMap is made with both pixel and strip association and the standard strip links
+  if (!recHitSimTrackIdMapTag.label().empty() &&
+      (!conf_.getParameter<bool>("associatePixel") || !conf_.getParameter<bool>("associateStrip") ||
+       conf_.getParameter<bool>("useCompactStripLinks"))) {
+    edm::LogWarning("TrackAssociatorByHits") << "recHitSimTrackIdMap ignored, the hit associator settings differ from the ones used to make it";
+    recHitSimTrackIdMapTag = edm::InputTag();
+  }
 }
 
 
@@ -73,6 +86,12 @@ TrackAssociatorByHits::associateRecoToSim(const edm::RefToBaseVector<reco::Track
 					  const edm::Event * e,
                                           const edm::EventSetup *setup ) const{
 
+  if (UseIndexedHitCounting) {
+    RecoToSimCollection outputCollection;
+    associateByIndex(tC, TPCollectionH, e, setup, &outputCollection, 0);
+    return outputCollection;
+  }
+
   //edm::LogVerbatim("TrackAssociator") << "Starting TrackAssociatorByHits::associateRecoToSim - #tracks="<<tC.size()<<" #TPs="<<TPCollectionH.size();
   int nshared = 0;
   float quality=0;//fraction or absolute number of shared hits
@@ -80,7 +99,7 @@ TrackAssociatorByHits::associateRecoToSim(const edm::RefToBaseVector<reco::Track
   std::vector< SimHitIdpr> matchedIds; 
   RecoToSimCollection  outputCollection;
   
-  TrackerHitAssociator * associate = new TrackerHitAssociator(*e, conf_);
+  RecHitSimTrackIdFinder simTrackIdFinder(*e, conf_, recHitSimTrackIdMapTag);
   
   TrackingParticleCollection tPC;
   if (TPCollectionH.size()!=0)  tPC = *const_cast<TrackingParticleCollection*>(TPCollectionH.product());
@@ -91,7 +110,7 @@ TrackAssociatorByHits::associateRecoToSim(const edm::RefToBaseVector<reco::Track
     matchedIds.clear();
     int ri=0;//valid rechits
     //LogTrace("TrackAssociator") << "\nNEW TRACK - track number " << tindex <<" with pt =" << (*track)->pt() << " # valid=" << (*track)->found(); 
-    getMatchedIds<trackingRecHit_iterator>(matchedIds, SimTrackIds, ri, (*track)->recHitsBegin(), (*track)->recHitsEnd(), associate);
+    getMatchedIds<trackingRecHit_iterator>(matchedIds, SimTrackIds, ri, (*track)->recHitsBegin(), (*track)->recHitsEnd(), simTrackIdFinder);
 
     //LogTrace("TrackAssociator") << "MATCHED IDS LIST BEGIN" ;
     //for(size_t j=0; j<matchedIds.size(); j++){
@@ -113,7 +132,7 @@ TrackAssociatorByHits::associateRecoToSim(const edm::RefToBaseVector<reco::Track
 
 	//if electron subtract double counting
 	if (abs(t->pdgId())==11&&(t->g4Track_end()-t->g4Track_begin())>1){
-	  nshared-=getDoubleCount<trackingRecHit_iterator>((*track)->recHitsBegin(), (*track)->recHitsEnd(), associate, t);
+	  nshared-=getDoubleCount<trackingRecHit_iterator>((*track)->recHitsBegin(), (*track)->recHitsEnd(), simTrackIdFinder, t);
 	}
 
 	if (AbsoluteNumberOfHits) quality = static_cast<double>(nshared);
@@ -139,7 +158,6 @@ TrackAssociatorByHits::associateRecoToSim(const edm::RefToBaseVector<reco::Track
     }
   }
   //LogTrace("TrackAssociator") << "% of Assoc Tracks=" << ((double)outputCollection.size())/((double)tC.size());
-  delete associate;
   outputCollection.post_insert();
   return outputCollection;
 }
@@ -151,6 +169,12 @@ TrackAssociatorByHits::associateSimToReco(const edm::RefToBaseVector<reco::Track
 					  const edm::Event * e,
                                           const edm::EventSetup *setup ) const{
 
+  if (UseIndexedHitCounting) {
+    SimToRecoCollection outputCollection;
+    associateByIndex(tC, TPCollectionH, e, setup, 0, &outputCollection);
+    return outputCollection;
+  }
+
   edm::ESHandle<TrackerTopology> tTopoHand;
   setup->get<IdealGeometryRecord>().get(tTopoHand);
   const TrackerTopology *tTopo=tTopoHand.product();
@@ -162,7 +186,7 @@ TrackAssociatorByHits::associateSimToReco(const edm::RefToBaseVector<reco::Track
   std::vector< SimHitIdpr> matchedIds; 
   SimToRecoCollection  outputCollection;
 
-  TrackerHitAssociator * associate = new TrackerHitAssociator(*e, conf_);
+  RecHitSimTrackIdFinder simTrackIdFinder(*e, conf_, recHitSimTrackIdMapTag);
   
   TrackingParticleCollection tPC;
   if (TPCollectionH.size()!=0)  tPC = *const_cast<TrackingParticleCollection*>(TPCollectionH.product());
@@ -179,7 +203,7 @@ TrackAssociatorByHits::associateSimToReco(const edm::RefToBaseVector<reco::Track
   for (edm::RefToBaseVector<reco::Track>::const_iterator track=tC.begin(); track!=tC.end(); track++, tindex++){
     //LogTrace("TrackAssociator") << "\nNEW TRACK - hits of track number " << tindex <<" with pt =" << (*track)->pt() << " # valid=" << (*track)->found(); 
     int ri=0;//valid rechits
-    getMatchedIds<trackingRecHit_iterator>(matchedIds, SimTrackIds, ri, (*track)->recHitsBegin(), (*track)->recHitsEnd(), associate);
+    getMatchedIds<trackingRecHit_iterator>(matchedIds, SimTrackIds, ri, (*track)->recHitsBegin(), (*track)->recHitsEnd(), simTrackIdFinder);
 
     //save id for the track
     std::vector<SimHitIdpr> idcachev;
@@ -188,10 +212,8 @@ TrackAssociatorByHits::associateSimToReco(const edm::RefToBaseVector<reco::Track
       int tpindex =0;
       for (TrackingParticleCollection::iterator t = tPC.begin(); t != tPC.end(); ++t, ++tpindex) {
 	idcachev.clear();
-        std::vector<PSimHit> trackerPSimHit( t->trackPSimHit(DetId::Tracker) );
-        //int nsimhit = trackerPSimHit.size();
+        //int nsimhit = t->trackPSimHit(DetId::Tracker).size();
 	float totsimhit = 0; 
-	std::vector<PSimHit> tphits;
 	//LogTrace("TrackAssociator") << "TP number " << tpindex << " pdgId=" << t->pdgId() << " with number of PSimHits: "  << nsimhit;
 
 	nshared = getShared(matchedIds, idcachev, t);
@@ -204,59 +226,8 @@ TrackAssociatorByHits::associateSimToReco(const edm::RefToBaseVector<reco::Track
 	//}
 
 	if (nshared!=0) {//do not waste time recounting when it is not needed!!!!
-
 	  //count the TP simhit
-	  //LogTrace("TrackAssociator") << "recounting of tp hits";
-	  for(std::vector<PSimHit>::const_iterator TPhit = trackerPSimHit.begin(); TPhit != trackerPSimHit.end(); TPhit++){
-	    DetId dId = DetId(TPhit->detUnitId());
-	  
-	    unsigned int subdetId = static_cast<unsigned int>(dId.subdetId());
-	    if (!UsePixels && (subdetId==PixelSubdetector::PixelBarrel || subdetId==PixelSubdetector::PixelEndcap) )
-	      continue;
-
-	    //unsigned int dRawId = dId.rawId();
-	    SiStripDetId* stripDetId = 0;
-	    if (subdetId==SiStripDetId::TIB||subdetId==SiStripDetId::TOB||
-		subdetId==SiStripDetId::TID||subdetId==SiStripDetId::TEC)
-	      stripDetId= new SiStripDetId(dId);
-            //LogTrace("TrackAssociator") << "consider hit SUBDET = " << subdetId
-            //                            << " layer = " << LayerFromDetid(dId) 
-            //                            << " id = " << dId.rawId();
-	    bool newhit = true;
-	    for(std::vector<PSimHit>::const_iterator TPhitOK = tphits.begin(); TPhitOK != tphits.end(); TPhitOK++){
-	      DetId dIdOK = DetId(TPhitOK->detUnitId());
-	      //unsigned int dRawIdOK = dIdOK.rawId();
-              //LogTrace("TrackAssociator") << "\t\tcompare with SUBDET = " << dIdOK.subdetId()
-              //                            << " layer = " << LayerFromDetid(dIdOK)
-              //                            << " id = " << dIdOK.rawId();
-	      //no grouped, no splitting
-	      if (!UseGrouped && !UseSplitting)
-		if (tTopo->layer(dId)==tTopo->layer(dIdOK) &&
-		    dId.subdetId()==dIdOK.subdetId()) newhit = false;
-	      //no grouped, splitting
-	      if (!UseGrouped && UseSplitting)
-		if (tTopo->layer(dId)==tTopo->layer(dIdOK) &&
-		    dId.subdetId()==dIdOK.subdetId() &&
-		    (stripDetId==0 || stripDetId->partnerDetId()!=dIdOK.rawId()))
-		  newhit = false;
-	      //grouped, no splitting
-	      if (UseGrouped && !UseSplitting)
-		if (tTopo->layer(dId)==tTopo->layer(dIdOK) &&
-		    dId.subdetId()==dIdOK.subdetId() &&
-		    stripDetId!=0 && stripDetId->partnerDetId()==dIdOK.rawId())
-		  newhit = false;
-	      //grouped, splitting
-	      if (UseGrouped && UseSplitting)
-		newhit = true;
-	    }
-	    if (newhit) {
-	      //LogTrace("TrackAssociator") << "\t\tok";
-	      tphits.push_back(*TPhit);
-	    }
-	    //else LogTrace("TrackAssociator") << "\t\tno";
-	    delete stripDetId;
-	  }
-	  totsimhit = tphits.size();
+	  totsimhit = getNumberOfSimHits(*t, tTopo);
 	}
 
 	if (AbsoluteNumberOfHits) quality = static_cast<double>(nshared);
@@ -284,12 +255,28 @@ TrackAssociatorByHits::associateSimToReco(const edm::RefToBaseVector<reco::Track
     }
   }
   //LogTrace("TrackAssociator") << "% of Assoc TPs=" << ((double)outputCollection.size())/((double)TPCollectionH.size());
-  delete associate;
   outputCollection.post_insert();
   return outputCollection;
 }
 
 
+void
+TrackAssociatorByHits::associateBoth(const edm::RefToBaseVector<reco::Track>& tC, 
+				     const edm::RefVector<TrackingParticleCollection>& TPCollectionH,
+				     const edm::Event * e,
+				     const edm::EventSetup *setup,
+				     RecoToSimCollection& recoToSim,
+				     SimToRecoCollection& simToReco) const{
+  if (UseIndexedHitCounting) {
+    recoToSim = RecoToSimCollection();
+    simToReco = SimToRecoCollection();
+    associateByIndex(tC, TPCollectionH, e, setup, &recoToSim, &simToReco);
+  } else {
+    TrackAssociatorBase::associateBoth(tC, TPCollectionH, e, setup, recoToSim, simToReco);
+  }
+}
+
+
 RecoToSimCollectionSeed  
 TrackAssociatorByHits::associateRecoToSim(edm::Handle<edm::View<TrajectorySeed> >& seedCollectionH,
 					  edm::Handle<TrackingParticleCollection>&  TPCollectionH,     
@@ -304,7 +291,7 @@ TrackAssociatorByHits::associateRecoToSim(edm::Handle<edm::View<TrajectorySeed>
   std::vector< SimHitIdpr> matchedIds; 
   RecoToSimCollectionSeed  outputCollection;
   
-  TrackerHitAssociator * associate = new TrackerHitAssociator(*e, conf_);
+  RecHitSimTrackIdFinder simTrackIdFinder(*e, conf_, recHitSimTrackIdMapTag);
   
   const TrackingParticleCollection tPC   = *(TPCollectionH.product());
 
@@ -317,7 +304,7 @@ TrackAssociatorByHits::associateRecoToSim(edm::Handle<edm::View<TrajectorySeed>
     int ri=0;//valid rechits
     int nsimhit = seed->recHits().second-seed->recHits().first;
     LogTrace("TrackAssociator") << "\nNEW SEED - seed number " << tindex << " # valid=" << nsimhit;
-    getMatchedIds<edm::OwnVector<TrackingRecHit>::const_iterator>(matchedIds, SimTrackIds, ri, seed->recHits().first, seed->recHits().second, associate );
+    getMatchedIds<edm::OwnVector<TrackingRecHit>::const_iterator>(matchedIds, SimTrackIds, ri, seed->recHits().first, seed->recHits().second, simTrackIdFinder);
 
     //save id for the track
     std::vector<SimHitIdpr> idcachev;
@@ -331,7 +318,7 @@ TrackAssociatorByHits::associateRecoToSim(edm::Handle<edm::View<TrajectorySeed>
 
 	//if electron subtract double counting
 	if (abs(t->pdgId())==11&&(t->g4Track_end()-t->g4Track_begin())>1){
-	  nshared-=getDoubleCount<edm::OwnVector<TrackingRecHit>::const_iterator>(seed->recHits().first, seed->recHits().second, associate, t);
+	  nshared-=getDoubleCount<edm::OwnVector<TrackingRecHit>::const_iterator>(seed->recHits().first, seed->recHits().second, simTrackIdFinder, t);
 	}
 	
 	if (AbsoluteNumberOfHits) quality = static_cast<double>(nshared);
@@ -353,7 +340,6 @@ TrackAssociatorByHits::associateRecoToSim(edm::Handle<edm::View<TrajectorySeed>
     }
   }
   LogTrace("TrackAssociator") << "% of Assoc Seeds=" << ((double)outputCollection.size())/((double)seedCollectionH->size());
-  delete associate;
   outputCollection.post_insert();
   return outputCollection;
 }
@@ -373,7 +359,7 @@ TrackAssociatorByHits::associateSimToReco(edm::Handle<edm::View<TrajectorySeed>
   std::vector< SimHitIdpr> matchedIds; 
   SimToRecoCollectionSeed  outputCollection;
 
-  TrackerHitAssociator * associate = new TrackerHitAssociator(*e, conf_);
+  RecHitSimTrackIdFinder simTrackIdFinder(*e, conf_, recHitSimTrackIdMapTag);
   
   TrackingParticleCollection tPC =*const_cast<TrackingParticleCollection*>(TPCollectionH.product());
 
@@ -384,7 +370,7 @@ TrackAssociatorByHits::associateSimToReco(edm::Handle<edm::View<TrajectorySeed>
   for (edm::View<TrajectorySeed>::const_iterator seed=sC.begin(); seed!=sC.end(); seed++, tindex++) {
     int ri=0;//valid rechits
     LogTrace("TrackAssociator") << "\nNEW SEED - seed number " << tindex << " # valid=" << seed->recHits().second-seed->recHits().first;
-    getMatchedIds<edm::OwnVector<TrackingRecHit>::const_iterator>(matchedIds, SimTrackIds, ri, seed->recHits().first, seed->recHits().second, associate );
+    getMatchedIds<edm::OwnVector<TrackingRecHit>::const_iterator>(matchedIds, SimTrackIds, ri, seed->recHits().first, seed->recHits().second, simTrackIdFinder);
 
     //save id for the track
     std::vector<SimHitIdpr> idcachev;
@@ -416,7 +402,6 @@ TrackAssociatorByHits::associateSimToReco(edm::Handle<edm::View<TrajectorySeed>
     }
   }
   LogTrace("TrackAssociator") << "% of Assoc TPs=" << ((double)outputCollection.size())/((double)TPCollectionH->size());
-  delete associate;
   outputCollection.post_insert();
   return outputCollection;
 }
@@ -428,6 +413,17 @@ void TrackAssociatorByHits::getMatchedIds(std::vector<SimHitIdpr>& matchedIds,
 					  iter begin,
 					  iter end,
 					  TrackerHitAssociator* associate ) const {
+  RecHitSimTrackIdFinder simTrackIdFinder(*associate);
+  getMatchedIds<iter>(matchedIds, SimTrackIds, ri, begin, end, simTrackIdFinder);
+}
+
+template<typename iter>
+void TrackAssociatorByHits::getMatchedIds(std::vector<SimHitIdpr>& matchedIds, 
+					  std::vector<SimHitIdpr>& SimTrackIds, 
+					  int& ri, 
+					  iter begin,
+					  iter end,
+					  RecHitSimTrackIdFinder& simTrackIdFinder ) const {
     matchedIds.clear();
     ri=0;//valid rechits
     for (iter it = begin;  it != end; it++){
@@ -436,7 +432,7 @@ void TrackAssociatorByHits::getMatchedIds(std::vector<SimHitIdpr>& matchedIds,
 	ri++;
 	uint32_t t_detID=  hit->geographicalId().rawId();
 	SimTrackIds.clear();	  
- 	associate->associateHitId(*hit, SimTrackIds);
+ 	simTrackIdFinder.associateHitId(*hit, SimTrackIds);
 	//save all the id of matched simtracks
 	if(!SimTrackIds.empty()){
 	 for(size_t j=0; j<SimTrackIds.size(); j++){
@@ -509,13 +505,22 @@ int TrackAssociatorByHits::getDoubleCount(iter begin,
 					  iter end,
 					  TrackerHitAssociator* associate,
 					  TrackingParticleCollection::const_iterator t) const {
+  RecHitSimTrackIdFinder simTrackIdFinder(*associate);
+  return getDoubleCount<iter>(begin, end, simTrackIdFinder, t);
+}
+
+template<typename iter>
+int TrackAssociatorByHits::getDoubleCount(iter begin,
+					  iter end,
+					  RecHitSimTrackIdFinder& simTrackIdFinder,
+					  TrackingParticleCollection::const_iterator t) const {
   int doublecount = 0 ;
   std::vector<SimHitIdpr> SimTrackIdsDC;
   //  cout<<begin-end<<endl;
   for (iter it = begin;  it != end; it++){
     int idcount = 0;
     SimTrackIdsDC.clear();
-    associate->associateHitId(*getHitPtr(it), SimTrackIdsDC);
+    simTrackIdFinder.associateHitId(*getHitPtr(it), SimTrackIdsDC);
     //    cout<<SimTrackIdsDC.size()<<endl;
     if(SimTrackIdsDC.size()>1){
       //     cout<<(t->g4Track_end()-t->g4Track_begin())<<endl;
@@ -529,3 +534,189 @@ int TrackAssociatorByHits::getDoubleCount(iter begin,
   }
   return doublecount;
 }
+
+
+int TrackAssociatorByHits::getNumberOfSimHits(const TrackingParticle& tp,
+					      const TrackerTopology* tTopo) const {
+  std::vector<PSimHit> trackerPSimHit( tp.trackPSimHit(DetId::Tracker) );
+  std::vector<PSimHit> tphits;
+  //LogTrace("TrackAssociator") << "recounting of tp hits";
+  for(std::vector<PSimHit>::const_iterator TPhit = trackerPSimHit.begin(); TPhit != trackerPSimHit.end(); TPhit++){
+    DetId dId = DetId(TPhit->detUnitId());
+
+    unsigned int subdetId = static_cast<unsigned int>(dId.subdetId());
+    if (!UsePixels && (subdetId==PixelSubdetector::PixelBarrel || subdetId==PixelSubdetector::PixelEndcap) )
+      continue;
+
+    SiStripDetId* stripDetId = 0;
+    if (subdetId==SiStripDetId::TIB||subdetId==SiStripDetId::TOB||
+	subdetId==SiStripDetId::TID||subdetId==SiStripDetId::TEC)
+      stripDetId= new SiStripDetId(dId);
+    bool newhit = true;
+    for(std::vector<PSimHit>::const_iterator TPhitOK = tphits.begin(); TPhitOK != tphits.end(); TPhitOK++){
+      DetId dIdOK = DetId(TPhitOK->detUnitId());
+      //no grouped, no splitting
+      if (!UseGrouped && !UseSplitting)
+	if (tTopo->layer(dId)==tTopo->layer(dIdOK) &&
+	    dId.subdetId()==dIdOK.subdetId()) newhit = false;
+      //no grouped, splitting
+      if (!UseGrouped && UseSplitting)
+	if (tTopo->layer(dId)==tTopo->layer(dIdOK) &&
+	    dId.subdetId()==dIdOK.subdetId() &&
+	    (stripDetId==0 || stripDetId->partnerDetId()!=dIdOK.rawId()))
+	  newhit = false;
+      //grouped, no splitting
+      if (UseGrouped && !UseSplitting)
+	if (tTopo->layer(dId)==tTopo->layer(dIdOK) &&
+	    dId.subdetId()==dIdOK.subdetId() &&
+	    stripDetId!=0 && stripDetId->partnerDetId()==dIdOK.rawId())
+	  newhit = false;
+      //grouped, splitting
+      if (UseGrouped && UseSplitting)
+	newhit = true;
+    }
+    if (newhit) {
+      tphits.push_back(*TPhit);
+    }
+    delete stripDetId;
+  }
+  return tphits.size();
+}
+
+
+void TrackAssociatorByHits::fillTrackingParticleIndex(const TrackingParticleCollection& tPC,
+						      SimTrackToTrackingParticleIndex& tpIndex) const {
+  tpIndex.clear();
+  tpIndex.reserve(tPC.size());
+  size_t tpindex = 0;
+  for (TrackingParticleCollection::const_iterator t = tPC.begin(); t != tPC.end(); ++t, ++tpindex) {
+    if (t->trackPSimHit().size()==0) continue;//getShared never associates these
+    //getShared compares the id of the g4 tracks with the event id of the TrackingParticle
+    for (TrackingParticle::g4t_iterator g4T = t -> g4Track_begin(); g4T !=  t -> g4Track_end(); ++g4T) {
+      tpIndex.insert((*g4T).trackId(), t->eventId(), tpindex);
+    }
+  }
+}
+
+
+void TrackAssociatorByHits::getSharedHitCounts(const std::vector<SimHitIdpr>& matchedIds,
+					       const SimTrackToTrackingParticleIndex& tpIndex,
+					       std::vector<std::pair<size_t,int> >& sharedHitCounts) const {
+  sharedHitCounts.clear();
+
+  //histogram of the matched ids: each id once, with the number of hits it has been matched to
+  std::vector<std::pair<SimHitIdpr,int> > idCounts;
+  for (std::vector<SimHitIdpr>::const_iterator id = matchedIds.begin(); id != matchedIds.end(); ++id) {
+    std::vector<std::pair<SimHitIdpr,int> >::iterator idCount = idCounts.begin();
+    for (; idCount != idCounts.end(); ++idCount) {
+      if (idCount->first == *id) break;
+    }
+    if (idCount == idCounts.end()) idCounts.push_back(std::make_pair(*id,1));
+    else ++idCount->second;
+  }
+
+  //add the hits of each id to all the TrackingParticles containing it
+  for (std::vector<std::pair<SimHitIdpr,int> >::const_iterator idCount = idCounts.begin(); idCount != idCounts.end(); ++idCount) {
+    const SimTrackToTrackingParticleIndex::IndexList* tpindices = tpIndex.find(idCount->first.first, idCount->first.second);
+    if (tpindices==0) continue;
+    for (SimTrackToTrackingParticleIndex::IndexList::const_iterator tpindex = tpindices->begin(); tpindex != tpindices->end(); ++tpindex) {
+      std::vector<std::pair<size_t,int> >::iterator shared = sharedHitCounts.begin();
+      for (; shared != sharedHitCounts.end(); ++shared) {
+	if (shared->first == *tpindex) break;
+      }
+      if (shared == sharedHitCounts.end()) sharedHitCounts.push_back(std::make_pair(*tpindex,idCount->second));
+      else shared->second += idCount->second;
+    }
+  }
+
+  //same order as the loop over the TrackingParticle collection
+  std::sort(sharedHitCounts.begin(), sharedHitCounts.end());
+}
+
+
+void TrackAssociatorByHits::associateByIndex(const edm::RefToBaseVector<reco::Track>& tC,
+					     const edm::RefVector<TrackingParticleCollection>& TPCollectionH,
+					     const edm::Event * e,
+					     const edm::EventSetup *setup,
+					     RecoToSimCollection* recoToSim,
+					     SimToRecoCollection* simToReco) const {
+  //the topology is only needed to recount the simhits for sim to reco
+  const TrackerTopology *tTopo=0;
+  if (simToReco) {
+    edm::ESHandle<TrackerTopology> tTopoHand;
+    setup->get<IdealGeometryRecord>().get(tTopoHand);
+    tTopo=tTopoHand.product();
+  }
+
+  RecHitSimTrackIdFinder simTrackIdFinder(*e, conf_, recHitSimTrackIdMapTag);
+
+  //no copy of the collection, the index refers to the positions in the product
+  const TrackingParticleCollection* tPC = 0;
+  SimTrackToTrackingParticleIndex tpIndex;
+  if (TPCollectionH.size()!=0) {
+    tPC = TPCollectionH.product();
+    fillTrackingParticleIndex(*tPC, tpIndex);
+  }
+
+  std::vector< SimHitIdpr> SimTrackIds;
+  std::vector< SimHitIdpr> matchedIds;
+  std::vector<std::pair<size_t,int> > sharedHitCounts;
+
+  int tindex=0;
+  for (edm::RefToBaseVector<reco::Track>::const_iterator track=tC.begin(); track!=tC.end(); track++, tindex++){
+    int ri=0;//valid rechits
+    getMatchedIds<trackingRecHit_iterator>(matchedIds, SimTrackIds, ri, (*track)->recHitsBegin(), (*track)->recHitsEnd(), simTrackIdFinder);
+    if (matchedIds.empty() || tPC==0) continue;
+
+    //TrackingParticles sharing no hit are skipped: their quality would be 0 (or negative after the
+    //double count subtraction), which never passes the (non negative) cuts
+    getSharedHitCounts(matchedIds, tpIndex, sharedHitCounts);
+
+    for (std::vector<std::pair<size_t,int> >::const_iterator shared = sharedHitCounts.begin(); shared != sharedHitCounts.end(); ++shared) {
+      const size_t tpindex = shared->first;
+      TrackingParticleCollection::const_iterator t = tPC->begin()+tpindex;
+
+      //same quality and cuts as associateRecoToSim
+      if (recoToSim) {
+	int nshared = shared->second;
+	float quality=0;//fraction or absolute number of shared hits
+
+	//if electron subtract double counting
+	if (abs(t->pdgId())==11&&(t->g4Track_end()-t->g4Track_begin())>1){
+	  nshared-=getDoubleCount<trackingRecHit_iterator>((*track)->recHitsBegin(), (*track)->recHitsEnd(), simTrackIdFinder, t);
+	}
+
+	if (AbsoluteNumberOfHits) quality = static_cast<double>(nshared);
+	else if(ri!=0) quality = (static_cast<double>(nshared)/static_cast<double>(ri));
+	else quality = 0;
+	//if a track has just 3 hits we require that all 3 hits are shared
+	if(quality > cut_RecoToSim && !(ThreeHitTracksAreSpecial && ri==3 && nshared<3)){
+	  recoToSim->insert(tC[tindex],
+			    std::make_pair(edm::Ref<TrackingParticleCollection>(TPCollectionH, tpindex),
+					   quality));
+	}
+      }
+
+      //same quality and cuts as associateSimToReco
+      if (simToReco) {
+	int nshared = shared->second;
+	float quality=0;//fraction or absolute number of shared hits
+	float totsimhit = getNumberOfSimHits(*t, tTopo);
+
+	if (AbsoluteNumberOfHits) quality = static_cast<double>(nshared);
+	else if(SimToRecoDenominator == denomsim && totsimhit!=0) quality = ((double) nshared)/((double)totsimhit);
+	else if(SimToRecoDenominator == denomreco && ri!=0) quality = ((double) nshared)/((double)ri);
+	else quality = 0;
+
+	float purity = 1.0*nshared/ri;
+	//if a track has just 3 hits we require that all 3 hits are shared
+	if (quality>quality_SimToReco && !(ThreeHitTracksAreSpecial && totsimhit==3 && nshared<3) && (AbsoluteNumberOfHits||(purity>purity_SimToReco))) {
+	  simToReco->insert(edm::Ref<TrackingParticleCollection>(TPCollectionH, tpindex),
+			    std::make_pair(tC[tindex],quality));
+	}
+      }
+    }
+  }
+  if (recoToSim) recoToSim->post_insert();
+  if (simToReco) simToReco->post_insert();
+}
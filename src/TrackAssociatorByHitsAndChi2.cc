@@ -0,0 +1,143 @@
+#include "SimTracker/TrackAssociation/interface/TrackAssociatorByHitsAndChi2.h"
+#include "DataFormats/BeamSpot/interface/BeamSpot.h"
+
+#include <map>
+
+using namespace edm;
+using namespace reco;
+using namespace std;
+
+TrackAssociatorByHitsAndChi2::TrackAssociatorByHitsAndChi2(const edm::ESHandle<MagneticField> mF, const edm::ParameterSet& conf):
+  hitAssociator_(conf.getParameter<edm::ParameterSet>("hitAssociation")),
+  chi2Associator_(mF, conf.getParameter<edm::ParameterSet>("chi2Association")),
+  chi2cut_(conf.getParameter<edm::ParameterSet>("chi2Association").getParameter<double>("chi2cut")),
+  bsSrc_(conf.getParameter<edm::ParameterSet>("chi2Association").getParameter<edm::InputTag>("beamSpot")) {
+}
+
+RecoToSimCollection TrackAssociatorByHitsAndChi2::associateRecoToSim(const edm::RefToBaseVector<reco::Track>& tC,
+								     const edm::RefVector<TrackingParticleCollection>& tPCH,
+								     const edm::Event * e,
+								     const edm::EventSetup *setup ) const{
+  RecoToSimCollection outputCollection;
+  associateImplementation(tC, tPCH, e, setup, &outputCollection, 0, 0, 0);
+  return outputCollection;
+}
+
+SimToRecoCollection TrackAssociatorByHitsAndChi2::associateSimToReco(const edm::RefToBaseVector<reco::Track>& tC,
+								     const edm::RefVector<TrackingParticleCollection>& tPCH,
+								     const edm::Event * e,
+								     const edm::EventSetup *setup ) const{
+  SimToRecoCollection outputCollection;
+  associateImplementation(tC, tPCH, e, setup, 0, &outputCollection, 0, 0);
+  return outputCollection;
+}
+
+void TrackAssociatorByHitsAndChi2::associateBoth(edm::Handle<edm::View<reco::Track> >& tCH,
+						 edm::Handle<TrackingParticleCollection>& tPCH,
+						 const edm::Event * e,
+						 const edm::EventSetup *setup,
+						 reco::RecoToSimCollection& recoToSim,
+						 reco::SimToRecoCollection& simToReco) const{
+  edm::RefToBaseVector<reco::Track> tc(tCH);
+  for (unsigned int j=0; j<tCH->size();j++)
+    tc.push_back(edm::RefToBase<reco::Track>(tCH,j));
+
+  edm::RefVector<TrackingParticleCollection> tpc(tPCH.id());
+  for (unsigned int j=0; j<tPCH->size();j++)
+    tpc.push_back(edm::Ref<TrackingParticleCollection>(tPCH,j));
+
+  associateImplementation(tc, tpc, e, setup, &recoToSim, &simToReco, 0, 0);
+}
+
+void TrackAssociatorByHitsAndChi2::associateBoth(const edm::RefToBaseVector<reco::Track>& tC,
+						 const edm::RefVector<TrackingParticleCollection>& tPCH,
+						 const edm::Event * e,
+						 const edm::EventSetup *setup,
+						 reco::RecoToSimCollection& recoToSim,
+						 reco::SimToRecoCollection& simToReco) const{
+  associateImplementation(tC, tPCH, e, setup, &recoToSim, &simToReco, 0, 0);
+}
+
+void TrackAssociatorByHitsAndChi2::associateBoth(const edm::RefToBaseVector<reco::Track>& tC,
+						 const edm::RefVector<TrackingParticleCollection>& tPCH,
+						 const edm::Event * e,
+						 const edm::EventSetup *setup,
+						 reco::RecoToSimCollection& recoToSim,
+						 reco::SimToRecoCollection& simToReco,
+						 reco::RecoToSimCollection& recoToSimByHits,
+						 reco::SimToRecoCollection& simToRecoByHits) const{
+  associateImplementation(tC, tPCH, e, setup, &recoToSim, &simToReco, &recoToSimByHits, &simToRecoByHits);
+}
+
+void TrackAssociatorByHitsAndChi2::associateImplementation(const edm::RefToBaseVector<reco::Track>& tC,
+							   const edm::RefVector<TrackingParticleCollection>& tPCH,
+							   const edm::Event * e,
+							   const edm::EventSetup *setup,
+							   reco::RecoToSimCollection* recoToSim,
+							   reco::SimToRecoCollection* simToReco,
+							   reco::RecoToSimCollection* recoToSimByHits,
+							   reco::SimToRecoCollection* simToRecoByHits) const{
+  edm::Handle<reco::BeamSpot> recoBeamSpotHandle;
+  e->getByLabel(bsSrc_,recoBeamSpotHandle);
+  const reco::BeamSpot& bs = *recoBeamSpotHandle;
+
+  //the candidate pairs: the ones sharing hits
+  RecoToSimCollection hitRecoToSim;
+  SimToRecoCollection hitSimToReco;
+  if (recoToSim && simToReco) hitAssociator_.associateBoth(tC, tPCH, e, setup, hitRecoToSim, hitSimToReco);
+  else if (recoToSim) hitRecoToSim = hitAssociator_.associateRecoToSim(tC, tPCH, e, setup);
+  else if (simToReco) hitSimToReco = hitAssociator_.associateSimToReco(tC, tPCH, e, setup);
+
+  //the chi2 of the pairs of both directions are computed in one go, so that each TrackingParticle is propagated once
+  std::vector<TrackAssociatorByChi2::TrackIndexTrackingParticlePair> pairs;
+  std::vector<double> hitQualities;
+  size_t nRecoToSimPairs = 0;
+
+  if (recoToSim) {
+    for (unsigned int tindex=0; tindex<tC.size(); ++tindex){
+      RecoToSimCollection::const_iterator matches = hitRecoToSim.find(tC[tindex]);
+      if (matches==hitRecoToSim.end()) continue;
+      for (std::vector<std::pair<TrackingParticleRef, double> >::const_iterator match=matches->val.begin(); match!=matches->val.end(); ++match){
+	pairs.push_back(std::make_pair(tindex, match->first));
+	hitQualities.push_back(match->second);
+      }
+    }
+    nRecoToSimPairs = pairs.size();
+  }
+
+  if (simToReco) {
+    std::map<size_t, unsigned int> trackIndices;
+    for (unsigned int tindex=0; tindex<tC.size(); ++tindex) trackIndices[tC[tindex].key()] = tindex;
+    for (SimToRecoCollection::const_iterator matches=hitSimToReco.begin(); matches!=hitSimToReco.end(); ++matches){
+      for (std::vector<std::pair<edm::RefToBase<reco::Track>, double> >::const_iterator match=matches->val.begin(); match!=matches->val.end(); ++match){
+	//a track that is not in tC has no chi2 to compute
+	std::map<size_t, unsigned int>::const_iterator trackIndex = trackIndices.find(match->first.key());
+	if (trackIndex==trackIndices.end()) continue;
+	pairs.push_back(std::make_pair(trackIndex->second, matches->key));
+	hitQualities.push_back(match->second);
+      }
+    }
+  }
+
+  std::vector<double> chi2s;
+  chi2Associator_.getChi2s(tC, pairs, bs, chi2s);
+
+  for (size_t i=0; i<pairs.size(); ++i){
+    double chi2 = chi2s[i];
+    if (!(chi2<chi2cut_)) continue;
+    const edm::RefToBase<reco::Track>& track = tC[pairs[i].first];
+    const TrackingParticleRef& tp = pairs[i].second;
+    if (i<nRecoToSimPairs) {
+      recoToSim->insert(track, std::make_pair(tp, -chi2));//-chi2 because the Association Map is ordered using std::greater
+      if (recoToSimByHits) recoToSimByHits->insert(track, std::make_pair(tp, hitQualities[i]));
+    } else {
+      simToReco->insert(tp, std::make_pair(track, -chi2));
+      if (simToRecoByHits) simToRecoByHits->insert(tp, std::make_pair(track, hitQualities[i]));
+    }
+  }
+
+  if (recoToSim) recoToSim->post_insert();
+  if (simToReco) simToReco->post_insert();
+  if (recoToSimByHits) recoToSimByHits->post_insert();
+  if (simToRecoByHits) simToRecoByHits->post_insert();
+}
@@ -2,51 +2,188 @@
 #include "SimDataFormats/TrackingAnalysis/interface/TrackingParticle.h"
 
 #include <TrackingTools/TrajectoryState/interface/TrajectoryStateTransform.h>
+#include "TrackingTools/GeomPropagators/interface/AnalyticalPropagator.h"
 #include <Geometry/CommonDetUnit/interface/GeomDet.h>
 
 #include "DataFormats/Math/interface/deltaR.h"
 //#include "PhysicsTools/Utilities/interface/DeltaR.h"
+#include "DataFormats/Math/interface/deltaPhi.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 using namespace edm;
 using namespace reco;
 
-TrajectoryStateOnSurface TrackAssociatorByPosition::getState(const TrackingParticle & st)const{
-  //  TrackingParticle* simtrack = const_cast<TrackingParticle*>(&st);
-  //loop over PSimHits
-  const PSimHit * psimhit=0;
-  const BoundPlane * plane=0;
-  double dLim=thePositionMinimumDistance;
-
-  //    look for the further most hit beyond a certain limit
-  std::vector<PSimHit> pSimHit = st.trackPSimHit();
-  if (!theConsiderAllSimHits) pSimHit=st.trackPSimHit(DetId::Tracker);
-  std::vector<PSimHit> ::const_iterator start=pSimHit.begin();
-  std::vector<PSimHit> ::const_iterator end=pSimHit.end();
-  LogDebug("TrackAssociatorByPosition")<<pSimHit.size()<<" PSimHits.";
-
-  unsigned int count=0;
-  for (std::vector<PSimHit> ::const_iterator psit=start;psit!=end;++psit){    
-    //get the detid
-    DetId dd(psit->detUnitId());
-    LogDebug("TrackAssociatorByPosition")<<count++<<"] PSimHit on: "<<dd.rawId();
-    //get the surface from the global geometry
-    const GeomDet * gd=theGeometry->idToDet(dd);
-    if (!gd){edm::LogError("TrackAssociatorByPosition")<<"no geomdet for: "<<dd.rawId()<<". will skip.";
-      continue;}
-    double d=gd->surface().toGlobal(psit->localPosition()).mag();
-    if (d>dLim ){
-      dLim=d;
-      psimhit=&(*psit);
-      plane=&gd->surface();}
+namespace {
+  typedef TrackAssociatorByPosition::QualityState QualityState;
+
+  /// chi2 of the local parameters with the inverted local error of the track state
+  struct Chi2Quality {
+    static void prepare(const TrajectoryStateOnSurface & state, bool withWeight, QualityState & prepared) {
+      prepared.localParameters = state.localParameters().vector();
+      if (!withWeight) return;
+      prepared.localWeight = state.localError().matrix();
+      int ierr = ! prepared.localWeight.Invert();
+      if (ierr!=0) edm::LogInfo("TrackAssociatorByPosition")<<"error inverting the error matrix:\n"<<prepared.localWeight;
+    }
+    static double quality(const QualityState & track, const QualityState & sim) {
+      AlgebraicVector5 v(track.localParameters - sim.localParameters);
+      return ROOT::Math::Similarity(v,track.localWeight);
+    }
+  };
+
+  /// distance between the positions
+  struct DistanceQuality {
+    static void prepare(const TrajectoryStateOnSurface & state, bool, QualityState & prepared) {
+      prepared.position = state.globalPosition();
+    }
+    static double quality(const QualityState & track, const QualityState & sim) {
+      return (track.position - sim.position).mag();
+    }
+  };
+
+  /// deltaR between the momentum directions
+  struct MomentumDeltaRQuality {
+    static void prepare(const TrajectoryStateOnSurface & state, bool, QualityState & prepared) {
+      prepared.eta = state.globalDirection().eta();
+      prepared.phi = state.globalDirection().phi();
+    }
+    static double quality(const QualityState & track, const QualityState & sim) {
+      return deltaR<double>(track.eta,track.phi,sim.eta,sim.phi);
+    }
+  };
+
+  /// deltaR between the positions
+  struct PositionDeltaRQuality {
+    static void prepare(const TrajectoryStateOnSurface & state, bool, QualityState & prepared) {
+      prepared.eta = state.globalPosition().eta();
+      prepared.phi = state.globalPosition().phi();
+    }
+    static double quality(const QualityState & track, const QualityState & sim) {
+      return deltaR<double>(track.eta,track.phi,sim.eta,sim.phi);
+    }
+  };
+
+  template<typename Method>
+  class QualityEstimatorT : public TrackAssociatorByPosition::QualityEstimator {
+  public:
+    void prepare(const TrajectoryStateOnSurface & state, bool withWeight, QualityState & prepared) const {
+      Method::prepare(state,withWeight,prepared);
+    }
+    double quality(const QualityState & track, const QualityState & sim) const {
+      return Method::quality(track,sim);
+    }
+    void qualities(const QualityState & track, const QualityState * sims, size_t n, double * results) const {
+      for (size_t k=0; k<n; ++k) results[k] = Method::quality(track,sims[k]);
+    }
+  };
+
+  /// Indices of the TrackingParticles binned in (eta, phi) of their reference direction, so that the
+  /// preselection of a track only looks at the particles of the cells that overlap its window.
+  /// The first and last eta bins also take the directions beyond +-etaMax; the directions that are not
+  /// finite are in no cell and are candidates of every track.
+  class DirectionIndex {
+  public:
+    DirectionIndex(const std::vector<double>& eta, const std::vector<double>& phi, const std::vector<char>& valid) {
+      std::vector<int> cells(eta.size(), -1);
+      cellBegin_.assign(nEtaBins*nPhiBins+1, 0);
+      for (size_t k=0; k<eta.size(); ++k) {
+	if (!valid[k]) continue;
+	if (!(std::isfinite(eta[k]) && std::isfinite(phi[k]))) {
+	  unbinned_.push_back(k);
+	  continue;
+	}
+	cells[k] = etaBin(eta[k])*nPhiBins + phiBin(phi[k]);
+	++cellBegin_[cells[k]+1];
+      }
+      for (int c=0; c<nEtaBins*nPhiBins; ++c) cellBegin_[c+1] += cellBegin_[c];
+      entries_.resize(cellBegin_.back());
+      std::vector<unsigned int> next(cellBegin_.begin(), cellBegin_.end()-1);
+      for (size_t k=0; k<eta.size(); ++k) {
+	if (cells[k]>=0) entries_[next[cells[k]]++] = k;
+      }
+    }
+
+    /// indices, in increasing order, of the particles in the cells that overlap the window; all the valid
+    /// particles if the window is not finite
+    void getCandidates(double eta, double etaWindow, double phi, double phiWindow, std::vector<unsigned int>& candidates) const {
+      candidates.clear();
+      if (!(std::isfinite(eta) && std::isfinite(etaWindow) && std::abs(phi)<=M_PI && phiWindow>=0)) {
+	candidates = entries_;
+	candidates.insert(candidates.end(), unbinned_.begin(), unbinned_.end());
+	std::sort(candidates.begin(), candidates.end());
+	return;
+      }
+      int etaFirst = etaBin(eta-etaWindow);
+      int etaLast = etaBin(eta+etaWindow);
+      int phiFirst = 0;
+      int phiLast = nPhiBins-1;
+      if (phiWindow<M_PI) {
+	phiFirst = clampedBin((phi-phiWindow+M_PI)/phiBinWidth(), -nPhiBins, 2*nPhiBins-1);
+	phiLast = clampedBin((phi+phiWindow+M_PI)/phiBinWidth(), -nPhiBins, 2*nPhiBins-1);
+	if (phiLast-phiFirst+1>=nPhiBins) {
+	  phiFirst = 0;
+	  phiLast = nPhiBins-1;
+	}
+      }
+      for (int etaCell=etaFirst; etaCell<=etaLast; ++etaCell) {
+	for (int phiCell=phiFirst; phiCell<=phiLast; ++phiCell) {
+	  int cell = etaCell*nPhiBins + (phiCell+nPhiBins)%nPhiBins;
+	  candidates.insert(candidates.end(), entries_.begin()+cellBegin_[cell], entries_.begin()+cellBegin_[cell+1]);
+	}
+      }
+      candidates.insert(candidates.end(), unbinned_.begin(), unbinned_.end());
+      std::sort(candidates.begin(), candidates.end());
+    }
+
+  private:
+    static const int nEtaBins = 40;
+    static const int nPhiBins = 64;
+    static double etaMax() { return 4.; }
+    static double phiBinWidth() { return 2*M_PI/nPhiBins; }
+    /// floor(x) limited to [first, last] before the conversion to int, which would overflow for a large x
+    static int clampedBin(double x, int first, int last) {
+      return int(std::max(double(first), std::min(std::floor(x), double(last))));
+    }
+    static int etaBin(double eta) {
+      return clampedBin((eta+etaMax())*nEtaBins/(2*etaMax()), 0, nEtaBins-1);
+    }
+    static int phiBin(double phi) {
+      return clampedBin((phi+M_PI)/phiBinWidth(), 0, nPhiBins-1);
+    }
+
+    std::vector<unsigned int> cellBegin_;
+    std::vector<unsigned int> entries_;
+    std::vector<unsigned int> unbinned_;
+  };
+
+  /// Inside the coil the field is close enough to the one at the starting point for the helix of the
+  /// pre-propagation; beyond it (return yoke, muon chambers) the field changes and reverses (cm)
+  const double solenoidRadius = 290.;
+  const double solenoidHalfLength = 300.;
+  bool insideSolenoid(const GlobalPoint & point) {
+    return point.perp()<solenoidRadius && std::abs(point.z())<solenoidHalfLength;
   }
+}
 
+TrajectoryStateOnSurface TrackAssociatorByPosition::getState(const TrackingParticle & st)const{
+  //look for the further most hit beyond a certain limit
+  TrackingParticleReferenceStates::Entry entry;
+  TrackingParticleReferenceStates::makeEntry(st,*theGeometry,thePositionMinimumDistance,theConsiderAllSimHits,entry);
+  return getState(entry);
+}
 
-  if (psimhit && plane){
+TrajectoryStateOnSurface TrackAssociatorByPosition::getState(const TrackingParticleReferenceStates::Entry & entry)const{
+  const GeomDet * gd = entry.detId!=0 ? theGeometry->idToDet(DetId(entry.detId)) : 0;
+  if (gd){
     //build a trajectorystate on this surface    
+    const BoundPlane * plane=&gd->surface();
     SurfaceSideDefinition::SurfaceSide surfaceside = SurfaceSideDefinition::atCenterOfSurface;
-    GlobalPoint initialPoint=plane->toGlobal(psimhit->localPosition());
-    GlobalVector initialMomentum=plane->toGlobal(psimhit->momentumAtEntry());
-    int initialCharge =  (psimhit->particleType()>0) ? -1:1;
+    GlobalPoint initialPoint(entry.position[0],entry.position[1],entry.position[2]);
+    GlobalVector initialMomentum(entry.momentum[0],entry.momentum[1],entry.momentum[2]);
+    int initialCharge = entry.charge;
     CartesianTrajectoryError initialCartesianErrors; //no error at initial state  
     const GlobalTrajectoryParameters initialParameters(initialPoint,initialMomentum,initialCharge,thePropagator->magneticField());
     return TrajectoryStateOnSurface(initialParameters,initialCartesianErrors,*plane,surfaceside);}
@@ -61,67 +198,374 @@ FreeTrajectoryState TrackAssociatorByPosition::getState(const reco::Track & trac
 }
 
 double TrackAssociatorByPosition::quality(const TrajectoryStateOnSurface & tr, const TrajectoryStateOnSurface & sim) const {
-  switch(theMethod){
-  case 0:
-    {
-      AlgebraicVector5 v(tr.localParameters().vector() - sim.localParameters().vector());
-      AlgebraicSymMatrix55 m(tr.localError().matrix());
-      int ierr = ! m.Invert();
-      if (ierr!=0) edm::LogInfo("TrackAssociatorByPosition")<<"error inverting the error matrix:\n"<<m;
-      double est = ROOT::Math::Similarity(v,m);
-      return est;
-      break;
-    }
-  case 1:
-    {
-      return (tr.globalPosition() - sim.globalPosition()).mag();
-      break;
-    }
-  case 2:
-    {
-      return  (deltaR<double>(tr.globalDirection().eta(),tr.globalDirection().phi(),
-			      sim.globalDirection().eta(),sim.globalDirection().phi()));
-      break;
-    }
-  case 3:
-    {
-      return (deltaR<double>(tr.globalPosition().eta(),tr.globalPosition().phi(),
-			     sim.globalPosition().eta(),sim.globalPosition().phi()));
-      break;
+  if (!theQualityEstimator){
+    edm::LogError("TrackAssociatorByPosition")<<"option: "<<theMethod<<" has not been recognized. association has no meaning.";
+    return -1;
+  }
+  QualityState trackState, simState;
+  theQualityEstimator->prepare(tr,true,trackState);
+  theQualityEstimator->prepare(sim,false,simState);
+  return theQualityEstimator->quality(trackState,simState);
+}
+
+void TrackAssociatorByPosition::quality(const TrajectoryStateOnSurface & tr,
+					const std::vector<TrajectoryStateOnSurface> & sims,
+					std::vector<double> & qualities) const {
+  if (!theQualityEstimator){
+    edm::LogError("TrackAssociatorByPosition")<<"option: "<<theMethod<<" has not been recognized. association has no meaning.";
+    qualities.assign(sims.size(),-1);
+    return;
+  }
+  QualityState trackState;
+  theQualityEstimator->prepare(tr,true,trackState);
+  std::vector<QualityState> simStates(sims.size());
+  for (size_t k=0; k<sims.size(); ++k) theQualityEstimator->prepare(sims[k],false,simStates[k]);
+  qualities.resize(sims.size());
+  if (!sims.empty()) theQualityEstimator->qualities(trackState,&simStates[0],sims.size(),&qualities[0]);
+}
+
+double TrackAssociatorByPosition::quality(const StateCache& cache, unsigned int Ti, unsigned int TPi) const {
+  if (!theQualityEstimator) return quality(cache.propagatedStates[Ti*cache.surfaces.size()+cache.simSurfaces[TPi]],cache.simStates[TPi]);
+  return cache.qualities[Ti*cache.surfaceSimQualityStates.size()+cache.simSlots[TPi]];
+}
+
+TrackAssociatorByPosition::QualityEstimator * TrackAssociatorByPosition::makeQualityEstimator(unsigned int method) {
+  switch(method){
+  case 0: return new QualityEstimatorT<Chi2Quality>();
+  case 1: return new QualityEstimatorT<DistanceQuality>();
+  case 2: return new QualityEstimatorT<MomentumDeltaRQuality>();
+  case 3: return new QualityEstimatorT<PositionDeltaRQuality>();
+  }
+  return 0;
+}
+
+
+const TrackingParticleReferenceStates * TrackAssociatorByPosition::getReferenceStates(const edm::Event * e,
+										   const edm::RefVector<TrackingParticleCollection>& tPCH) const{
+  if (theReferenceStatesTag.label().empty() || e==0) return 0;
+  edm::Handle<TrackingParticleReferenceStates> referenceStates;
+  if (!e->getByLabel(theReferenceStatesTag,referenceStates)) return 0;
+  if (referenceStates->trackingParticles()!=tPCH.id() ||
+      referenceStates->positionMinimumDistance()!=thePositionMinimumDistance ||
+      referenceStates->considerAllSimHits()!=theConsiderAllSimHits){
+    edm::LogWarning("TrackAssociatorByPosition")<<theReferenceStatesTag.encode()
+						<<" ignored, it was made for other TrackingParticles or with other settings";
+    return 0;}
+  return referenceStates.product();
+}
+
+void TrackAssociatorByPosition::fillStateCache(const edm::RefToBaseVector<reco::Track>& tCH, 
+					       const edm::RefVector<TrackingParticleCollection>& tPCH,
+					       const edm::Event * e,
+					       StateCache& cache) const{
+  cache.trackStates.clear();
+  cache.trackStates.reserve(tCH.size());
+  for (unsigned int Ti=0; Ti!=tCH.size();++Ti){
+    //initial state (initial OR inner OR outter)
+    cache.trackStates.push_back(getState(*(tCH)[Ti]));
+  }
+  cache.simStates.clear();
+  cache.simStates.reserve(tPCH.size());
+  const TrackingParticleReferenceStates * referenceStates = getReferenceStates(e,tPCH);
+  for (unsigned int TPi=0;TPi!=tPCH.size();++TPi) {
+    //get a state in the muon system, with the hit already chosen if the event has it
+    if (referenceStates) cache.simStates.push_back(getState((*referenceStates)[tPCH[TPi].key()]));
+    else cache.simStates.push_back(getState(*(tPCH)[TPi]));
+  }
+  std::map<const Surface*,int> surfaceIndices;
+  cache.simSurfaces.assign(tPCH.size(),-1);
+  cache.surfaces.clear();
+  for (unsigned int TPi=0;TPi!=tPCH.size();++TPi) {
+    if (!cache.simStates[TPi].isValid()) continue;
+    const Surface * surface = &cache.simStates[TPi].surface();
+    std::map<const Surface*,int>::const_iterator found = surfaceIndices.find(surface);
+    if (found==surfaceIndices.end()) {
+      found = surfaceIndices.insert(std::make_pair(surface,int(cache.surfaces.size()))).first;
+      cache.surfaces.push_back(surface);
     }
+    cache.simSurfaces[TPi] = found->second;
+  }
+  LogDebug("TrackAssociatorByPosition")<<cache.simStates.size()<<" TrackingParticles on "<<cache.surfaces.size()<<" surfaces.";
+
+  //the prepared TrackingParticle states, contiguous per surface for theQualityEstimator->qualities
+  cache.surfaceBegin.assign(cache.surfaces.size()+1,0);
+  for (unsigned int TPi=0;TPi!=tPCH.size();++TPi) {
+    if (cache.simSurfaces[TPi]>=0) ++cache.surfaceBegin[cache.simSurfaces[TPi]+1];
   }
-  //should never be reached
-  edm::LogError("TrackAssociatorByPosition")<<"option: "<<theMethod<<" has not been recognized. association has no meaning.";
-  return -1;
+  for (unsigned int surface=0; surface!=cache.surfaces.size(); ++surface) cache.surfaceBegin[surface+1] += cache.surfaceBegin[surface];
+  std::vector<unsigned int> nextSlot(cache.surfaceBegin.begin(), cache.surfaceBegin.end()-1);
+  cache.simSlots.assign(tPCH.size(),0);
+  cache.surfaceSimQualityStates.assign(cache.surfaceBegin.back(), QualityState());
+  for (unsigned int TPi=0;TPi!=tPCH.size();++TPi) {
+    if (cache.simSurfaces[TPi]<0) continue;
+    cache.simSlots[TPi] = nextSlot[cache.simSurfaces[TPi]]++;
+    if (theQualityEstimator) theQualityEstimator->prepare(cache.simStates[TPi],false,cache.surfaceSimQualityStates[cache.simSlots[TPi]]);
+  }
+
+  cache.propagatedStates.assign(cache.trackStates.size()*cache.surfaces.size(), TrajectoryStateOnSurface());
+  cache.propagated.assign(cache.propagatedStates.size(), 0);
+  cache.qualities.assign(theQualityEstimator ? cache.trackStates.size()*cache.surfaceSimQualityStates.size() : 0, 0.);
+
+  cache.preselected.clear();
+  if (thePreselection) fillPreselection(cache);
+  cache.prePropagationQCut.clear();
+  if (thePrePropagation) fillPrePropagation(cache);
+}
+
+void TrackAssociatorByPosition::preselectionWindows(double pt, double bz, double rPerp, double rMag,
+						    double& etaWindow, double& phiWindow) const{
+  //angle that QCut stands for at the reference state
+  double qCutAngle = 0;
+  if (theMethod==1) qCutAngle = rMag>theQCut ? std::asin(theQCut/rMag) : M_PI;
+  else if (theMethod==2 || theMethod==3) qCutAngle = theQCut;
+
+  //the position of a track of transverse momentum pt is at most asin(0.0015 bz r/pt) away in phi from its
+  //initial direction at radius r, and its momentum twice as much; the field outside the solenoid, which
+  //is lower and in the other direction, only bends it back
+  double bending = M_PI;
+  double sinBending = 0.0029979*std::abs(bz)*rPerp/(2*pt);
+  if (sinBending<1) bending = (theMethod==2 ? 2 : 1)*std::asin(sinBending);
+
+  etaWindow = thePreselectionMargin + qCutAngle;
+  phiWindow = thePreselectionMargin + qCutAngle + bending;
 }
 
+void TrackAssociatorByPosition::fillPreselection(StateCache& cache) const{
+  const size_t nTracks = cache.trackStates.size();
+  const size_t nTPs = cache.simStates.size();
+  cache.preselected.assign(nTracks*nTPs, 0);
+  if (nTracks==0 || nTPs==0) return;
+
+  //reference direction of the TrackingParticles, and the radii that give the widest windows
+  std::vector<double> eta(nTPs,0.), phi(nTPs,0.), rPerp(nTPs,0.), rMag(nTPs,0.);
+  std::vector<char> valid(nTPs,0);
+  double rPerpMax = 0, rMagMin = std::numeric_limits<double>::max();
+  for (unsigned int TPi=0;TPi!=nTPs;++TPi) {
+    const TrajectoryStateOnSurface & simReferenceState = cache.simStates[TPi];
+    if (!simReferenceState.isValid()) continue;
+    GlobalVector direction = theMethod==2 ? simReferenceState.globalMomentum() : GlobalVector(simReferenceState.globalPosition().basicVector());
+    eta[TPi] = direction.eta();
+    phi[TPi] = direction.phi();
+    rPerp[TPi] = simReferenceState.globalPosition().perp();
+    rMag[TPi] = simReferenceState.globalPosition().mag();
+    valid[TPi] = 1;
+    rPerpMax = std::max(rPerpMax, rPerp[TPi]);
+    rMagMin = std::min(rMagMin, rMag[TPi]);
+  }
+  DirectionIndex index(eta, phi, valid);
+  double bz = thePropagator->magneticField()->inTesla(GlobalPoint(0,0,0)).z();
+
+  std::vector<unsigned int> candidates;
+  unsigned int nKept = 0;
+  for (unsigned int Ti=0; Ti!=nTracks;++Ti){
+    GlobalVector momentum = cache.trackStates[Ti].momentum();
+    double pt = momentum.perp();
+    double etaWindow, phiWindow;
+    preselectionWindows(pt, bz, rPerpMax, rMagMin, etaWindow, phiWindow);
+    index.getCandidates(momentum.eta(), etaWindow, momentum.phi(), phiWindow, candidates);
+    for (std::vector<unsigned int>::const_iterator TPi=candidates.begin(); TPi!=candidates.end(); ++TPi){
+      preselectionWindows(pt, bz, rPerp[*TPi], rMag[*TPi], etaWindow, phiWindow);
+      if (std::abs(momentum.eta()-eta[*TPi])>etaWindow) continue;
+      if (std::abs(reco::deltaPhi(momentum.phi(),phi[*TPi]))>phiWindow) continue;
+      cache.preselected[Ti*nTPs+*TPi] = 1;
+      ++nKept;
+    }
+  }
+  LogDebug("TrackAssociatorByPosition")<<"preselection kept "<<nKept<<" pairs out of "<<nTracks*nTPs;
+}
+
+void TrackAssociatorByPosition::fillPrePropagation(StateCache& cache) const{
+  const size_t nTracks = cache.trackStates.size();
+  const size_t nTPs = cache.simStates.size();
+  const size_t nSurfaces = cache.surfaces.size();
+  if (cache.preselected.empty()) cache.preselected.assign(nTracks*nTPs, 1);
+  cache.prePropagationQCut.assign(nTracks*nTPs, 2);
+
+  //helix in the field at the starting point, memoized per surface as for thePropagator
+  AnalyticalPropagator analyticalPropagator(thePropagator->magneticField(), thePropagator->propagationDirection());
+  const double looseQCut = thePrePropagationCutFactor*theQCut;
+  std::vector<TrajectoryStateOnSurface> states(nSurfaces);
+  std::vector<double> qualities(cache.surfaceSimQualityStates.size());
+  QualityState trackState;
+  std::vector<char> propagated(nSurfaces);
+  //only the helices that stay inside the solenoid: the other pairs are left to thePropagator
+  std::vector<char> surfaceInside(nSurfaces);
+  for (unsigned int surface=0; surface!=nSurfaces; ++surface)
+    surfaceInside[surface] = insideSolenoid(cache.surfaces[surface]->position());
+  for (unsigned int Ti=0; Ti!=nTracks;++Ti){
+    propagated.assign(nSurfaces,0);
+    bool trackInside = insideSolenoid(cache.trackStates[Ti].position());
+    for (unsigned int TPi=0;TPi!=nTPs;++TPi) {
+      int surface = cache.simSurfaces[TPi];
+      if (surface<0) continue;
+      char & status = cache.preselected[Ti*nTPs+TPi];
+      if (status!=1) continue;
+      if (!trackInside || !surfaceInside[surface]){
+	++cache.prePropagationCounters.outsideSolenoid;
+	continue;}
+      if (!propagated[surface]){
+	states[surface] = analyticalPropagator.propagate(cache.trackStates[Ti],cache.simStates[TPi].surface());
+	if (states[surface].isValid()){
+	  //compared at once to all the TrackingParticles of the surface
+	  theQualityEstimator->prepare(states[surface],true,trackState);
+	  unsigned int begin = cache.surfaceBegin[surface];
+	  theQualityEstimator->qualities(trackState,&cache.surfaceSimQualityStates[begin],cache.surfaceBegin[surface+1]-begin,&qualities[begin]);}
+	propagated[surface] = 1;}
+      if (!states[surface].isValid()) continue;
+
+      double dQ = qualities[cache.simSlots[TPi]];
+      ++cache.prePropagationCounters.pairs;
+      if (dQ < looseQCut){
+	cache.prePropagationQCut[Ti*nTPs+TPi] = dQ < theQCut;}
+      else{
+	status = 0;
+	++cache.prePropagationCounters.rejected;}
+    }
+  }
+}
+
+void TrackAssociatorByPosition::countRefinement(StateCache& cache, unsigned int Ti, unsigned int TPi, double dQ) const{
+  if (cache.prePropagationQCut.empty()) return;
+  char & status = cache.prePropagationQCut[Ti*cache.simStates.size()+TPi];
+  if (status==2) return;
+  ++cache.prePropagationCounters.refined;
+  if ((status==1) == (dQ < theQCut)) ++cache.prePropagationCounters.agreeing;
+  status = 2;
+}
+
+void TrackAssociatorByPosition::logPrePropagation(const StateCache& cache) const{
+  if (!thePrePropagation) return;
+  edm::LogInfo("TrackAssociatorByPosition")<<"pre-propagation: "<<cache.prePropagationCounters.rejected
+					   <<" pairs rejected out of "<<cache.prePropagationCounters.pairs
+					   <<", "<<cache.prePropagationCounters.outsideSolenoid<<" pairs outside the solenoid left to the propagator, "
+					   <<cache.prePropagationCounters.agreeing<<" of the "<<cache.prePropagationCounters.refined
+					   <<" pairs propagated afterwards have the same decision at QCut.";
+}
+
+bool TrackAssociatorByPosition::preselected(StateCache& cache, unsigned int Ti, unsigned int TPi) const{
+  if (cache.preselected.empty()) return true;
+  char & status = cache.preselected[Ti*cache.simStates.size()+TPi];
+  if (status==1) return true;
+  if (theValidatePreselection && status==0){
+    status = 2;
+    const TrajectoryStateOnSurface & trackReferenceState = propagatedState(cache,Ti,TPi);
+    if (trackReferenceState.isValid()){
+      double dQ = quality(cache,Ti,TPi);
+      if (dQ < theQCut)
+	edm::LogWarning("TrackAssociatorByPosition")<<"the preselection or the pre-propagation rejected track number: "<<Ti
+						     <<" and TrackingParticle number: "<<TPi
+						     <<" which are associated with dQ: "<<dQ;
+    }
+  }
+  return false;
+}
+
+const TrajectoryStateOnSurface & TrackAssociatorByPosition::propagatedState(StateCache& cache,
+									    unsigned int Ti,
+									    unsigned int TPi) const{
+  unsigned int index = Ti*cache.surfaces.size()+cache.simSurfaces[TPi];
+  if (!cache.propagated[index]) propagate(cache,Ti,TPi);
+  return cache.propagatedStates[index];
+}
+
+void TrackAssociatorByPosition::propagate(StateCache& cache, unsigned int Ti, unsigned int TPi) const{
+  int surface = cache.simSurfaces[TPi];
+  unsigned int index = Ti*cache.surfaces.size()+surface;
+  //propagate the TRACK to the surface
+  cache.propagatedStates[index] = thePropagator->propagate(cache.trackStates[Ti],cache.simStates[TPi].surface());
+  cache.propagated[index] = 1;
+  if (!theQualityEstimator || !cache.propagatedStates[index].isValid()) return;
+
+  //one batch for all the TrackingParticles of the surface, which the loops then read pair by pair
+  QualityState trackState;
+  theQualityEstimator->prepare(cache.propagatedStates[index],true,trackState);
+  unsigned int begin = cache.surfaceBegin[surface];
+  theQualityEstimator->qualities(trackState,&cache.surfaceSimQualityStates[begin],cache.surfaceBegin[surface+1]-begin,
+				 &cache.qualities[Ti*cache.surfaceSimQualityStates.size()+begin]);
+}
 
 RecoToSimCollection TrackAssociatorByPosition::associateRecoToSim(const edm::RefToBaseVector<reco::Track>& tCH, 
 								  const edm::RefVector<TrackingParticleCollection>& tPCH,
 								  const edm::Event * e,
                                                                   const edm::EventSetup *setup ) const{
   RecoToSimCollection  outputCollection;
+  StateCache cache;
+  fillStateCache(tCH, tPCH, e, cache);
+  fillRecoToSim(tCH, tPCH, cache, outputCollection);
+  outputCollection.post_insert();
+  logPrePropagation(cache);
+  return outputCollection;
+}
+
+SimToRecoCollection TrackAssociatorByPosition::associateSimToReco(const edm::RefToBaseVector<reco::Track>& tCH, 
+								  const edm::RefVector<TrackingParticleCollection>& tPCH,
+								  const edm::Event * e,
+                                                                  const edm::EventSetup *setup ) const {
+  SimToRecoCollection  outputCollection;
+  StateCache cache;
+  fillStateCache(tCH, tPCH, e, cache);
+  fillSimToReco(tCH, tPCH, cache, outputCollection);
+  outputCollection.post_insert();
+  logPrePropagation(cache);
+  return outputCollection;
+}
+
+void TrackAssociatorByPosition::associateBoth(edm::Handle<edm::View<reco::Track> >& tCH,
+					      edm::Handle<TrackingParticleCollection>& tPCH,
+					      const edm::Event * e,
+					      const edm::EventSetup *setup,
+					      reco::RecoToSimCollection& recoToSim,
+					      reco::SimToRecoCollection& simToReco) const{
+  edm::RefToBaseVector<reco::Track> tc(tCH);
+  for (unsigned int j=0; j<tCH->size();j++)
+    tc.push_back(edm::RefToBase<reco::Track>(tCH,j));
+
+  edm::RefVector<TrackingParticleCollection> tpc(tPCH.id());
+  for (unsigned int j=0; j<tPCH->size();j++)
+    tpc.push_back(edm::Ref<TrackingParticleCollection>(tPCH,j));
+
+  associateBoth(tc, tpc, e, setup, recoToSim, simToReco);
+}
+
+void TrackAssociatorByPosition::associateBoth(const edm::RefToBaseVector<reco::Track>& tCH,
+					      const edm::RefVector<TrackingParticleCollection>& tPCH,
+					      const edm::Event * e,
+					      const edm::EventSetup *setup,
+					      reco::RecoToSimCollection& recoToSim,
+					      reco::SimToRecoCollection& simToReco) const{
+  StateCache cache;
+  fillStateCache(tCH, tPCH, e, cache);
+  fillRecoToSim(tCH, tPCH, cache, recoToSim);
+  recoToSim.post_insert();
+  fillSimToReco(tCH, tPCH, cache, simToReco);
+  simToReco.post_insert();
+  logPrePropagation(cache);
+}
+
+void TrackAssociatorByPosition::fillRecoToSim(const edm::RefToBaseVector<reco::Track>& tCH, 
+					      const edm::RefVector<TrackingParticleCollection>& tPCH,
+					      StateCache& cache,
+					      RecoToSimCollection& outputCollection) const{
   //for each reco track find a matching tracking particle
   std::pair<unsigned int,unsigned int> minPair;
   const double dQmin_default=1542543;
   double dQmin=dQmin_default;
   for (unsigned int Ti=0; Ti!=tCH.size();++Ti){
-    //initial state (initial OR inner OR outter)
-    FreeTrajectoryState iState = getState(*(tCH)[Ti]);
-
     bool atLeastOne=false;
     //    for each tracking particle, find a state position and the plane to propagate the track to.
     for (unsigned int TPi=0;TPi!=tPCH.size();++TPi) {
       //get a state in the muon system 
-      TrajectoryStateOnSurface simReferenceState = getState(*(tPCH)[TPi]);
+      const TrajectoryStateOnSurface & simReferenceState = cache.simStates[TPi];
       if (!simReferenceState.isValid()) continue;
+      if (!preselected(cache,Ti,TPi)) continue;
 
-      //propagate the TRACK to the surface
-      TrajectoryStateOnSurface trackReferenceState = thePropagator->propagate(iState,simReferenceState.surface());
+      //propagate the TRACK to the surface, unless it was already propagated there
+      const TrajectoryStateOnSurface & trackReferenceState = propagatedState(cache,Ti,TPi);
       if (!trackReferenceState.isValid()) continue; 
       
       //comparison
-      double dQ= quality(trackReferenceState,simReferenceState);
+      double dQ= quality(cache,Ti,TPi);
+      countRefinement(cache,Ti,TPi,dQ);
       if (dQ < theQCut){
 	atLeastOne=true;
 	outputCollection.insert(tCH[Ti],
@@ -137,17 +581,14 @@ RecoToSimCollection TrackAssociatorByPosition::associateRecoToSim(const edm::Ref
       outputCollection.insert(tCH[minPair.first],
 			      std::make_pair(edm::Ref<TrackingParticleCollection>(tPCH,minPair.second),-dQmin));}
   }//loop over tracks
-  outputCollection.post_insert();
-  return outputCollection;
 }
 
 
 
-SimToRecoCollection TrackAssociatorByPosition::associateSimToReco(const edm::RefToBaseVector<reco::Track>& tCH, 
-								  const edm::RefVector<TrackingParticleCollection>& tPCH,
-								  const edm::Event * e,
-                                                                  const edm::EventSetup *setup ) const {
-  SimToRecoCollection  outputCollection;
+void TrackAssociatorByPosition::fillSimToReco(const edm::RefToBaseVector<reco::Track>& tCH, 
+					      const edm::RefVector<TrackingParticleCollection>& tPCH,
+					      StateCache& cache,
+					      SimToRecoCollection& outputCollection) const {
   //for each tracking particle, find matching tracks.
 
   std::pair<unsigned int,unsigned int> minPair;
@@ -155,22 +596,22 @@ SimToRecoCollection TrackAssociatorByPosition::associateSimToReco(const edm::Ref
   double dQmin=dQmin_default;
   for (unsigned int TPi=0;TPi!=tPCH.size();++TPi){
     //get a state in the muon system
-    TrajectoryStateOnSurface simReferenceState= getState(*(tPCH)[TPi]);
+    const TrajectoryStateOnSurface & simReferenceState= cache.simStates[TPi];
       
     if (!simReferenceState.isValid()) continue; 
     bool atLeastOne=false;
     //	propagate every track from any state (initial, inner, outter) to the surface 
     //	and make the position test
     for (unsigned int Ti=0; Ti!=tCH.size();++Ti){
-      //initial state
-      FreeTrajectoryState iState = getState(*(tCH)[Ti]);
-	
-      //propagation to surface
-      TrajectoryStateOnSurface trackReferenceState = thePropagator->propagate(iState,simReferenceState.surface());
+      if (!preselected(cache,Ti,TPi)) continue;
+
+      //propagation to surface, shared by the TrackingParticles on the same surface
+      const TrajectoryStateOnSurface & trackReferenceState = propagatedState(cache,Ti,TPi);
       if (!trackReferenceState.isValid()) continue;
 	
       //comparison
-      double dQ= quality(trackReferenceState, simReferenceState);
+      double dQ= quality(cache,Ti,TPi);
+      countRefinement(cache,Ti,TPi,dQ);
       if (dQ < theQCut){
 	atLeastOne=true;
 	outputCollection.insert(edm::Ref<TrackingParticleCollection>(tPCH,TPi),
@@ -186,7 +627,4 @@ SimToRecoCollection TrackAssociatorByPosition::associateSimToReco(const edm::Ref
       outputCollection.insert(edm::Ref<TrackingParticleCollection>(tPCH,minPair.first),
 			      std::make_pair(tCH[minPair.second],-dQmin));}
   }//loop over tracking particles
-  
-  outputCollection.post_insert();
-  return outputCollection;
 }
@@ -0,0 +1,24 @@
+#include "SimTracker/TrackAssociation/interface/TrackParameterPulls.h"
+
+#include <algorithm>
+
+void TrackParameterPulls::insert(uint32_t trackKey, uint32_t trackingParticleKey, const float (&pulls)[5]) {
+  Entry entry;
+  entry.trackKey = trackKey;
+  entry.trackingParticleKey = trackingParticleKey;
+  for (unsigned int i=0; i<5; i++) entry.pulls[i] = pulls[i];
+  entries_.push_back(entry);
+}
+
+void TrackParameterPulls::post_insert() {
+  std::sort(entries_.begin(), entries_.end());
+}
+
+const TrackParameterPulls::Entry* TrackParameterPulls::find(uint32_t trackKey, uint32_t trackingParticleKey) const {
+  Entry entry;
+  entry.trackKey = trackKey;
+  entry.trackingParticleKey = trackingParticleKey;
+  std::vector<Entry>::const_iterator found = std::lower_bound(entries_.begin(), entries_.end(), entry);
+  if (found==entries_.end() || entry<*found) return 0;
+  return &*found;
+}
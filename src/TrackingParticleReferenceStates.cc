@@ -0,0 +1,50 @@
+#include "SimTracker/TrackAssociation/interface/TrackingParticleReferenceStates.h"
+
+#include "SimDataFormats/TrackingAnalysis/interface/TrackingParticle.h"
+#include "Geometry/CommonDetUnit/interface/TrackingGeometry.h"
+#include "Geometry/CommonDetUnit/interface/GeomDet.h"
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+
+bool TrackingParticleReferenceStates::makeEntry(const TrackingParticle& trackingParticle, const TrackingGeometry& geometry,
+						double positionMinimumDistance, bool considerAllSimHits, Entry& entry) {
+  entry = Entry();
+  const PSimHit * psimhit=0;
+  const BoundPlane * plane=0;
+  double dLim=positionMinimumDistance;
+
+  //look for the further most hit beyond a certain limit
+  //(only the tracker hits are copied, all the hits are read in place)
+  std::vector<PSimHit> trackerPSimHit;
+  if (!considerAllSimHits) trackerPSimHit=trackingParticle.trackPSimHit(DetId::Tracker);
+  const std::vector<PSimHit> & pSimHit = considerAllSimHits ? trackingParticle.trackPSimHit() : trackerPSimHit;
+  LogDebug("TrackAssociatorByPosition")<<pSimHit.size()<<" PSimHits.";
+
+  unsigned int count=0;
+  for (std::vector<PSimHit>::const_iterator psit=pSimHit.begin();psit!=pSimHit.end();++psit){
+    //get the detid
+    DetId dd(psit->detUnitId());
+    LogDebug("TrackAssociatorByPosition")<<count++<<"] PSimHit on: "<<dd.rawId();
+    //get the surface from the global geometry
+    const GeomDet * gd=geometry.idToDet(dd);
+    if (!gd){edm::LogError("TrackAssociatorByPosition")<<"no geomdet for: "<<dd.rawId()<<". will skip.";
+      continue;}
+    double d=gd->surface().toGlobal(psit->localPosition()).mag();
+    if (d>dLim ){
+      dLim=d;
+      psimhit=&(*psit);
+      plane=&gd->surface();}
+  }
+  if (!psimhit || !plane) return false;
+
+  GlobalPoint position=plane->toGlobal(psimhit->localPosition());
+  GlobalVector momentum=plane->toGlobal(psimhit->momentumAtEntry());
+  entry.detId = psimhit->detUnitId();
+  entry.position[0] = position.x();
+  entry.position[1] = position.y();
+  entry.position[2] = position.z();
+  entry.momentum[0] = momentum.x();
+  entry.momentum[1] = momentum.y();
+  entry.momentum[2] = momentum.z();
+  entry.charge = (psimhit->particleType()>0) ? -1:1;
+  return true;
+}
@@ -0,0 +1,18 @@
+#include "SimTracker/TrackAssociation/interface/RecHitSimTrackIdMap.h"
+#include "SimTracker/TrackAssociation/interface/TrackParameterPulls.h"
+#include "SimTracker/TrackAssociation/interface/TrackingParticleReferenceStates.h"
+#include "DataFormats/Common/interface/Wrapper.h"
+
+namespace {
+  struct dictionary {
+    RecHitSimTrackIdMap rhstim;
+    edm::Wrapper<RecHitSimTrackIdMap> rhstimw;
+    std::vector<RecHitSimTrackIdMap::Entry> rhstimev;
+    TrackParameterPulls tpp;
+    edm::Wrapper<TrackParameterPulls> tppw;
+    std::vector<TrackParameterPulls::Entry> tppev;
+    TrackingParticleReferenceStates tprs;
+    edm::Wrapper<TrackingParticleReferenceStates> tprsw;
+    std::vector<TrackingParticleReferenceStates::Entry> tprsev;
+  };
+}
@@ -8,11 +8,20 @@
 #include "SimDataFormats/TrackingAnalysis/interface/TrackingParticle.h"
 
 #include "DataFormats/TrackReco/interface/TrackFwd.h"
+#include "DataFormats/BeamSpot/interface/BeamSpot.h"
+#include "DataFormats/Math/interface/deltaPhi.h"
+#include "FWCore/Utilities/interface/Exception.h"
 #include "SimTracker/TrackAssociation/interface/TrackAssociatorBase.h"
+#include "SimTracker/TrackAssociation/interface/TrackAssociatorByChi2.h"
+#include "SimTracker/TrackAssociation/interface/TrackParameterPulls.h"
+#include "SimTracker/TrackAssociation/interface/TrackingParticleReferenceStates.h"
+#include "Geometry/Records/interface/GlobalTrackingGeometryRecord.h"
+#include "Geometry/CommonDetUnit/interface/GlobalTrackingGeometry.h"
 
 #include <memory>
 #include <iostream>
 #include <string>
+#include <cmath>
 
 //class TrackAssociator; 
 class TrackAssociatorByHits; 
@@ -27,11 +36,63 @@ testTrackAssociator::testTrackAssociator(edm::ParameterSet const& conf) {
   tpTag = conf.getParameter< edm::InputTag >("tpTag");
   simtracksTag = conf.getParameter< edm::InputTag >("simtracksTag");
   simvtxTag = conf.getParameter< edm::InputTag >("simvtxTag");
+  beamSpotTag = conf.getParameter< edm::InputTag >("beamSpotTag");
+  pullsTag = conf.getParameter< edm::InputTag >("pullsTag");
+  referenceStatesTag = conf.getParameter< edm::InputTag >("referenceStatesTag");
+  std::vector<edm::ParameterSet> compared = conf.getParameter<std::vector<edm::ParameterSet> >("comparedAssociators");
+  for (std::vector<edm::ParameterSet>::const_iterator pset=compared.begin(); pset!=compared.end(); ++pset) {
+    AssociatorComparison comparison = {pset->getParameter<std::string>("reference"),
+				       pset->getParameter<std::string>("test"),
+				       pset->getParameter<double>("relativeTolerance"),
+				       pset->getParameter<bool>("sameAssociations"),
+				       0, 0, 0, 0};
+    comparisons.push_back(comparison);
+  }
+  analyticalPCA.tolerances = conf.getParameter<std::vector<double> >("analyticalPCATolerances");
+  if (!analyticalPCA.tolerances.empty() && analyticalPCA.tolerances.size()!=5)
+    throw cms::Exception("Configuration") << "analyticalPCATolerances needs 5 values, qoverp, lambda, phi, dxy and dsz";
+  analyticalPCA.particles = analyticalPCA.differentStatus = analyticalPCA.outsideTolerance = 0;
+  for (unsigned int i=0; i<5; i++) analyticalPCA.maxDifference[i] = 0;
 }
 
 testTrackAssociator::~testTrackAssociator() {
 }
 
+namespace {
+  /// TrackingParticle index -> quality of the particles associated to track in association
+  std::map<unsigned int,double> associatedParticles(const reco::RecoToSimCollection& association, const RefToBase<Track>& track) {
+    std::map<unsigned int,double> particles;
+    reco::RecoToSimCollection::const_iterator found = association.find(track);
+    if (found==association.end()) return particles;
+    for (std::vector<std::pair<TrackingParticleRef, double> >::const_iterator it=found->val.begin(); it!=found->val.end(); ++it)
+      particles[it->first.index()] = it->second;
+    return particles;
+  }
+}
+
+void testTrackAssociator::endJob() {
+  for (std::vector<AssociatorComparison>::const_iterator c=comparisons.begin(); c!=comparisons.end(); ++c) {
+    cout << c->test << " vs " << c->reference << ": " << c->pairs << " pairs in " << c->reference
+	 << ", " << c->onlyInReference << " only in " << c->reference
+	 << ", " << c->onlyInTest << " only in " << c->test
+	 << ", " << c->differentQuality << " with a relative quality difference above " << c->relativeTolerance << endl;
+  }
+  if (!analyticalPCA.tolerances.empty()) {
+    cout << "analytical PCA vs TSCBLBuilderNoMaterial: " << analyticalPCA.particles << " charged TrackingParticles, "
+	 << analyticalPCA.differentStatus << " propagated by only one, " << analyticalPCA.outsideTolerance
+	 << " outside the tolerances, largest differences";
+    for (unsigned int i=0; i<5; i++) cout << " " << analyticalPCA.maxDifference[i];
+    cout << endl;
+  }
+  //after all the summaries, so that they are printed whichever comparison fails
+  for (std::vector<AssociatorComparison>::const_iterator c=comparisons.begin(); c!=comparisons.end(); ++c) {
+    if (c->sameAssociations && (c->onlyInReference || c->onlyInTest))
+      throw cms::Exception("TrackAssociatorComparison") << c->test << " and " << c->reference << " don't associate the same pairs: "
+							  << c->onlyInReference << " only in " << c->reference << ", "
+							  << c->onlyInTest << " only in " << c->test;
+  }
+}
+
 void testTrackAssociator::analyze(const edm::Event& event, const edm::EventSetup& setup)
 {
   
@@ -43,6 +104,9 @@ void testTrackAssociator::analyze(const edm::Event& event, const edm::EventSetup
   edm::ESHandle<TrackAssociatorBase> theHitsAssociator;
   setup.get<TrackAssociatorRecord>().get("TrackAssociatorByHits",theHitsAssociator);
   associatorByHits = (TrackAssociatorBase *) theHitsAssociator.product();
+  edm::ESHandle<TrackAssociatorBase> theHitsAndChi2Associator;
+  setup.get<TrackAssociatorRecord>().get("TrackAssociatorByHitsAndChi2",theHitsAndChi2Associator);
+  associatorByHitsAndChi2 = (TrackAssociatorBase *) theHitsAndChi2Associator.product();
 
   Handle<View<Track> > trackCollectionH;
   event.getByLabel(tracksTag,trackCollectionH);
@@ -108,6 +172,97 @@ void testTrackAssociator::analyze(const edm::Event& event, const edm::EventSetup
 	   <<  " matched to 0  MC Tracks" << endl;
     }
   }
+  cout << "-- Associator by hits and chi2 --" << endl;  
+  p = associatorByHitsAndChi2->associateRecoToSim (trackCollectionH,TPCollectionH,&event,&setup );
+  for(View<Track>::size_type i=0; i<tC.size(); ++i) {
+    RefToBase<Track> track(trackCollectionH, i);
+    try{ 
+      std::vector<std::pair<TrackingParticleRef, double> > tp = p[track];
+      cout << "Reco Track pT: "  << setw(6) << track->pt() 
+	   <<  " matched to " << tp.size() << " MC Tracks" << std::endl;
+      for (std::vector<std::pair<TrackingParticleRef, double> >::const_iterator it = tp.begin(); 
+	   it != tp.end(); ++it) {
+	TrackingParticleRef tpr = it->first;
+	double assocChi2 = it->second;
+	cout << "\t\tMCTrack " << setw(2) << tpr.index() << " pT: " << setw(6) << tpr->pt() << 
+	  " chi2: " << assocChi2 << endl;
+      }
+    } catch (Exception event) {
+      cout << "->   Track pT: " 
+	   << setprecision(2) << setw(6) << track->pt() 
+	   <<  " matched to 0  MC Tracks" << endl;
+    }
+  }
+  //the same RecoToSim association from two associators, e.g. in double and in single precision
+  for (std::vector<AssociatorComparison>::iterator c=comparisons.begin(); c!=comparisons.end(); ++c) {
+    edm::ESHandle<TrackAssociatorBase> reference, test;
+    setup.get<TrackAssociatorRecord>().get(c->reference,reference);
+    setup.get<TrackAssociatorRecord>().get(c->test,test);
+    reco::RecoToSimCollection referenceAssociation = reference->associateRecoToSim(trackCollectionH,TPCollectionH,&event,&setup);
+    reco::RecoToSimCollection testAssociation = test->associateRecoToSim(trackCollectionH,TPCollectionH,&event,&setup);
+    for(View<Track>::size_type i=0; i<tC.size(); ++i) {
+      RefToBase<Track> track(trackCollectionH, i);
+      std::map<unsigned int,double> referenceParticles = associatedParticles(referenceAssociation, track);
+      std::map<unsigned int,double> testParticles = associatedParticles(testAssociation, track);
+      c->pairs += referenceParticles.size();
+      for (std::map<unsigned int,double>::const_iterator r=referenceParticles.begin(); r!=referenceParticles.end(); ++r) {
+	std::map<unsigned int,double>::const_iterator t = testParticles.find(r->first);
+	if (t==testParticles.end()) {
+	  ++c->onlyInReference;
+	  cout << c->test << " vs " << c->reference << ": track " << i << " and TrackingParticle " << r->first
+	       << " only associated by " << c->reference << ", quality " << r->second << endl;
+	} else if (std::abs(t->second-r->second)>c->relativeTolerance*std::abs(r->second)) {
+	  ++c->differentQuality;
+	  cout << c->test << " vs " << c->reference << ": track " << i << " and TrackingParticle " << r->first
+	       << " quality " << t->second << " instead of " << r->second << endl;
+	}
+      }
+      for (std::map<unsigned int,double>::const_iterator t=testParticles.begin(); t!=testParticles.end(); ++t) {
+	if (referenceParticles.count(t->first)) continue;
+	++c->onlyInTest;
+	cout << c->test << " vs " << c->reference << ": track " << i << " and TrackingParticle " << t->first
+	     << " only associated by " << c->test << ", quality " << t->second << endl;
+      }
+    }
+  }
+
+  //closed form helix of useAnalyticalPCA against the propagation with TSCBLBuilderNoMaterial
+  if (!analyticalPCA.tolerances.empty()) {
+    const TrackAssociatorByChi2* chi2Associator = dynamic_cast<const TrackAssociatorByChi2*>(associatorByChi2);
+    if (!chi2Associator) throw cms::Exception("Configuration") << "TrackAssociatorByChi2 is not a TrackAssociatorByChi2";
+    Handle<reco::BeamSpot> beamSpot;
+    event.getByLabel(beamSpotTag, beamSpot);
+    for (TrackingParticleCollection::size_type i=0; i<tPC.size(); ++i) {
+      const TrackingParticle& tp = tPC[i];
+      if (tp.charge()==0) continue;
+      ++analyticalPCA.particles;
+      Basic3DVector<double> momAtVtx(tp.momentum().x(),tp.momentum().y(),tp.momentum().z());
+      Basic3DVector<double> vert(tp.vertex().x(),tp.vertex().y(),tp.vertex().z());
+      std::pair<bool,TrackBase::ParameterVector> propagated = chi2Associator->parametersAtClosestApproach(vert, momAtVtx, tp.charge(), *beamSpot);
+      std::pair<bool,TrackBase::ParameterVector> analytical = chi2Associator->analyticalParametersAtClosestApproach(vert, momAtVtx, tp.charge(), *beamSpot);
+      if (propagated.first!=analytical.first) {
+	++analyticalPCA.differentStatus;
+	cout << "TrackingParticle " << i << " pT: " << tp.pt() << (propagated.first ? " not" : " only")
+	     << " propagated by the analytical PCA" << endl;
+	continue;
+      }
+      if (!propagated.first) continue;
+      bool outside = false;
+      for (unsigned int j=0; j<5; j++) {
+	double difference = analytical.second[j]-propagated.second[j];
+	if (j==2) difference = reco::deltaPhi(difference,0.);
+	difference = std::abs(difference);
+	analyticalPCA.maxDifference[j] = std::max(analyticalPCA.maxDifference[j], difference);
+	outside |= difference>analyticalPCA.tolerances[j];
+      }
+      if (outside) {
+	++analyticalPCA.outsideTolerance;
+	cout << "TrackingParticle " << i << " pT: " << tp.pt() << " analytical PCA " << analytical.second
+	     << " TSCBLBuilderNoMaterial " << propagated.second << endl;
+      }
+    }
+  }
+
   //SIMTORECO
   cout << "                      ****************** Sim To Reco ****************** " << endl;
   cout << "-- Associator by hits --" << endl;  
@@ -151,6 +306,76 @@ void testTrackAssociator::analyze(const edm::Event& event, const edm::EventSetup
 	   <<  " matched to 0  reco::Tracks" << endl;
     }
   }
+  cout << "-- Associator by hits and chi2 --" << endl;  
+  q = associatorByHitsAndChi2->associateSimToReco(trackCollectionH,TPCollectionH,&event,&setup );
+  for(SimTrackContainer::size_type i=0; i<simTC.size(); ++i){
+    TrackingParticleRef tp (TPCollectionH,i);
+    try{ 
+      std::vector<std::pair<RefToBase<Track>, double> > trackV = q[tp];
+      cout << "Sim Track " << setw(2) << tp.index() << " pT: "  << setw(6) << tp->pt() 
+	   <<  " matched to " << trackV.size() << " reco::Tracks" << std::endl;
+      for (std::vector<std::pair<RefToBase<Track>,double> >::const_iterator it=trackV.begin(); it != trackV.end(); ++it) {
+	RefToBase<Track> tr = it->first;
+	double assocChi2 = it->second;
+	cout << "\t\treco::Track pT: " << setw(6) << tr->pt() << 
+	  " chi2: " << assocChi2 << endl;
+      }
+    } catch (Exception event) {
+      cout << "->   TrackingParticle " << setw(2) << tp.index() << " pT: " 
+	   <<setprecision(2)<<setw(6)<<tp->pt() 
+	   <<  " matched to 0  reco::Tracks" << endl;
+    }
+  }
+
+  //pulls of the pairs associated by a TrackAssociatorEDProducer with producePulls: one entry per pair of its RecoToSim
+  cout << "                      ****************** Products ****************** " << endl;
+  Handle<TrackParameterPulls> pulls;
+  event.getByLabel(pullsTag, pulls);
+  Handle<reco::RecoToSimCollection> pullsAssociation;
+  event.getByLabel(pullsTag, pullsAssociation);
+  unsigned int associatedPairs = 0, pairsWithoutPulls = 0;
+  for (reco::RecoToSimCollection::const_iterator it=pullsAssociation->begin(); it!=pullsAssociation->end(); ++it) {
+    for (std::vector<std::pair<TrackingParticleRef, double> >::const_iterator tp=it->val.begin(); tp!=it->val.end(); ++tp) {
+      ++associatedPairs;
+      const TrackParameterPulls::Entry* entry = pulls->find(it->key.key(), tp->first.key());
+      if (!entry) {
+	++pairsWithoutPulls;
+	cout << "reco::Track " << it->key.key() << " and MCTrack " << tp->first.key() << " have no pulls" << endl;
+	continue;
+      }
+      cout << "reco::Track " << setw(2) << it->key.key() << " MCTrack " << setw(2) << tp->first.key() << " pulls:";
+      for (unsigned int i=0; i<5; i++) cout << " " << entry->pulls[i];
+      cout << endl;
+    }
+  }
+  cout << "-- " << pullsTag.encode() << ": " << pulls->size() << " pulls for " << associatedPairs << " associated pairs, "
+       << pairsWithoutPulls << " pairs without pulls --" << endl;
+
+  //reference states of the position associators, made again here from the TrackingParticles
+  Handle<TrackingParticleReferenceStates> referenceStates;
+  event.getByLabel(referenceStatesTag, referenceStates);
+  edm::ESHandle<GlobalTrackingGeometry> geometry;
+  setup.get<GlobalTrackingGeometryRecord>().get(geometry);
+  if (referenceStates->trackingParticles()!=TPCollectionH.id() || referenceStates->size()!=tPC.size()) {
+    cout << "-- " << referenceStatesTag.encode() << " was made for other TrackingParticles --" << endl;
+  } else {
+    unsigned int withHit = 0, different = 0;
+    for (TrackingParticleCollection::size_type i=0; i<tPC.size(); ++i) {
+      TrackingParticleReferenceStates::Entry entry;
+      if (TrackingParticleReferenceStates::makeEntry(tPC[i], *geometry, referenceStates->positionMinimumDistance(),
+						      referenceStates->considerAllSimHits(), entry)) ++withHit;
+      const TrackingParticleReferenceStates::Entry& stored = (*referenceStates)[i];
+      bool same = entry.detId==stored.detId && entry.charge==stored.charge;
+      for (unsigned int j=0; j<3; j++) same &= entry.position[j]==stored.position[j] && entry.momentum[j]==stored.momentum[j];
+      if (!same) {
+	++different;
+	cout << "TrackingParticle " << i << " reference hit on " << stored.detId << " instead of " << entry.detId << endl;
+      }
+    }
+    cout << "-- " << referenceStatesTag.encode() << ": " << withHit << " of the " << tPC.size()
+	 << " TrackingParticles have a reference hit, " << different << " differ --" << endl;
+  }
+
 }
 
 
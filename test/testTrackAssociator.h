@@ -12,6 +12,7 @@
 #include <string>
 #include <map>
 #include <set>
+#include <vector>
 
 class TrackAssociatorBase;
 
@@ -22,11 +23,38 @@ class testTrackAssociator : public edm::EDAnalyzer {
   virtual ~testTrackAssociator();
   virtual void beginJob() {}  
   virtual void analyze(const edm::Event&, const edm::EventSetup&);
+  virtual void endJob();
   
+  /// two associators whose RecoToSim associations are compared pair by pair on every event,
+  /// e.g. TrackAssociatorByChi2 with and without useFloatPrecision; with sameAssociations, endJob
+  /// throws if a pair is associated by only one of them
+  struct AssociatorComparison {
+    std::string reference, test;
+    double relativeTolerance;
+    bool sameAssociations;
+    unsigned long pairs, onlyInReference, onlyInTest, differentQuality;
+  };
+
+  /// parameters at the beam line of the charged TrackingParticles from the closed form helix of
+  /// useAnalyticalPCA compared to those propagated by TrackAssociatorByChi2 with TSCBLBuilderNoMaterial;
+  /// the check is off if tolerances (qoverp, lambda, phi, dxy, dsz) is empty
+  struct AnalyticalPCAComparison {
+    std::vector<double> tolerances;
+    unsigned long particles, differentStatus, outsideTolerance;
+    double maxDifference[5];
+  };
+
  private:
   TrackAssociatorBase * associatorByChi2;
   TrackAssociatorBase * associatorByHits;
-  edm::InputTag tracksTag, tpTag, simtracksTag, simvtxTag;
+  TrackAssociatorBase * associatorByHitsAndChi2;
+  edm::InputTag tracksTag, tpTag, simtracksTag, simvtxTag, beamSpotTag;
+  /// TrackAssociatorEDProducer with producePulls, whose pulls are checked against its RecoToSim association
+  edm::InputTag pullsTag;
+  /// TrackingParticleReferenceStates, checked against the reference states made again from the TrackingParticles
+  edm::InputTag referenceStatesTag;
+  std::vector<AssociatorComparison> comparisons;
+  AnalyticalPCAComparison analyticalPCA;
 };
 
 #endif
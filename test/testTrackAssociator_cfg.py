@@ -0,0 +1,79 @@
+import FWCore.ParameterSet.Config as cms
+
+process = cms.Process("TestTrackAssociator")
+
+process.load("Configuration.StandardSequences.Services_cff")
+process.load("Configuration.StandardSequences.GeometryRecoDB_cff")
+process.load("Configuration.StandardSequences.MagneticField_cff")
+process.load("Configuration.StandardSequences.FrontierConditions_GlobalTag_cff")
+from Configuration.AlCa.autoCond import autoCond
+process.GlobalTag.globaltag = autoCond['startup']
+
+process.load("SimTracker.TrackAssociation.TrackAssociatorByChi2_cfi")
+process.load("SimTracker.TrackAssociation.TrackAssociatorByHits_cfi")
+process.load("SimTracker.TrackAssociation.TrackAssociatorByHitsAndChi2_cfi")
+process.load("SimTracker.TrackAssociation.recHitSimTrackIdMap_cfi")
+process.load("SimTracker.TrackAssociation.trackingParticleReferenceStates_cfi")
+process.load("SimTracker.TrackAssociation.trackingParticleRecoTrackAsssociation_cfi")
+
+# the chi2 association as event products, with the pulls of its pairs
+process.trackAssociatorByChi2Pulls = process.trackingParticleRecoTrackAsssociation.clone(
+    associator = 'TrackAssociatorByChi2',
+    producePulls = True
+)
+
+# the same associator in single precision, compared to the double precision one on every event
+process.TrackAssociatorByChi2Float = process.TrackAssociatorByChi2ESProducer.clone(
+    ComponentName = 'TrackAssociatorByChi2Float',
+    useFloatPrecision = True
+)
+
+# the closed form helix of useAnalyticalPCA, compared to the default TSCBLBuilderNoMaterial propagation
+process.TrackAssociatorByChi2AnalyticalPCA = process.TrackAssociatorByChi2ESProducer.clone(
+    ComponentName = 'TrackAssociatorByChi2AnalyticalPCA',
+    useAnalyticalPCA = True
+)
+
+process.maxEvents = cms.untracked.PSet(
+    input = cms.untracked.int32(100)
+)
+
+# RelValTTbar of the release: the tracks from GEN-SIM-RECO, the TrackingParticles and simhits from its parent files
+from PhysicsTools.PatAlgos.tools.cmsswVersionTools import pickRelValInputFiles
+process.source = cms.Source("PoolSource",
+    fileNames = cms.untracked.vstring(
+        pickRelValInputFiles(relVal = 'RelValTTbar', dataTier = 'GEN-SIM-RECO', condition = 'startup', numberOfFiles = 1)
+    ),
+    secondaryFileNames = cms.untracked.vstring(
+        pickRelValInputFiles(relVal = 'RelValTTbar', dataTier = 'GEN-SIM-DIGI-RAW-HLTDEBUG', condition = 'startup', numberOfFiles = 0)
+    )
+)
+
+process.testTrackAssociator = cms.EDAnalyzer("testTrackAssociator",
+    tracksTag = cms.InputTag("generalTracks"),
+    tpTag = cms.InputTag("mergedtruth","MergedTrackTruth"),
+    simtracksTag = cms.InputTag("g4SimHits"),
+    simvtxTag = cms.InputTag("g4SimHits"),
+    beamSpotTag = cms.InputTag("offlineBeamSpot"),
+    pullsTag = cms.InputTag("trackAssociatorByChi2Pulls"),
+    referenceStatesTag = cms.InputTag("trackingParticleReferenceStates"),
+    comparedAssociators = cms.VPSet(
+        cms.PSet(
+            reference = cms.string('TrackAssociatorByChi2'),
+            test = cms.string('TrackAssociatorByChi2Float'),
+            relativeTolerance = cms.double(1e-4),
+            # the single precision must not change any chi2cut decision
+            sameAssociations = cms.bool(True)
+        ),
+        cms.PSet(
+            reference = cms.string('TrackAssociatorByChi2'),
+            test = cms.string('TrackAssociatorByChi2AnalyticalPCA'),
+            relativeTolerance = cms.double(1e-2),
+            sameAssociations = cms.bool(False)
+        )
+    ),
+    # largest accepted |analytical - TSCBLBuilderNoMaterial| of qoverp, lambda, phi, dxy (cm) and dsz (cm)
+    analyticalPCATolerances = cms.vdouble(1e-4, 1e-4, 1e-4, 1e-3, 1e-3)
+)
+
+process.p = cms.Path(process.recHitSimTrackIdMap*process.trackingParticleReferenceStates*process.trackAssociatorByChi2Pulls*process.testTrackAssociator)